@@ -0,0 +1,178 @@
+/*
+ * PeerDrive
+ * Copyright (C) 2013  Jan Klötzke <jan DOT kloetzke AT freenet DOT de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QCoreApplication>
+#include <QEvent>
+#include <QSemaphore>
+#include <QThread>
+#include <errno.h>
+#include <stdlib.h>
+
+#include "benchmarks.h"
+
+/*
+ * Counts the heap allocations of the whole process by wrapping the allocator
+ * of the C library. Everything ends up there, including operator new, the
+ * allocations of Qt and of protobuf. The aligned variants are wrapped too,
+ * an aligned operator new ends up in them. Only available with glibc.
+ *
+ * QAtomicInt is only 32 bits wide, the counter uses the GCC builtins
+ * instead so that it cannot wrap during a long run.
+ */
+
+static volatile qint64 allocations = 0;
+static __thread bool ignored;
+
+static inline void countAllocation()
+{
+	if (!ignored)
+		__sync_fetch_and_add(&allocations, 1);
+}
+
+#if defined(__GLIBC__)
+
+extern "C" {
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void *__libc_valloc(size_t size);
+void *__libc_pvalloc(size_t size);
+
+void *malloc(size_t size) __THROW
+{
+	countAllocation();
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) __THROW
+{
+	countAllocation();
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) __THROW
+{
+	countAllocation();
+	return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size) __THROW
+{
+	countAllocation();
+	return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) __THROW
+{
+	countAllocation();
+	return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) __THROW
+{
+	if (!alignment || (alignment & (alignment - 1)) || alignment % sizeof(void*))
+		return EINVAL;
+
+	countAllocation();
+	void *mem = __libc_memalign(alignment, size);
+	if (!mem)
+		return ENOMEM;
+
+	*ptr = mem;
+	return 0;
+}
+
+void *valloc(size_t size) __THROW
+{
+	countAllocation();
+	return __libc_valloc(size);
+}
+
+void *pvalloc(size_t size) __THROW
+{
+	countAllocation();
+	return __libc_pvalloc(size);
+}
+
+}
+
+qint64 allocationCount()
+{
+	return __sync_fetch_and_add(&allocations, 0);
+}
+
+#else
+
+qint64 allocationCount()
+{
+	return -1;
+}
+
+#endif
+
+namespace {
+
+/*
+ * Sets the flag of the thread it lives in when it receives its event.
+ */
+class IgnoreAllocations : public QObject
+{
+public:
+	IgnoreAllocations(QSemaphore *done) : m_done(done) { }
+
+protected:
+	bool event(QEvent *e)
+	{
+		if (e->type() != QEvent::User)
+			return QObject::event(e);
+
+		ignored = true;
+		deleteLater();
+		m_done->release();
+		return true;
+	}
+
+private:
+	QSemaphore *m_done;
+};
+
+}
+
+void ignoreAllocations(QThread *thread)
+{
+	QSemaphore done;
+
+	IgnoreAllocations *obj = new IgnoreAllocations(&done);
+	obj->moveToThread(thread);
+	QCoreApplication::postEvent(obj, new QEvent(QEvent::User));
+	done.acquire();
+}
+
+/*
+ * Allocations per operation between two counts, or -1 if allocations are not
+ * counted.
+ */
+double allocationsPer(qint64 before, qint64 after, qint64 ops)
+{
+	if (before < 0 || ops <= 0)
+		return -1;
+
+	return (after - before) / (double)ops;
+}
@@ -0,0 +1,23 @@
+include(../global.pri)
+
+TEMPLATE = app
+CONFIG += console
+QT = core network
+
+TARGET = pdbench
+
+SOURCES += main.cpp
+SOURCES += allocs.cpp
+SOURCES += standin.cpp
+SOURCES += codec.cpp
+SOURCES += contention.cpp
+SOURCES += decode.cpp
+SOURCES += frames.cpp
+SOURCES += lanes.cpp
+SOURCES += suite.cpp
+SOURCES += transport.cpp
+HEADERS += benchmarks.h standin.h
+
+include(../tools/pdmockd/mockdaemon.pri)
+
+LIBS += -lprotobuf
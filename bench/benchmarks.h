@@ -0,0 +1,63 @@
+/*
+ * PeerDrive
+ * Copyright (C) 2013  Jan Klötzke <jan DOT kloetzke AT freenet DOT de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BENCH_BENCHMARKS_H
+#define BENCH_BENCHMARKS_H
+
+#include <QVector>
+#include <QtAlgorithms>
+
+class QStringList;
+class QThread;
+
+int bench_codec(const QStringList &args);
+int bench_contention(const QStringList &args);
+int bench_decode(const QStringList &args);
+int bench_device(const QStringList &args);
+int bench_frames(const QStringList &args);
+int bench_lanes(const QStringList &args);
+int bench_latency(const QStringList &args);
+int bench_read(const QStringList &args);
+int bench_suite(const QStringList &args);
+int bench_throughput(const QStringList &args);
+int bench_transport(const QStringList &args);
+
+/*
+ * Heap allocations of the process, see allocs.cpp. allocationCount() returns
+ * -1 if they are not counted on this platform. Threads that should not be
+ * counted, like an in-process mock daemon, can be excluded.
+ */
+qint64 allocationCount();
+void ignoreAllocations(QThread *thread);
+double allocationsPer(qint64 before, qint64 after, qint64 ops);
+
+/*
+ * Returns the p-th percentile (0..100) of the sampled values. The samples are
+ * sorted in place.
+ */
+inline qint64 percentile(QVector<qint64> &samples, double p)
+{
+	if (samples.isEmpty())
+		return 0;
+
+	qSort(samples);
+	int idx = (int)((samples.size() - 1) * p / 100.0 + 0.5);
+	return samples.at(idx);
+}
+
+#endif
@@ -0,0 +1,138 @@
+/*
+ * PeerDrive
+ * Copyright (C) 2013  Jan Klötzke <jan DOT kloetzke AT freenet DOT de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QElapsedTimer>
+#include <QStringList>
+#include <iostream>
+
+#include <peerdrive-qt/peerdrive_internal.h>
+
+#include "benchmarks.h"
+
+using namespace PeerDrive;
+
+/*
+ * Compares the generated protobuf code with the hand written codecs for the
+ * messages of Document::read() and RevInfo. Encoding includes building the
+ * request frame, decoding includes getting at the payload.
+ */
+
+static qint64 encodeGenerated(int count, const QString &attachment, int *bytes)
+{
+	QElapsedTimer timer;
+
+	*bytes = 0;
+	timer.start();
+	for (int i = 0; i < count; i++) {
+		ReadReq req;
+		req.set_handle(42);
+		req.set_part(attachment.toStdString());
+		req.set_offset((qint64)i << 14);
+		req.set_length(16384);
+
+		Request raw(req);
+		*bytes += raw.size();
+	}
+
+	return timer.nsecsElapsed();
+}
+
+static qint64 encodeCodec(int count, const QString &attachment, int *bytes)
+{
+	QElapsedTimer timer;
+
+	*bytes = 0;
+	timer.start();
+	QByteArray part = attachment.toAscii();
+	for (int i = 0; i < count; i++) {
+		ReadReqCodec req(42, part, (qint64)i << 14, 16384);
+
+		Request raw(req);
+		*bytes += raw.size();
+	}
+
+	return timer.nsecsElapsed();
+}
+
+template <typename C>
+static qint64 decode(int count, const std::string &raw, C &cnf)
+{
+	QElapsedTimer timer;
+
+	timer.start();
+	for (int i = 0; i < count; i++)
+		if (!cnf.ParseFromArray(raw.data(), raw.size()))
+			return -1;
+
+	return timer.nsecsElapsed();
+}
+
+int bench_codec(const QStringList &args)
+{
+	int count = args.size() > 2 ? args.at(2).toInt() : 1000000;
+	int payload = args.size() > 3 ? args.at(3).toInt() : 16384;
+	int genBytes, codecBytes;
+
+	qint64 encGen = encodeGenerated(count, "FILE", &genBytes);
+	qint64 encCodec = encodeCodec(count, "FILE", &codecBytes);
+
+	ReadCnf readCnf;
+	readCnf.set_data(std::string(payload, 'x'));
+	std::string rawRead = readCnf.SerializeAsString();
+
+	StatCnf statCnf;
+	statCnf.set_flags(0);
+	statCnf.mutable_data()->set_size(1234);
+	statCnf.mutable_data()->set_hash(std::string(16, 'h'));
+	for (int i = 0; i < 4; i++) {
+		StatCnf_Attachment *a = statCnf.add_attachments();
+		a->set_name(QString("ATT%1").arg(i).toStdString());
+		a->set_size(i << 20);
+		a->set_hash(std::string(16, 'a'));
+		a->set_crtime(Q_UINT64_C(1370000000000000));
+		a->set_mtime(Q_UINT64_C(1370000000000000));
+	}
+	statCnf.add_parents(std::string(16, 'p'));
+	statCnf.set_crtime(Q_UINT64_C(1370000000000000));
+	statCnf.set_mtime(Q_UINT64_C(1370000000000000));
+	statCnf.set_type_code("public.text");
+	statCnf.set_creator_code("org.peerdrive.bench");
+	std::string rawStat = statCnf.SerializeAsString();
+
+	ReadCnf genRead;
+	ReadCnfCodec codecRead;
+	StatCnf genStat;
+	StatCnfCodec codecStat;
+	qint64 decReadGen = decode(count, rawRead, genRead);
+	qint64 decReadCodec = decode(count, rawRead, codecRead);
+	qint64 decStatGen = decode(count, rawStat, genStat);
+	qint64 decStatCodec = decode(count, rawStat, codecStat);
+
+	std::cout << "messages:             " << count << "\n"
+	          << "ReadReq generated:    " << encGen / count << " ns\n"
+	          << "ReadReq codec:        " << encCodec / count << " ns\n"
+	          << "ReadCnf generated:    " << decReadGen / count << " ns ("
+	          << payload << " bytes)\n"
+	          << "ReadCnf codec:        " << decReadCodec / count << " ns\n"
+	          << "StatCnf generated:    " << decStatGen / count << " ns\n"
+	          << "StatCnf codec:        " << decStatCodec / count << " ns\n";
+
+	bool ok = genBytes == codecBytes && decReadGen >= 0 && decReadCodec >= 0 &&
+		decStatGen >= 0 && decStatCodec >= 0;
+	return ok ? 0 : 2;
+}
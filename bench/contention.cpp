@@ -0,0 +1,120 @@
+/*
+ * PeerDrive
+ * Copyright (C) 2013  Jan Klötzke <jan DOT kloetzke AT freenet DOT de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QElapsedTimer>
+#include <QStringList>
+#include <QThread>
+#include <ctime>
+#include <iostream>
+
+#include <peerdrive-qt/peerdrive_internal.h>
+
+#include "benchmarks.h"
+#include "standin.h"
+
+using namespace PeerDrive;
+
+namespace {
+
+/*
+ * Issues blocking RPCs back to back. Every confirmation wakes exactly one
+ * waiter if the completion signalling is per-request. With a broadcast every
+ * confirmation wakes all workers, which shows up as CPU time per RPC and tail
+ * latency growing with the number of threads.
+ */
+class Worker : public QThread
+{
+public:
+	Worker(int requests) : m_requests(requests) { }
+
+	QVector<qint64> latencies;
+	int errors;
+
+protected:
+	void run()
+	{
+		Connection *c = Connection::instance();
+		QByteArray req, cnf;
+		QElapsedTimer timer;
+
+		errors = 0;
+		latencies.reserve(m_requests);
+		for (int i = 0; i < m_requests; i++) {
+			timer.start();
+			if (c->rpc(PROGRESS_QUERY_MSG, req, cnf))
+				errors++;
+			latencies.append(timer.nsecsElapsed());
+		}
+	}
+
+private:
+	int m_requests;
+};
+
+}
+
+int bench_contention(const QStringList &args)
+{
+	int threads = args.size() > 2 ? args.at(2).toInt() : 16;
+	int requests = args.size() > 3 ? args.at(3).toInt() : 10000;
+	int connections = args.size() > 4 ? args.at(4).toInt() : 1;
+
+	StandInServer server;
+	useServer(server.address());
+	setConnectionPoolSize(connections);
+	if (!waitForConnected()) {
+		std::cerr << "stand-in server not reachable\n";
+		return 2;
+	}
+
+	QList<Worker*> workers;
+	for (int i = 0; i < threads; i++)
+		workers.append(new Worker(requests));
+
+	QElapsedTimer wall;
+	std::clock_t cpuStart = std::clock();
+	wall.start();
+
+	foreach (Worker *w, workers)
+		w->start();
+	foreach (Worker *w, workers)
+		w->wait();
+
+	qint64 wallNs = wall.nsecsElapsed();
+	double cpuMs = (std::clock() - cpuStart) * 1000.0 / CLOCKS_PER_SEC;
+
+	QVector<qint64> all;
+	int errors = 0;
+	foreach (Worker *w, workers) {
+		all += w->latencies;
+		errors += w->errors;
+		delete w;
+	}
+
+	int total = all.size();
+	std::cout << "threads:        " << threads << "\n"
+	          << "connections:    " << connectionPoolSize() << "\n"
+	          << "rpcs:           " << total << " (" << errors << " errors)\n"
+	          << "wall time:      " << wallNs / 1000000 << " ms\n"
+	          << "throughput:     " << (qint64)(total * 1e9 / wallNs) << " rpc/s\n"
+	          << "cpu per rpc:    " << (qint64)(cpuMs * 1000.0 / total) << " us\n"
+	          << "latency p50:    " << percentile(all, 50) / 1000 << " us\n"
+	          << "latency p99:    " << percentile(all, 99) / 1000 << " us\n";
+
+	return errors ? 2 : 0;
+}
@@ -0,0 +1,129 @@
+/*
+ * PeerDrive
+ * Copyright (C) 2013  Jan Klötzke <jan DOT kloetzke AT freenet DOT de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QElapsedTimer>
+#include <QStringList>
+#include <QtEndian>
+#include <iostream>
+
+#include <peerdrive-qt/peerdrive_internal.h>
+
+#include "benchmarks.h"
+
+using namespace PeerDrive;
+
+/*
+ * Decodes back-to-back frames as they would arrive from the socket in bursts
+ * of BURST bytes. The receive buffer of the library is compared with the
+ * former append/mid/remove scheme which moves the rest of the buffer for
+ * every decoded frame.
+ */
+
+static QByteArray makeStream(int frames, int payload)
+{
+	QByteArray stream;
+	stream.resize(frames * (payload + 8));
+
+	uchar *p = (uchar *)stream.data();
+	for (int i = 0; i < frames; i++) {
+		qToBigEndian((quint16)(6 + payload), p);
+		qToBigEndian((quint32)i, p + 2);
+		qToBigEndian((quint16)((READ_MSG << 4) | 1), p + 6);
+		memset(p + 8, i, payload);
+		p += payload + 8;
+	}
+
+	return stream;
+}
+
+static qint64 decodeRecvBuffer(const QByteArray &stream, int burst, int *count)
+{
+	RecvBuffer buf;
+	Frame frame;
+	quint32 sum = 0;
+	QElapsedTimer timer;
+
+	*count = 0;
+	timer.start();
+	for (int pos = 0; pos < stream.size(); pos += burst) {
+		int len = qMin(burst, stream.size() - pos);
+		memcpy(buf.reserve(len), stream.constData() + pos, len);
+		buf.commit(len);
+
+		while (buf.next(frame)) {
+			sum += qFromBigEndian<quint32>((const uchar *)frame.constData());
+			(*count)++;
+		}
+	}
+	qint64 elapsed = timer.nsecsElapsed();
+
+	Q_UNUSED(sum);
+	return elapsed;
+}
+
+static qint64 decodeLegacy(const QByteArray &stream, int burst, int *count)
+{
+	QByteArray buf;
+	quint32 sum = 0;
+	QElapsedTimer timer;
+
+	*count = 0;
+	timer.start();
+	for (int pos = 0; pos < stream.size(); pos += burst) {
+		buf.append(stream.constData() + pos, qMin(burst, stream.size() - pos));
+
+		while (buf.size() > 2) {
+			quint16 expect = qFromBigEndian<quint16>((const uchar *)buf.constData());
+			if (expect+2 > buf.size())
+				break;
+
+			QByteArray payload = buf.mid(8, expect-6);
+			sum += qFromBigEndian<quint32>((const uchar *)buf.constData() + 2);
+			sum += payload.size();
+			(*count)++;
+
+			buf.remove(0, expect+2);
+		}
+	}
+	qint64 elapsed = timer.nsecsElapsed();
+
+	Q_UNUSED(sum);
+	return elapsed;
+}
+
+int bench_decode(const QStringList &args)
+{
+	int frames = args.size() > 2 ? args.at(2).toInt() : 100000;
+	int payload = args.size() > 3 ? args.at(3).toInt() : 64;
+	int burst = args.size() > 4 ? args.at(4).toInt() : 65536;
+
+	QByteArray stream = makeStream(frames, payload);
+	int decoded, legacyDecoded;
+
+	qint64 ring = decodeRecvBuffer(stream, burst, &decoded);
+	qint64 legacy = decodeLegacy(stream, burst, &legacyDecoded);
+
+	std::cout << "frames:         " << frames << " x " << payload << " bytes\n"
+	          << "burst:          " << burst << " bytes\n"
+	          << "recv buffer:    " << ring / 1000 << " us ("
+	          << ring / qMax(decoded, 1) << " ns/frame)\n"
+	          << "append/remove:  " << legacy / 1000 << " us ("
+	          << legacy / qMax(legacyDecoded, 1) << " ns/frame)\n";
+
+	return (decoded == frames && legacyDecoded == frames) ? 0 : 2;
+}
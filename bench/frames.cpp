@@ -0,0 +1,94 @@
+/*
+ * PeerDrive
+ * Copyright (C) 2013  Jan Klötzke <jan DOT kloetzke AT freenet DOT de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QProcess>
+#include <QStringList>
+#include <iostream>
+
+#include <peerdrive-qt/peerdrive_internal.h>
+
+#include "benchmarks.h"
+#include "standin.h"
+
+using namespace PeerDrive;
+
+/*
+ * Reads an attachment through Document::read(). The number of round trips is
+ * bounded by the max_packet_size that the server offers, which in turn is
+ * limited by the frame format.
+ */
+int bench_read(const QStringList &args)
+{
+	qint64 size = (args.size() > 2 ? args.at(2).toLongLong() : 256) << 20;
+	unsigned int packet = args.size() > 3 ? args.at(3).toUInt() : 16384;
+	QString framing = args.size() > 4 ? args.at(4) : QString("legacy");
+
+	StandInServer server(packet, framing == "large");
+	useServer(server.address());
+
+	Document doc(Link(DId(QByteArray(16, 's')), RId(QByteArray(16, 'r'))));
+	if (!doc.peek()) {
+		std::cerr << "peek failed: " << doc.error() << "\n";
+		return 2;
+	}
+
+	unsigned int mps = Connection::instance()->maxPacketSize();
+	QByteArray data(qMin<qint64>(size, 16 << 20), 0);
+	QElapsedTimer timer;
+	qint64 done = 0;
+
+	timer.start();
+	while (done < size) {
+		qint64 len = doc.read("FILE", data.data(), qMin<qint64>(data.size(), size - done));
+		if (len <= 0) {
+			std::cerr << "read failed: " << doc.error() << "\n";
+			return 2;
+		}
+		done += len;
+	}
+	qint64 ns = timer.nsecsElapsed();
+
+	std::cout << qPrintable(framing.leftJustified(7)) << "packet: " << mps
+	          << "  rpcs: " << (size + mps - 1) / mps
+	          << "  time: " << ns / 1000000 << " ms"
+	          << "  throughput: " << (qint64)(size * 1e3 / ns) << " MB/s\n";
+
+	return 0;
+}
+
+int bench_frames(const QStringList &args)
+{
+	QString mbytes = args.size() > 2 ? args.at(2) : QString("256");
+	QString self = QCoreApplication::applicationFilePath();
+	int ret = 0;
+
+	// The first server does not know about large frames. The client has to
+	// fall back to the 16 bit framing there.
+	QList<QStringList> runs;
+	runs << (QStringList() << "read" << mbytes << "16384" << "legacy")
+	     << (QStringList() << "read" << mbytes << "1048576" << "large");
+
+	foreach (const QStringList &run, runs) {
+		int err = QProcess::execute(self, run);
+		if (err)
+			ret = err;
+	}
+
+	return ret;
+}
@@ -0,0 +1,135 @@
+/*
+ * PeerDrive
+ * Copyright (C) 2013  Jan Klötzke <jan DOT kloetzke AT freenet DOT de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <QElapsedTimer>
+#include <QSemaphore>
+#include <QStringList>
+#include <QThread>
+#include <iostream>
+
+#include <peerdrive-qt/peerdrive_internal.h>
+
+#include "benchmarks.h"
+#include "standin.h"
+
+using namespace PeerDrive;
+
+namespace {
+
+/*
+ * Keeps the connection saturated with large bulk frames, like a
+ * Document::write() of a huge attachment does.
+ */
+class BulkWriter : public QThread
+{
+public:
+	BulkWriter(int frameSize) : m_frameSize(frameSize), m_stop(false) { }
+
+	void stop() { m_stop = true; }
+	void waitForWindow() { m_filled.acquire(); }
+	qint64 bytes;
+
+protected:
+	void run()
+	{
+		PriorityScope scope(PriorityBulk);
+		Connection *c = Connection::instance();
+		QByteArray data(m_frameSize, 'x');
+		QList<PendingReply*> window;
+
+		bytes = 0;
+		while (!m_stop) {
+			while (window.size() < 32) {
+				Request req(data);
+				window.append(c->rpcAsync(WRITE_BUFFER_MSG, req));
+			}
+			if (!bytes)
+				m_filled.release();
+
+			PendingReply *reply = window.takeFirst();
+			reply->wait();
+			delete reply;
+			bytes += m_frameSize;
+		}
+
+		qDeleteAll(window);
+	}
+
+private:
+	int m_frameSize;
+	volatile bool m_stop;
+	QSemaphore m_filled;
+};
+
+}
+
+int bench_lanes(const QStringList &args)
+{
+	int requests = args.size() > 2 ? args.at(2).toInt() : 2000;
+	QString lane = args.size() > 3 ? args.at(3) : QString("interactive");
+
+	Priority priority;
+	if (lane == "interactive")
+		priority = PriorityInteractive;
+	else if (lane == "normal")
+		priority = PriorityNormal;
+	else if (lane == "bulk")
+		priority = PriorityBulk;
+	else {
+		std::cerr << "unknown priority: " << qPrintable(lane) << "\n";
+		return 1;
+	}
+
+	StandInServer server;
+	useServer(server.address());
+	Connection *c = Connection::instance();
+	if (!c->waitForReady()) {
+		std::cerr << "stand-in server not reachable\n";
+		return 2;
+	}
+
+	BulkWriter writer(c->maxPacketSize());
+	writer.start();
+	writer.waitForWindow();
+
+	PriorityScope scope(priority);
+	QByteArray req, cnf;
+	QVector<qint64> latencies;
+	QElapsedTimer timer, wall;
+	int errors = 0;
+
+	wall.start();
+	latencies.reserve(requests);
+	for (int i = 0; i < requests; i++) {
+		timer.start();
+		if (c->rpc(STAT_MSG, req, cnf))
+			errors++;
+		latencies.append(timer.nsecsElapsed());
+	}
+	qint64 wallNs = wall.nsecsElapsed();
+
+	writer.stop();
+	writer.wait();
+
+	std::cout << "priority:       " << qPrintable(lane) << "\n"
+	          << "rpcs:           " << requests << " (" << errors << " errors)\n"
+	          << "latency p50:    " << percentile(latencies, 50) / 1000 << " us\n"
+	          << "latency p99:    " << percentile(latencies, 99) / 1000 << " us\n"
+	          << "bulk MB/s:      " << (qint64)(writer.bytes * 1e3 / wallNs) << "\n";
+
+	return errors ? 2 : 0;
+}
@@ -0,0 +1,90 @@
+/*
+ * PeerDrive
+ * Copyright (C) 2013  Jan Klötzke <jan DOT kloetzke AT freenet DOT de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QCoreApplication>
+#include <QString>
+#include <QStringList>
+#include <iostream>
+
+#include "benchmarks.h"
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+struct cmd {
+	QString name;
+	int (*fun)(const QStringList &args);
+};
+
+static struct cmd benchmarks[] = {
+	{ "codec", bench_codec },
+	{ "contention", bench_contention },
+	{ "decode", bench_decode },
+	{ "device", bench_device },
+	{ "frames", bench_frames },
+	{ "lanes", bench_lanes },
+	{ "latency", bench_latency },
+	{ "read", bench_read },
+	{ "suite", bench_suite },
+	{ "throughput", bench_throughput },
+	{ "transport", bench_transport },
+};
+
+static const char *help =
+	"PeerDrive library benchmarks\n"
+	"\n"
+	"USAGE: pdbench BENCHMARK [ARGS]\n"
+	"\n"
+	"Available benchmarks:\n"
+	"    codec [COUNT] [SIZE]                   Generated vs. hand written message codecs\n"
+	"    contention [THREADS] [RPCS] [CONNS]    Concurrent blocking RPCs\n"
+	"    decode [FRAMES] [SIZE] [BURST]         Receive path frame decoding\n"
+	"    device [VALUES] [LATENCY]              QDataStream over an AttachmentDevice\n"
+	"    frames [MBYTES]                        Compare read throughput of 16/32 bit frames\n"
+	"    lanes [RPCS] [PRIORITY]                Metadata latency during a bulk upload\n"
+	"    latency [RPCS] [tcp|unix]              Blocking RPC round trip latency\n"
+	"    read [MBYTES] [PACKET] [legacy|large]  Attachment read throughput\n"
+	"    suite [RPCS] [OUTPUT]                  Full suite against the mock daemon, as JSON\n"
+	"    throughput [PACKET] [MBYTES] [DEPTH]   Document read/write throughput, as JSON\n"
+	"    transport [RPCS]                       Compare latency of TCP and unix sockets\n"
+	"\n"
+	"All benchmarks run against a local stand-in server or the mock daemon. No\n"
+	"daemon is needed.\n";
+
+int main(int argc, char** argv)
+{
+	QCoreApplication app(argc, argv);
+	QStringList arguments(QCoreApplication::arguments());
+
+	if (arguments.size() < 2) {
+		std::cerr << help;
+		return 1;
+	}
+
+	if (arguments.at(1) == "--help" || arguments.at(1) == "-h") {
+		std::cout << help;
+		return 0;
+	}
+
+	QString name = arguments.at(1);
+	for (unsigned int i = 0; i < ARRAY_SIZE(benchmarks); i++)
+		if (benchmarks[i].name == name)
+			return benchmarks[i].fun(arguments);
+
+	std::cerr << help;
+	return 1;
+}
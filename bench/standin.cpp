@@ -0,0 +1,218 @@
+/*
+ * PeerDrive
+ * Copyright (C) 2013  Jan Klötzke <jan DOT kloetzke AT freenet DOT de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QCoreApplication>
+#include <QDir>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QtEndian>
+
+#include <peerdrive-qt/peerdrive_internal.h>
+
+#include "standin.h"
+
+using namespace PeerDrive;
+
+StandInServer::StandInServer(unsigned int maxPacketSize, bool largeFrames,
+	QObject *parent)
+	: QThread(parent)
+	, m_maxPacketSize(maxPacketSize)
+	, m_largeFrames(largeFrames)
+	, m_port(0)
+{
+	QMutexLocker locker(&m_startupMutex);
+
+	start();
+	m_startupDone.wait(&m_startupMutex);
+}
+
+StandInServer::~StandInServer()
+{
+	exit();
+	wait();
+}
+
+QString StandInServer::address() const
+{
+	return QString("tcp://127.0.0.1:%1/00").arg(m_port);
+}
+
+QString StandInServer::localAddress() const
+{
+	return QString("unix://%1?00").arg(m_localPath);
+}
+
+void StandInServer::run()
+{
+	QTcpServer server;
+	StandInAcceptor acceptor(&server, m_maxPacketSize, m_largeFrames);
+	QLocalServer localServer;
+	StandInAcceptor localAcceptor(&localServer, m_maxPacketSize, m_largeFrames);
+
+	QString path = QDir::tempPath() + QString("/pdbench-%1.sock")
+		.arg(QCoreApplication::applicationPid());
+	QLocalServer::removeServer(path);
+
+	server.listen(QHostAddress::LocalHost, 0);
+	localServer.listen(path);
+
+	m_startupMutex.lock();
+	m_port = server.serverPort();
+	m_localPath = localServer.fullServerName();
+	m_startupDone.wakeAll();
+	m_startupMutex.unlock();
+
+	exec();
+
+	localServer.close();
+}
+
+StandInAcceptor::StandInAcceptor(QObject *server, unsigned int maxPacketSize,
+	bool largeFrames)
+	: QObject(server)
+	, m_maxPacketSize(maxPacketSize)
+	, m_largeFrames(largeFrames)
+{
+	connect(server, SIGNAL(newConnection()), this, SLOT(newConnection()));
+}
+
+void StandInAcceptor::newConnection()
+{
+	if (QTcpServer *server = qobject_cast<QTcpServer*>(parent())) {
+		while (server->hasPendingConnections()) {
+			QTcpSocket *socket = server->nextPendingConnection();
+			socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+			new StandInSession(socket, m_maxPacketSize, m_largeFrames);
+		}
+	} else if (QLocalServer *server = qobject_cast<QLocalServer*>(parent())) {
+		while (server->hasPendingConnections())
+			new StandInSession(server->nextPendingConnection(),
+				m_maxPacketSize, m_largeFrames);
+	}
+}
+
+StandInSession::StandInSession(QIODevice *socket, unsigned int maxPacketSize,
+	bool largeFrames)
+	: QObject(socket)
+	, m_socket(socket)
+	, m_maxPacketSize(maxPacketSize)
+	, m_largeFrames(largeFrames)
+	, m_large(false)
+{
+	connect(socket, SIGNAL(readyRead()), this, SLOT(readyRead()));
+	connect(socket, SIGNAL(disconnected()), socket, SLOT(deleteLater()));
+}
+
+void StandInSession::readyRead()
+{
+	m_buf.append(m_socket->readAll());
+
+	int pos = 0;
+	while (m_buf.size() - pos > 2) {
+		const uchar *frame = (const uchar *)m_buf.constData() + pos;
+		int header = 2;
+		int expect;
+
+		if (m_large && (*frame & 0x80)) {
+			if (m_buf.size() - pos < 4)
+				break;
+			header = 4;
+			expect = qFromBigEndian<quint32>(frame) & ~FRAME_LARGE;
+		} else
+			expect = qFromBigEndian<quint16>(frame);
+
+		if (pos + expect + header > m_buf.size())
+			break;
+
+		quint32 ref = qFromBigEndian<quint32>(frame + header);
+		quint16 msg = qFromBigEndian<quint16>(frame + header + 4);
+		if ((msg & 3) == FLAG_REQ)
+			handle(ref, msg >> 4, m_buf.mid(pos + header + 6, expect - 6));
+
+		pos += expect + header;
+	}
+
+	m_buf.remove(0, pos);
+}
+
+template <typename C>
+static QByteArray serialize(const C &cnf)
+{
+	QByteArray raw;
+	raw.resize(cnf.ByteSize());
+	cnf.SerializeWithCachedSizesToArray((google::protobuf::uint8*)raw.data());
+	return raw;
+}
+
+void StandInSession::handle(quint32 ref, int msg, const QByteArray &body)
+{
+	if (msg == INIT_MSG) {
+		InitReq req;
+		req.ParseFromArray(body.constData(), body.size());
+
+		InitCnf cnf;
+		cnf.set_major(2);
+		cnf.set_minor(0);
+		cnf.set_max_packet_size(m_maxPacketSize);
+		if (m_largeFrames && req.large_frames())
+			cnf.set_large_frames(true);
+		send(ref, msg, serialize(cnf));
+
+		// switch after the confirmation went out in the old format
+		m_large = cnf.large_frames();
+	} else if (msg == PEEK_MSG) {
+		PeekCnf cnf;
+		cnf.set_handle(1);
+		send(ref, msg, serialize(cnf));
+	} else if (msg == READ_MSG) {
+		ReadReq req;
+		req.ParseFromArray(body.constData(), body.size());
+
+		ReadCnf cnf;
+		cnf.mutable_data()->assign(qMin(req.length(), m_maxPacketSize), '\0');
+		send(ref, msg, serialize(cnf));
+	} else {
+		send(ref, msg, QByteArray());
+	}
+}
+
+void StandInSession::send(quint32 ref, int msg, const QByteArray &body)
+{
+	int len = 6 + body.size();
+	uchar header[10];
+	int offset = 0;
+
+	if (m_large && len > FRAME_SHORT_MAX) {
+		qToBigEndian((quint32)(FRAME_LARGE | len), header);
+	} else {
+		offset = 2;
+		qToBigEndian((quint16)len, header + 2);
+	}
+	qToBigEndian((quint32)ref, header + 4);
+	qToBigEndian((quint16)((msg << 4) | FLAG_CNF), header + 8);
+
+	m_socket->write((const char *)header + offset, 10 - offset);
+	m_socket->write(body);
+}
+
+void useServer(const QString &address)
+{
+	qputenv("PEERDRIVE", address.toLatin1());
+}
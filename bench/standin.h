@@ -0,0 +1,107 @@
+/*
+ * PeerDrive
+ * Copyright (C) 2013  Jan Klötzke <jan DOT kloetzke AT freenet DOT de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BENCH_STANDIN_H
+#define BENCH_STANDIN_H
+
+#include <QByteArray>
+#include <QMutex>
+#include <QString>
+#include <QThread>
+#include <QWaitCondition>
+
+class QIODevice;
+
+/*
+ * Minimal stand-in for the PeerDrive daemon. It completes the INIT handshake,
+ * opens every document as handle 1 and answers reads with zeros. Every other
+ * request is confirmed with an empty body. Large frames are only offered if
+ * enabled, otherwise the server behaves like an old daemon. It listens on TCP
+ * and on a unix domain socket. The server runs in its own thread so that it
+ * does not compete with the event loop of the client.
+ */
+class StandInServer : public QThread
+{
+	Q_OBJECT
+
+public:
+	StandInServer(unsigned int maxPacketSize = 16384, bool largeFrames = false,
+		QObject *parent = NULL);
+	~StandInServer();
+
+	QString address() const;
+	QString localAddress() const;
+
+protected:
+	void run();
+
+private:
+	unsigned int m_maxPacketSize;
+	bool m_largeFrames;
+	quint16 m_port;
+	QString m_localPath;
+
+	QMutex m_startupMutex;
+	QWaitCondition m_startupDone;
+};
+
+class StandInSession : public QObject
+{
+	Q_OBJECT
+
+public:
+	StandInSession(QIODevice *socket, unsigned int maxPacketSize,
+		bool largeFrames);
+
+private slots:
+	void readyRead();
+
+private:
+	void handle(quint32 ref, int msg, const QByteArray &body);
+	void send(quint32 ref, int msg, const QByteArray &body);
+
+	QIODevice *m_socket;
+	QByteArray m_buf;
+	unsigned int m_maxPacketSize;
+	bool m_largeFrames;
+	bool m_large;
+};
+
+class StandInAcceptor : public QObject
+{
+	Q_OBJECT
+
+public:
+	StandInAcceptor(QObject *server, unsigned int maxPacketSize,
+		bool largeFrames);
+
+private slots:
+	void newConnection();
+
+private:
+	unsigned int m_maxPacketSize;
+	bool m_largeFrames;
+};
+
+/*
+ * Points the PeerDrive library to the given server. Must be called before the
+ * first RPC is made.
+ */
+void useServer(const QString &address);
+
+#endif
@@ -0,0 +1,514 @@
+/*
+ * PeerDrive
+ * Copyright (C) 2013  Jan Klötzke <jan DOT kloetzke AT freenet DOT de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QCoreApplication>
+#include <QDataStream>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QProcess>
+#include <QStringList>
+#include <QThread>
+#include <iostream>
+
+#include <peerdrive-qt/attachmentdevice.h>
+#include <peerdrive-qt/peerdrive_internal.h>
+#include <mockdaemon.h>
+
+#include "benchmarks.h"
+#include "standin.h"
+
+using namespace PeerDrive;
+
+namespace {
+
+/*
+ * Collects the members of a flat JSON object.
+ */
+class JsonObject
+{
+public:
+	JsonObject &add(const char *key, qint64 value)
+	{
+		return addRaw(key, QString::number(value));
+	}
+
+	JsonObject &add(const char *key, double value)
+	{
+		return addRaw(key, QString::number(value, 'f', 2));
+	}
+
+	JsonObject &add(const char *key, const QString &value)
+	{
+		QString escaped = value;
+		escaped.replace('\\', "\\\\").replace('"', "\\\"");
+		return addRaw(key, '"' + escaped + '"');
+	}
+
+	JsonObject &addRaw(const char *key, const QString &value)
+	{
+		m_members << QString("\"%1\": %2").arg(key, value);
+		return *this;
+	}
+
+	QString toString() const
+	{
+		return "{ " + m_members.join(", ") + " }";
+	}
+
+private:
+	QStringList m_members;
+};
+
+QString jsonArray(const QStringList &elements)
+{
+	if (elements.isEmpty())
+		return "[]";
+
+	return "[\n    " + elements.join(",\n    ") + "\n  ]";
+}
+
+const char *Attachment = "FILE";
+
+/*
+ * Creates a document with a small structured data part which GET_DATA can
+ * select from. The library has no public API for that yet.
+ */
+bool createDocument(const DId &store, Link *link)
+{
+	Value data(Value::DICT);
+	data["org.peerdrive.annotation"]["title"] = Value(QString("pdbench"));
+
+	CreateReq createReq;
+	CreateCnf createCnf;
+	createReq.set_store(store.toStdString());
+	createReq.set_type_code("public.data");
+	createReq.set_creator_code("org.peerdrive.pdbench");
+	if (Connection::defaultRPC<CreateReq, CreateCnf>(CREATE_MSG, createReq, createCnf))
+		return false;
+
+	QByteArray raw = data.toByteArray();
+	SetDataReq setReq;
+	setReq.set_handle(createCnf.handle());
+	setReq.set_data(raw.constData(), raw.size());
+
+	CommitReq commitReq;
+	CommitCnf commitCnf;
+	commitReq.set_handle(createCnf.handle());
+
+	CloseReq closeReq;
+	closeReq.set_handle(createCnf.handle());
+
+	Error err = Connection::defaultRPC<SetDataReq>(SET_DATA_MSG, setReq);
+	if (!err)
+		err = Connection::defaultRPC<CommitReq, CommitCnf>(COMMIT_MSG, commitReq,
+			commitCnf);
+	Connection::defaultRPC<CloseReq>(CLOSE_MSG, closeReq);
+	if (err)
+		return false;
+
+	*link = Link(store, DId(createCnf.doc()), RId(commitCnf.rev()));
+	return true;
+}
+
+bool prepare(Link *link)
+{
+	if (!waitForConnected()) {
+		std::cerr << "mock daemon not reachable\n";
+		return false;
+	}
+
+	Mounts mounts;
+	Mounts::Store *store = mounts.fromLabel("user");
+	if (!store || !createDocument(store->sid, link)) {
+		std::cerr << "cannot create benchmark document\n";
+		return false;
+	}
+
+	return true;
+}
+
+QString latencyResult(const char *op, QVector<qint64> &samples, int errors,
+	double allocs)
+{
+	qint64 sum = 0;
+	foreach (qint64 s, samples)
+		sum += s;
+
+	return JsonObject()
+		.add("op", QString(op))
+		.add("samples", (qint64)samples.size())
+		.add("errors", (qint64)errors)
+		.add("mean_us", sum / qMax(samples.size(), 1) / 1000.0)
+		.add("p50_us", percentile(samples, 50) / 1000.0)
+		.add("p99_us", percentile(samples, 99) / 1000.0)
+		.add("allocs_per_rpc", allocs)
+		.toString();
+}
+
+QStringList measureLatency(const Link &link, int rpcs)
+{
+	QList<DId> stores;
+	stores << link.store();
+	QVector<qint64> samples;
+	QElapsedTimer timer;
+	QStringList results;
+	qint64 allocs;
+	int errors;
+
+	// resize(0) keeps the reserved memory, clear() would free it
+	samples.reserve(rpcs);
+
+	errors = 0;
+	allocs = allocationCount();
+	for (int i = 0; i < rpcs; i++) {
+		timer.start();
+		RevInfo info(link.rev(), stores);
+		samples.append(timer.nsecsElapsed());
+		if (info.error())
+			errors++;
+	}
+	results << latencyResult("STAT", samples, errors,
+		allocationsPer(allocs, allocationCount(), rpcs));
+
+	samples.resize(0);
+	errors = 0;
+	allocs = allocationCount();
+	for (int i = 0; i < rpcs; i++) {
+		Document doc(link);
+		timer.start();
+		if (!doc.peek())
+			errors++;
+		doc.close();
+		samples.append(timer.nsecsElapsed());
+	}
+	if (flushRequests())
+		errors++;
+	results << latencyResult("PEEK+CLOSE", samples, errors,
+		allocationsPer(allocs, allocationCount(), rpcs));
+
+	samples.resize(0);
+	errors = 0;
+	Document doc(link);
+	allocs = allocationCount();
+	if (doc.peek()) {
+		for (int i = 0; i < rpcs; i++) {
+			timer.start();
+			doc.get("org.peerdrive.annotation/title");
+			samples.append(timer.nsecsElapsed());
+			if (doc.error())
+				errors++;
+		}
+	} else
+		errors = rpcs;
+	results << latencyResult("GET_DATA", samples, errors,
+		allocationsPer(allocs, allocationCount(), rpcs));
+
+	return results;
+}
+
+class StatWorker : public QThread
+{
+public:
+	StatWorker(const Link &link, int requests)
+		: errors(0), m_link(link), m_requests(requests) { }
+
+	QVector<qint64> latencies;
+	int errors;
+
+protected:
+	void run()
+	{
+		QList<DId> stores;
+		stores << m_link.store();
+		QElapsedTimer timer;
+
+		latencies.reserve(m_requests);
+		for (int i = 0; i < m_requests; i++) {
+			timer.start();
+			RevInfo info(m_link.rev(), stores);
+			latencies.append(timer.nsecsElapsed());
+			if (info.error())
+				errors++;
+		}
+	}
+
+private:
+	Link m_link;
+	int m_requests;
+};
+
+QStringList measureScaling(const Link &link, int rpcs, int maxThreads)
+{
+	QStringList results;
+
+	for (int threads = 1; threads <= maxThreads; threads *= 2) {
+		QList<StatWorker*> workers;
+		for (int i = 0; i < threads; i++)
+			workers.append(new StatWorker(link, rpcs / threads));
+
+		QElapsedTimer wall;
+		wall.start();
+		foreach (StatWorker *w, workers)
+			w->start();
+		foreach (StatWorker *w, workers)
+			w->wait();
+		qint64 wallNs = wall.nsecsElapsed();
+
+		QVector<qint64> all;
+		int errors = 0;
+		foreach (StatWorker *w, workers) {
+			all += w->latencies;
+			errors += w->errors;
+			delete w;
+		}
+
+		results << JsonObject()
+			.add("threads", (qint64)threads)
+			.add("rpcs", (qint64)all.size())
+			.add("errors", (qint64)errors)
+			.add("rpc_per_s", all.size() * 1e9 / wallNs)
+			.add("p50_us", percentile(all, 50) / 1000.0)
+			.add("p99_us", percentile(all, 99) / 1000.0)
+			.toString();
+	}
+
+	return results;
+}
+
+}
+
+/*
+ * Measures Document::write and Document::read throughput for different
+ * attachment sizes with the given packet size. Every result is printed as a
+ * JSON object on a line of its own.
+ */
+int bench_throughput(const QStringList &args)
+{
+	MockOptions options;
+	options.maxPacketSize = args.size() > 2 ? args.at(2).toUInt() : 16384;
+	qint64 volume = (args.size() > 3 ? args.at(3).toLongLong() : 64) << 20;
+	int depth = args.size() > 4 ? args.at(4).toInt() : Document::DefaultPipelineDepth;
+
+	MockDaemon daemon(options);
+	useServer(daemon.address());
+
+	Link link;
+	if (!prepare(&link))
+		return 2;
+
+	unsigned int mps = Connection::instance()->maxPacketSize();
+	QList<qint64> sizes;
+	sizes << 4096 << 65536 << (1 << 20) << (16 << 20);
+
+	foreach (qint64 size, sizes) {
+		QByteArray data(size, 'x');
+		int iterations = qMax<qint64>(1, volume / size);
+		qint64 writeNs = 0, readNs = 0;
+		int errors = 0;
+		QElapsedTimer timer;
+
+		Document doc(link);
+		doc.setPipelineDepth(depth);
+		for (int i = 0; i < iterations; i++) {
+			if (!doc.update()) {
+				errors++;
+				break;
+			}
+			timer.start();
+			if (!doc.write(Attachment, data.constData(), size))
+				errors++;
+			writeNs += timer.nsecsElapsed();
+			if (!doc.commit())
+				errors++;
+			doc.close();
+		}
+
+		if (doc.peek()) {
+			for (int i = 0; i < iterations; i++) {
+				doc.seek(Attachment, 0);
+				timer.start();
+				if (doc.read(Attachment, data.data(), size) != size)
+					errors++;
+				readNs += timer.nsecsElapsed();
+			}
+			doc.close();
+		} else
+			errors++;
+
+		qint64 bytes = size * iterations;
+		std::cout << qPrintable(JsonObject()
+			.add("op", QString("write"))
+			.add("packet", (qint64)mps)
+			.add("depth", (qint64)doc.pipelineDepth())
+			.add("size", size)
+			.add("iterations", (qint64)iterations)
+			.add("errors", (qint64)errors)
+			.add("mb_per_s", bytes * 1e3 / qMax<qint64>(writeNs, 1))
+			.toString()) << "\n";
+		std::cout << qPrintable(JsonObject()
+			.add("op", QString("read"))
+			.add("packet", (qint64)mps)
+			.add("depth", (qint64)doc.pipelineDepth())
+			.add("size", size)
+			.add("iterations", (qint64)iterations)
+			.add("errors", (qint64)errors)
+			.add("mb_per_s", bytes * 1e3 / qMax<qint64>(readNs, 1))
+			.toString()) << "\n";
+	}
+
+	return 0;
+}
+
+/*
+ * Streams small values through an AttachmentDevice with QDataStream and
+ * compares reading them back with plain Document::read() calls of the same
+ * size. The mock daemon may add a latency to show the effect of the link.
+ */
+int bench_device(const QStringList &args)
+{
+	int count = args.size() > 2 ? args.at(2).toInt() : 1000000;
+	MockOptions options;
+	options.latency = args.size() > 3 ? args.at(3).toInt() : 0;
+
+	MockDaemon daemon(options);
+	useServer(daemon.address());
+
+	Link link;
+	if (!prepare(&link))
+		return 2;
+
+	Document doc(link);
+	QElapsedTimer timer;
+	int errors = 0;
+
+	if (!doc.update())
+		return 2;
+	AttachmentDevice dev(&doc, Attachment);
+	dev.open(QIODevice::WriteOnly | QIODevice::Truncate);
+	timer.start();
+	QDataStream out(&dev);
+	for (int i = 0; i < count; i++)
+		out << (quint32)i;
+	dev.close();
+	qint64 writeNs = timer.nsecsElapsed();
+	if (dev.error() || !doc.commit())
+		errors++;
+	doc.close();
+
+	if (!doc.peek())
+		return 2;
+	dev.open(QIODevice::ReadOnly);
+	timer.start();
+	QDataStream in(&dev);
+	for (int i = 0; i < count; i++) {
+		quint32 value;
+		in >> value;
+		if (value != (quint32)i)
+			errors++;
+	}
+	qint64 readNs = timer.nsecsElapsed();
+	dev.close();
+
+	// unbuffered reads are way slower, only do a few of them
+	int rawCount = qMin(count, 10000);
+	doc.seek(Attachment, 0);
+	timer.start();
+	for (int i = 0; i < rawCount; i++) {
+		quint32 value;
+		if (doc.read(Attachment, (char *)&value, sizeof(value)) != sizeof(value))
+			errors++;
+	}
+	qint64 rawNs = timer.nsecsElapsed();
+	doc.close();
+
+	std::cout << qPrintable(JsonObject()
+		.add("values", (qint64)count)
+		.add("latency_us", (qint64)options.latency)
+		.add("errors", (qint64)errors)
+		.add("device_write_ns", writeNs / (double)qMax(count, 1))
+		.add("device_read_ns", readNs / (double)qMax(count, 1))
+		.add("document_read_ns", rawNs / (double)qMax(rawCount, 1))
+		.toString()) << "\n";
+
+	return errors ? 2 : 0;
+}
+
+int bench_suite(const QStringList &args)
+{
+	int rpcs = args.size() > 2 ? args.at(2).toInt() : 10000;
+	QString output = args.size() > 3 ? args.at(3) : QString();
+	int ret = 0;
+
+	// The packet size is negotiated once per process. Every packet size is
+	// hence measured by a process of its own.
+	QString self = QCoreApplication::applicationFilePath();
+	QStringList throughput;
+	foreach (const QString &packet, QStringList() << "4096" << "16384" << "65536"
+	         << "1048576") {
+		QProcess child;
+		child.start(self, QStringList() << "throughput" << packet);
+		bool finished = child.waitForFinished(-1);
+		std::cerr << child.readAllStandardError().constData();
+		if (!finished || child.exitCode()) {
+			std::cerr << "throughput run failed for packet size "
+			          << qPrintable(packet) << "\n";
+			ret = 2;
+			continue;
+		}
+
+		foreach (const QByteArray &line, child.readAllStandardOutput().split('\n'))
+			if (line.startsWith('{'))
+				throughput << QString::fromUtf8(line);
+	}
+
+	MockDaemon daemon;
+	ignoreAllocations(&daemon);
+	useServer(daemon.address());
+
+	Link link;
+	if (!prepare(&link))
+		return 2;
+
+	QStringList latency = measureLatency(link, rpcs);
+	QStringList scaling = measureScaling(link, rpcs, 16);
+
+	QString report = QString(
+		"{\n"
+		"  \"timestamp\": \"%1\",\n"
+		"  \"rpcs\": %2,\n"
+		"  \"latency\": %3,\n"
+		"  \"throughput\": %4,\n"
+		"  \"scaling\": %5\n"
+		"}\n").arg(QDateTime::currentDateTime().toUTC().toString(Qt::ISODate),
+		QString::number(rpcs), jsonArray(latency), jsonArray(throughput),
+		jsonArray(scaling));
+
+	if (output.isEmpty()) {
+		std::cout << qPrintable(report);
+	} else {
+		QFile file(output);
+		if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+			std::cerr << "cannot write " << qPrintable(output) << "\n";
+			return 2;
+		}
+		file.write(report.toUtf8());
+	}
+
+	return ret;
+}
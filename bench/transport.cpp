@@ -0,0 +1,93 @@
+/*
+ * PeerDrive
+ * Copyright (C) 2013  Jan Klötzke <jan DOT kloetzke AT freenet DOT de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QProcess>
+#include <QStringList>
+#include <iostream>
+
+#include <peerdrive-qt/peerdrive_internal.h>
+
+#include "benchmarks.h"
+#include "standin.h"
+
+using namespace PeerDrive;
+
+/*
+ * Round trip latency of blocking RPCs over one transport. The connection is
+ * a process wide singleton, so every transport is measured in a process of
+ * its own (see bench_transport).
+ */
+int bench_latency(const QStringList &args)
+{
+	int requests = args.size() > 2 ? args.at(2).toInt() : 20000;
+	QString transport = args.size() > 3 ? args.at(3) : QString("tcp");
+
+	StandInServer server;
+	if (transport == "unix")
+		useServer(server.localAddress());
+	else if (transport == "tcp")
+		useServer(server.address());
+	else {
+		std::cerr << "unknown transport: " << qPrintable(transport) << "\n";
+		return 1;
+	}
+
+	Connection *c = Connection::instance();
+	QByteArray req, cnf;
+	QVector<qint64> latencies;
+	QElapsedTimer timer;
+	int errors = 0;
+
+	latencies.reserve(requests);
+	for (int i = 0; i < requests; i++) {
+		timer.start();
+		if (c->rpc(PROGRESS_QUERY_MSG, req, cnf))
+			errors++;
+		latencies.append(timer.nsecsElapsed());
+	}
+
+	qint64 sum = 0;
+	foreach (qint64 l, latencies)
+		sum += l;
+
+	std::cout << qPrintable(transport.leftJustified(6)) << "rpcs: " << requests
+	          << "  errors: " << errors
+	          << "  mean: " << sum / qMax(requests, 1) / 1000 << " us"
+	          << "  p50: " << percentile(latencies, 50) / 1000 << " us"
+	          << "  p99: " << percentile(latencies, 99) / 1000 << " us\n";
+
+	return errors ? 2 : 0;
+}
+
+int bench_transport(const QStringList &args)
+{
+	QString rpcs = args.size() > 2 ? args.at(2) : QString("20000");
+	QString self = QCoreApplication::applicationFilePath();
+	int ret = 0;
+
+	foreach (const QString &transport, QStringList() << "tcp" << "unix") {
+		int err = QProcess::execute(self, QStringList() << "latency" << rpcs
+			<< transport);
+		if (err)
+			ret = err;
+	}
+
+	return ret;
+}
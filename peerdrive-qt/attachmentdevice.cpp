@@ -0,0 +1,269 @@
+/*
+ * This file is part of the PeerDrive Qt4 library.
+ * Copyright (C) 2013  Jan Klötzke <jan DOT kloetzke AT freenet DOT de>
+ *
+ * PeerDrive is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * PeerDrive is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with PeerDrive. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QtDebug>
+#include <string.h>
+
+#include "attachmentdevice.h"
+
+using namespace PeerDrive;
+
+static QString errorText(Error err)
+{
+	return QString("PeerDrive error %1").arg(err);
+}
+
+AttachmentDevice::AttachmentDevice(Document *doc, const QString &attachment,
+	QObject *parent)
+	: QIODevice(parent)
+	, m_doc(doc)
+	, m_attachment(attachment)
+	, m_size(0)
+	, m_error(ErrNoError)
+	, m_readOffset(-1)
+	, m_readLen(0)
+	, m_readAhead(MinReadAhead)
+	, m_writeOffset(0)
+	, m_writeLen(0)
+{
+}
+
+AttachmentDevice::~AttachmentDevice()
+{
+	close();
+}
+
+/*
+ * The device keeps its own buffers, hence it is always opened unbuffered.
+ * Truncate empties the attachment, Append starts at its end.
+ */
+bool AttachmentDevice::open(OpenMode mode)
+{
+	RevInfo info = m_doc->info();
+	if (!info.exists()) {
+		setError(ErrBadF);
+		return false;
+	}
+
+	m_size = info.attachmentSize(m_attachment);
+	if (mode & Truncate) {
+		if (!m_doc->resize(m_attachment, 0)) {
+			setError(m_doc->error());
+			return false;
+		}
+		m_size = 0;
+	}
+
+	m_error = ErrNoError;
+	m_readOffset = -1;
+	m_readLen = 0;
+	m_readAhead = MinReadAhead;
+	m_writeLen = 0;
+
+	if (!QIODevice::open(mode | Unbuffered))
+		return false;
+
+	if (mode & Append)
+		QIODevice::seek(m_size);
+
+	return true;
+}
+
+void AttachmentDevice::close()
+{
+	if (!isOpen())
+		return;
+
+	// QIODevice::close() clears the error string
+	bool flushed = flush();
+	QIODevice::close();
+	if (!flushed)
+		setErrorString(errorText(m_error));
+
+	m_readBuf = QByteArray();
+	m_writeBuf = QByteArray();
+}
+
+qint64 AttachmentDevice::size() const
+{
+	return m_size;
+}
+
+/*
+ * Writes out the collected writes. They are kept if that fails.
+ */
+bool AttachmentDevice::flush()
+{
+	if (!m_writeLen)
+		return true;
+
+	if (!writeAt(m_writeOffset, m_writeBuf.constData(), m_writeLen))
+		return false;
+
+	m_writeLen = 0;
+	return true;
+}
+
+Error AttachmentDevice::error() const
+{
+	return m_error;
+}
+
+qint64 AttachmentDevice::readData(char *data, qint64 maxSize)
+{
+	// the reads must see what was written before
+	if (!flush())
+		return -1;
+
+	qint64 pos = this->pos();
+	qint64 done = 0;
+
+	while (done < maxSize) {
+		qint64 offset = pos + done;
+
+		if (offset >= m_readOffset && offset < m_readOffset + m_readLen) {
+			int start = offset - m_readOffset;
+			int len = qMin<qint64>(maxSize - done, m_readLen - start);
+			memcpy(data + done, m_readBuf.constData() + start, len);
+			done += len;
+			continue;
+		}
+
+		if (offset >= m_size)
+			break;
+
+		// the read-ahead grows while the reads continue where the last
+		// one ended
+		if (offset == m_readOffset + m_readLen)
+			m_readAhead = qMin(m_readAhead * 2, (int)MaxReadAhead);
+		else
+			m_readAhead = MinReadAhead;
+
+		if (maxSize - done >= m_readAhead) {
+			qint64 len = readAt(offset, data + done, maxSize - done);
+			if (len < 0)
+				return done ? done : -1;
+
+			// keeps the position for the detection of sequential reads
+			m_readOffset = offset + len;
+			m_readLen = 0;
+			done += len;
+			break;
+		}
+
+		if (!fill(offset))
+			return done ? done : -1;
+		if (!m_readLen)
+			break;
+	}
+
+	return done;
+}
+
+qint64 AttachmentDevice::writeData(const char *data, qint64 maxSize)
+{
+	qint64 pos = this->pos();
+	qint64 done = 0;
+
+	// the read-ahead might overlap
+	m_readOffset = -1;
+	m_readLen = 0;
+
+	if (m_writeLen && pos != m_writeOffset + m_writeLen && !flush())
+		return -1;
+
+	// A full buffer is only written out when more data follows. Everything
+	// that is reported as written is either in the buffer or at the daemon.
+	while (done < maxSize) {
+		if (m_writeLen == WriteBufferSize && !flush())
+			break;
+
+		if (!m_writeLen && maxSize - done >= WriteBufferSize) {
+			if (!writeAt(pos + done, data + done, maxSize - done))
+				break;
+			done = maxSize;
+			break;
+		}
+
+		if (!m_writeLen) {
+			if (m_writeBuf.isEmpty())
+				m_writeBuf.resize(WriteBufferSize);
+			m_writeOffset = pos + done;
+		}
+
+		int len = qMin<qint64>(maxSize - done, WriteBufferSize - m_writeLen);
+		memcpy(m_writeBuf.data() + m_writeLen, data + done, len);
+		m_writeLen += len;
+		done += len;
+	}
+
+	if (!done && maxSize)
+		return -1;
+
+	m_size = qMax(m_size, pos + done);
+	return done;
+}
+
+/*
+ * Refills the read-ahead buffer at the given offset.
+ */
+bool AttachmentDevice::fill(qint64 offset)
+{
+	if (m_readBuf.size() < m_readAhead)
+		m_readBuf.resize(m_readAhead);
+
+	qint64 len = readAt(offset, m_readBuf.data(), m_readAhead);
+	if (len < 0) {
+		m_readOffset = -1;
+		m_readLen = 0;
+		return false;
+	}
+
+	m_readOffset = offset;
+	m_readLen = len;
+	return true;
+}
+
+qint64 AttachmentDevice::readAt(qint64 offset, char *data, qint64 size)
+{
+	m_doc->seek(m_attachment, offset);
+	qint64 len = m_doc->read(m_attachment, data, size);
+	if (len < 0)
+		setError(m_doc->error());
+
+	return len;
+}
+
+bool AttachmentDevice::writeAt(qint64 offset, const char *data, qint64 size)
+{
+	m_doc->seek(m_attachment, offset);
+	if (!m_doc->write(m_attachment, data, size)) {
+		setError(m_doc->error());
+		return false;
+	}
+
+	m_size = qMax(m_size, offset + size);
+	return true;
+}
+
+void AttachmentDevice::setError(Error err)
+{
+	m_error = err;
+	setErrorString(errorText(err));
+	qDebug() << "::PeerDrive::AttachmentDevice:" << m_attachment << "failed:" << err;
+}
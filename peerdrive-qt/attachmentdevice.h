@@ -0,0 +1,90 @@
+/*
+ * This file is part of the PeerDrive Qt4 library.
+ * Copyright (C) 2013  Jan Klötzke <jan DOT kloetzke AT freenet DOT de>
+ *
+ * PeerDrive is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * PeerDrive is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with PeerDrive. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef PEERDRIVE_ATTACHMENTDEVICE_H
+#define PEERDRIVE_ATTACHMENTDEVICE_H
+
+#include <QByteArray>
+#include <QIODevice>
+#include <QString>
+
+#include "peerdrive.h"
+
+namespace PeerDrive {
+
+/*
+ * Random access QIODevice on an attachment of an open Document, e.g. for
+ * QImageReader, QTextStream or QDataStream. The document must stay open as
+ * long as the device is used.
+ *
+ * Small reads are served from a read-ahead buffer. The read-ahead doubles
+ * with every refill while the attachment is read sequentially and starts
+ * small again after a seek. Reads bigger than the read-ahead go straight to
+ * the destination. Consecutive writes are collected and written out once
+ * the buffer is full, on flush(), on a read and on close(). Collected data
+ * that could not be written is kept for the next flush(). If close() cannot
+ * write it the data is lost and error() and errorString() tell why.
+ */
+class AttachmentDevice : public QIODevice
+{
+	Q_OBJECT
+
+public:
+	AttachmentDevice(Document *doc, const QString &attachment, QObject *parent = 0);
+	~AttachmentDevice();
+
+	bool open(OpenMode mode);
+	void close();
+	qint64 size() const;
+	bool flush();
+
+	Error error() const;
+
+protected:
+	qint64 readData(char *data, qint64 maxSize);
+	qint64 writeData(const char *data, qint64 maxSize);
+
+private:
+	enum {
+		MinReadAhead = 16 * 1024,
+		MaxReadAhead = 1024 * 1024,
+		WriteBufferSize = 1024 * 1024
+	};
+
+	bool fill(qint64 offset);
+	qint64 readAt(qint64 offset, char *data, qint64 size);
+	bool writeAt(qint64 offset, const char *data, qint64 size);
+	void setError(Error err);
+
+	Document *m_doc;
+	QString m_attachment;
+	qint64 m_size;
+	Error m_error;
+
+	QByteArray m_readBuf;
+	qint64 m_readOffset;
+	int m_readLen;
+	int m_readAhead;
+
+	QByteArray m_writeBuf;
+	qint64 m_writeOffset;
+	int m_writeLen;
+};
+
+}
+
+#endif
@@ -809,6 +809,10 @@ void FolderGatherer::flush()
 
 void FolderGatherer::run()
 {
+	// the view is waiting for us
+	PriorityScope scope(PriorityInteractive);
+	StatsTag tag("FolderModel");
+
 	forever {
 		QMutexLocker locker(&mutex);
 
@@ -846,6 +850,7 @@ void FolderGatherer::getItemInfos(const Link &item)
 	FolderInfo info;
 	RevInfo stat(item.rev(), QList<DId>() << store);
 	Document file(item);
+	file.setPriority(PriorityInteractive);
 
 	info.link = item;
 	info.exists = stat.exists();
@@ -366,7 +366,10 @@ void Registry::modified(const Link &item)
 	if (item.store() != link.store())
 		return;
 
+	PriorityScope scope(PriorityInteractive);
+	StatsTag tag("Registry");
 	Document file(item);
+	file.setPriority(PriorityInteractive);
 	if (!file.peek()) {
 		qDebug() << "PeerDrive::Registry: cannot read registry!";
 		return;
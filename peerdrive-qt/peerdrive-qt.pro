@@ -12,6 +12,9 @@ SOURCES += peerdrive.cpp peerdrive_value.cpp pdsd.cpp
 HEADERS += foldermodel.h foldermodel_internal.h
 SOURCES += foldermodel.cpp
 
+HEADERS += attachmentdevice.h
+SOURCES += attachmentdevice.cpp
+
 LIBS += -lprotobuf
 PROTOS = peerdrive_client.proto
 include(protobuf.pri)
@@ -18,21 +18,21 @@
 
 #include <QtDebug>
 #include <QtEndian>
+#include <QDataStream>
+#include <QDateTime>
 #include <QFile>
 #include <QProcessEnvironment>
+#include <QSet>
+#include <QTimer>
+#include <new>
 #include <stdexcept>
+#include <string.h>
 
 #include "peerdrive.h"
 #include "peerdrive_internal.h"
 
-#define FLAG_REQ	0
-#define FLAG_CNF	1
-#define FLAG_IND	2
-#define FLAG_RSP	3
-
 //#define TRACE_LEVEL 3
 
-#ifdef TRACE_LEVEL
 static const char *msg_names[] = {
 	"ERROR_MSG",
 	"INIT_MSG",
@@ -81,277 +81,2023 @@ static const char *msg_names[] = {
 	"SET_DATA_MSG",
 	"GET_LINKS_MSG",
 };
-#endif
+
+const char *PeerDrive::messageName(int msg)
+{
+	if (msg < 0 || msg >= MSG_COUNT)
+		return "<unknown>";
+
+	return msg_names[msg];
+}
 
 using namespace PeerDrive;
 
-ConnectionHandler::ConnectionHandler()
-	: QObject()
+RecvBuffer::RecvBuffer(int chunkSize)
+	: m_chunk(NULL)
+	, m_chunkSize(chunkSize)
+	, m_read(0)
+	, m_write(0)
+	, m_expect(0)
+	, m_maxFrame(FRAME_LEGACY_MAX)
+	, m_broken(false)
+	, m_large(false)
 {
-	nextRef = 0;
+}
 
-	QObject::connect(&socket, SIGNAL(readyRead()), this, SLOT(sockReadyRead()));
-	QObject::connect(&socket, SIGNAL(disconnected()), this, SLOT(sockDisconnected()));
-	QObject::connect(&socket, SIGNAL(error(QAbstractSocket::SocketError)),
-		this, SLOT(sockError(QAbstractSocket::SocketError)));
-	QObject::connect(this, SIGNAL(pushSendQueue()), this,
-		SLOT(sockReadySend()), Qt::QueuedConnection);
+/*
+ * Large frames may be as big as the packet size that the daemon announced,
+ * plus room for the headers of the message that carries the packet.
+ */
+void RecvBuffer::setLargeFrames(bool enable, int maxFrame)
+{
+	m_large = enable;
+	m_maxFrame = qMax(maxFrame, (int)FRAME_LEGACY_MAX);
 }
 
-ConnectionHandler::~ConnectionHandler()
+RecvBuffer::~RecvBuffer()
 {
-	while (socket.flush())
-		socket.waitForBytesWritten(1000);
-	socket.disconnectFromHost();
+	if (m_chunk)
+		FramePool::release(m_chunk);
+}
 
-	abortCompletions(ErrConnReset);
+/*
+ * Make room for at least 'len' bytes behind the write cursor. Frames that were
+ * handed out before never look past their own end. Hence it is safe to append
+ * to the chunk even if it is still referenced by them. The pending data is
+ * only moved within the chunk if no frame refers to it anymore.
+ */
+char *RecvBuffer::reserve(int len)
+{
+	int pending = m_write - m_read;
+	int capacity = m_chunk ? m_chunk->capacity : 0;
+
+	if (m_chunk && (int)m_chunk->refs == 1) {
+		if (pending == 0)
+			m_read = m_write = 0;
+		if (capacity - m_write < len && capacity >= pending + len) {
+			memmove(m_chunk->mem, m_chunk->mem + m_read, pending);
+			m_read = 0;
+			m_write = pending;
+		}
+	}
+
+	if (capacity - m_write < len) {
+		// make room for the whole pending frame at once
+		FrameBuffer *fresh = FramePool::alloc(qMax(qMax(m_chunkSize,
+			pending + len), m_expect));
+		if (m_chunk) {
+			memcpy(fresh->mem, m_chunk->mem + m_read, pending);
+			FramePool::release(m_chunk);
+		}
+		m_chunk = fresh;
+		m_read = 0;
+		m_write = pending;
+	}
+
+	return m_chunk->mem + m_write;
+}
+
+void RecvBuffer::clear()
+{
+	if (m_chunk)
+		FramePool::release(m_chunk);
+	m_chunk = NULL;
+	m_read = m_write = m_expect = 0;
+	m_maxFrame = FRAME_LEGACY_MAX;
+	m_broken = false;
+	m_large = false;
 }
 
-int ConnectionHandler::connect(const QString &hostName, quint16 port)
+int RecvBuffer::fill(QIODevice *device)
 {
-	socket.connectToHost(hostName, port);
-	if (!socket.waitForConnected())
-		return ERR_ENODEV;
+	int total = 0;
+
+	forever {
+		qint64 avail = device->bytesAvailable();
+		if (avail <= 0)
+			break;
+
+		int len = (int)qMin<qint64>(avail, m_chunkSize);
+		qint64 got = device->read(reserve(len), len);
+		if (got <= 0)
+			break;
 
-	return 0;
+		commit(got);
+		total += got;
+	}
+
+	return total;
 }
 
-void ConnectionHandler::disconnect()
+/*
+ * Cut the next complete frame from the buffer. The returned frame starts
+ * after the length field, i.e. with the ref. A frame that is too short for
+ * its header or bigger than allowed breaks the buffer for good, see
+ * isBroken().
+ */
+bool RecvBuffer::next(Frame &frame)
 {
-	socket.disconnectFromHost();
+	int pending = m_write - m_read;
+	if (pending <= 2 || m_broken)
+		return false;
+
+	const uchar *p = (const uchar *)m_chunk->mem + m_read;
+	int header = 2;
+	int expect;
+
+	if (m_large && (*p & 0x80)) {
+		if (pending < 4)
+			return false;
+		header = 4;
+		expect = qFromBigEndian<quint32>(p) & ~FRAME_LARGE;
+	} else
+		expect = qFromBigEndian<quint16>(p);
+
+	if (expect < 6 || expect > m_maxFrame) {
+		m_broken = true;
+		return false;
+	}
+
+	if (expect + header > pending) {
+		m_expect = expect + header;
+		return false;
+	}
+
+	frame = Frame(m_chunk, m_read + header, expect);
+	m_read += expect + header;
+	m_expect = 0;
+	return true;
 }
 
-Error ConnectionHandler::sendReq(int msg, Completion *completion, const QByteArray &req)
+/****************************************************************************/
+
+Request::Request(const QByteArray &body)
+	: m_buffer(FramePool::alloc(HeaderSize + body.size()))
+	, m_priority(PriorityScope::current())
+	, m_epoch(SessionScope::current())
 {
-	completion->done = false;
-	completion->err = ErrNoError;
+	memcpy(m_buffer->mem + HeaderSize, body.constData(), body.size());
+}
 
-	QMutexLocker locker(&mutex);
+/****************************************************************************/
 
-	if (socket.state() != QAbstractSocket::ConnectedState)
-		return ErrConnReset;
+RecycleStack<FrameBuffer> FramePool::m_released[FramePool::Classes];
+QThreadStorage<FramePool::Cache*> FramePool::m_caches;
 
-	quint32 ref = nextRef++;
-	pendingCompletions.insert(ref, completion);
+FramePool::Cache::~Cache()
+{
+	for (int i = 0; i < Classes; i++) {
+		while (free[i]) {
+			FrameBuffer *next = free[i]->next;
+			destroy(free[i]);
+			free[i] = next;
+		}
+	}
+}
 
-#if TRACE_LEVEL >= 1
-	qDebug() << "REQ" << msg_names[msg]
-#if TRACE_LEVEL >= 2
-		<< ref << req.size()
-#if TRACE_LEVEL >= 3
-		<< req.left(64).toHex()
-#endif
-#endif
-		;
-#endif
+int FramePool::sizeClass(int length)
+{
+	if (length > (1 << MaxShift))
+		return -1;
 
-	uchar header[8];
-	qToBigEndian((quint16)(6 + req.size()), header);
-	qToBigEndian((quint32)ref, header + 2);
-	qToBigEndian((quint16)((msg << 4) | FLAG_REQ), header + 6);
+	int shift = MinShift;
+	while (length > (1 << shift))
+		shift++;
+
+	return shift - MinShift;
+}
 
-	QByteArray fullReq((const char *)header, 8);
-	fullReq.append(req);
+FrameBuffer *FramePool::create(int sizeClass, int length)
+{
+	int capacity = sizeClass < 0 ? length : 1 << (sizeClass + MinShift);
 
-	sendQueue.enqueue(fullReq);
+	void *mem = qMalloc(sizeof(FrameBuffer) + capacity);
+	Q_CHECK_PTR(mem);
+	FrameBuffer *buffer = new (mem) FrameBuffer;
+	buffer->mem = (char *)(buffer + 1);
+	buffer->capacity = capacity;
+	buffer->sizeClass = sizeClass;
 
-	locker.unlock();
-	emit pushSendQueue();
+	return buffer;
+}
 
-	return ErrNoError;
+void FramePool::destroy(FrameBuffer *buffer)
+{
+	buffer->~FrameBuffer();
+	qFree(buffer);
 }
 
-Error ConnectionHandler::poll(Completion *completion)
+FrameBuffer *FramePool::alloc(int length)
 {
-	QMutexLocker locker(&mutex);
+	FrameBuffer *buffer = NULL;
+	int cls = sizeClass(length);
 
-	// FIXME: use a pool of QWaitCondition's or pre-allocated Completion's
-	// with their own semaphore
-	while (!completion->done)
-		gotConfirmation.wait(&mutex);
+	if (cls >= 0) {
+		if (!m_caches.hasLocalData())
+			m_caches.setLocalData(new Cache);
 
-	return completion->err;
+		FrameBuffer *&free = m_caches.localData()->free[cls];
+		if (!free)
+			free = m_released[cls].takeAll();
+		if (free) {
+			buffer = free;
+			free = buffer->next;
+		}
+	}
+
+	if (!buffer)
+		buffer = create(cls, length);
+
+	buffer->length = length;
+	buffer->offset = 0;
+	buffer->refs = 1;
+	buffer->next = NULL;
+
+	return buffer;
 }
 
-void ConnectionHandler::sockReadySend()
+void FramePool::release(FrameBuffer *buffer)
 {
-	QMutexLocker locker(&mutex);
+	if (buffer->refs.deref())
+		return;
 
-	while (!sendQueue.isEmpty()) {
-		QByteArray req = sendQueue.dequeue();
-		locker.unlock();
-		if (socket.write(req) != req.size()) {
-			socket.disconnectFromHost();
-			abortCompletions(ErrConnReset);
+	int cls = buffer->sizeClass;
+	if (cls >= 0) {
+		int limit = qMin((int)MaxIdle, qMax(4, MaxIdleBytes >> (cls + MinShift)));
+		if (m_released[cls].put(buffer, limit))
 			return;
-		}
-		locker.relock();
 	}
+
+	destroy(buffer);
 }
 
-void ConnectionHandler::sockReadyRead()
+/****************************************************************************/
+
+const uchar *Wire::skip(const uchar *in, const uchar *end, int type)
 {
-	m_buf.append(socket.readAll());
-	while (m_buf.size() > 2) {
-		quint16 expect = qFromBigEndian<quint16>((const uchar *)m_buf.constData());
-		if (expect+2 > m_buf.size())
-			break;
+	quint64 value;
+	Bytes bytes;
 
-		quint32 ref = qFromBigEndian<quint32>((const uchar *)m_buf.constData() + 2);
-		quint16 msg = qFromBigEndian<quint16>((const uchar *)m_buf.constData() + 6);
-		int type = msg & 3;
-		int len = expect-6;
-		msg >>= 4;
+	switch (type) {
+		case Varint:
+			return getVarint(in, end, &value);
+		case Fixed64:
+			return end - in >= 8 ? in + 8 : NULL;
+		case Delimited:
+			return getBytes(in, end, &bytes);
+		case Fixed32:
+			return end - in >= 4 ? in + 4 : NULL;
+		default:
+			return NULL;
+	}
+}
 
-		QMutexLocker locker(&mutex);
+bool ReadCnfCodec::ParseFromArray(const void *raw, int size)
+{
+	const uchar *in = (const uchar *)raw;
+	const uchar *end = in + size;
+	bool seen = false;
 
-#if TRACE_LEVEL >= 1
-		qDebug() << "cnf" << msg_names[msg]
-#if TRACE_LEVEL >= 2
-			<< ref << len
-#if TRACE_LEVEL >= 3
-			<< m_buf.mid(8, len).left(64).toHex()
-#endif
-#endif
-			;
-#endif
+	while (in && in < end) {
+		quint64 tag;
+		if (!(in = Wire::getVarint(in, end, &tag)))
+			return false;
 
-		if (type == FLAG_CNF && pendingCompletions.contains(ref)) {
-			Completion *c = pendingCompletions.take(ref);
-			c->done = true;
-			c->msg = msg;
-			*(c->cnf) = m_buf.mid(8, len);
-			gotConfirmation.wakeAll();
-		} else if (type == FLAG_IND) {
-			// dispatch with message header
-			emit indication(m_buf.mid(6, len+2));
+		if (tag == ((1 << 3) | Wire::Delimited)) {
+			in = Wire::getBytes(in, end, &data);
+			seen = true;
+		} else
+			in = Wire::skip(in, end, tag & 7);
+	}
+
+	return in && seen;
+}
+
+static const uchar *parseStatData(const uchar *in, const uchar *end,
+	StatCnfCodec *cnf)
+{
+	Wire::Bytes msg;
+	if (!(in = Wire::getBytes(in, end, &msg)))
+		return NULL;
+
+	const uchar *pos = (const uchar *)msg.data;
+	const uchar *stop = pos + msg.size;
+	int seen = 0;
+
+	while (pos && pos < stop) {
+		quint64 tag;
+		if (!(pos = Wire::getVarint(pos, stop, &tag)))
+			return NULL;
+
+		switch (tag) {
+			case (1 << 3) | Wire::Varint:
+				pos = Wire::getVarint(pos, stop, &cnf->dataSize);
+				seen |= 1;
+				break;
+			case (2 << 3) | Wire::Delimited:
+				pos = Wire::getBytes(pos, stop, &cnf->dataHash);
+				seen |= 2;
+				break;
+			default:
+				pos = Wire::skip(pos, stop, tag & 7);
+				break;
 		}
+	}
 
-		m_buf.remove(0, expect+2);
+	return (pos && seen == 3) ? in : NULL;
+}
+
+static const uchar *parseStatAttachment(const uchar *in, const uchar *end,
+	StatCnfCodec *cnf)
+{
+	Wire::Bytes msg;
+	if (!(in = Wire::getBytes(in, end, &msg)))
+		return NULL;
+
+	const uchar *pos = (const uchar *)msg.data;
+	const uchar *stop = pos + msg.size;
+	StatCnfCodec::Attachment a;
+	int seen = 0;
+
+	while (pos && pos < stop) {
+		quint64 tag;
+		if (!(pos = Wire::getVarint(pos, stop, &tag)))
+			return NULL;
+
+		switch (tag) {
+			case (1 << 3) | Wire::Delimited:
+				pos = Wire::getBytes(pos, stop, &a.name);
+				seen |= 1;
+				break;
+			case (2 << 3) | Wire::Varint:
+				pos = Wire::getVarint(pos, stop, &a.size);
+				seen |= 2;
+				break;
+			case (3 << 3) | Wire::Delimited:
+				pos = Wire::getBytes(pos, stop, &a.hash);
+				seen |= 4;
+				break;
+			case (4 << 3) | Wire::Varint:
+				pos = Wire::getVarint(pos, stop, &a.crtime);
+				seen |= 8;
+				break;
+			case (5 << 3) | Wire::Varint:
+				pos = Wire::getVarint(pos, stop, &a.mtime);
+				seen |= 16;
+				break;
+			default:
+				pos = Wire::skip(pos, stop, tag & 7);
+				break;
+		}
 	}
+
+	if (!pos || seen != 31)
+		return NULL;
+
+	cnf->attachments.append(a);
+	return in;
 }
 
-void ConnectionHandler::sockDisconnected()
+bool StatCnfCodec::ParseFromArray(const void *raw, int size)
 {
-	abortCompletions(ErrConnReset);
+	const uchar *in = (const uchar *)raw;
+	const uchar *end = in + size;
+	int seen = 0;
+	quint64 value;
+
+	attachments.clear();
+	parents.clear();
+	comment = Wire::Bytes();
+
+	while (in && in < end) {
+		quint64 tag;
+		if (!(in = Wire::getVarint(in, end, &tag)))
+			return false;
+
+		switch (tag) {
+			case (1 << 3) | Wire::Varint:
+				in = Wire::getVarint(in, end, &value);
+				flags = value;
+				seen |= 1;
+				break;
+			case (2 << 3) | Wire::Delimited:
+				in = parseStatData(in, end, this);
+				seen |= 2;
+				break;
+			case (3 << 3) | Wire::Delimited:
+				in = parseStatAttachment(in, end, this);
+				break;
+			case (4 << 3) | Wire::Delimited:
+				parents.append(Wire::Bytes());
+				in = Wire::getBytes(in, end, &parents[parents.size()-1]);
+				break;
+			case (5 << 3) | Wire::Varint:
+				in = Wire::getVarint(in, end, &crtime);
+				seen |= 4;
+				break;
+			case (6 << 3) | Wire::Varint:
+				in = Wire::getVarint(in, end, &mtime);
+				seen |= 8;
+				break;
+			case (7 << 3) | Wire::Delimited:
+				in = Wire::getBytes(in, end, &typeCode);
+				seen |= 16;
+				break;
+			case (8 << 3) | Wire::Delimited:
+				in = Wire::getBytes(in, end, &creatorCode);
+				seen |= 32;
+				break;
+			case (9 << 3) | Wire::Delimited:
+				in = Wire::getBytes(in, end, &comment);
+				break;
+			default:
+				in = Wire::skip(in, end, tag & 7);
+				break;
+		}
+	}
+
+	// all required fields must be there, just like with the generated code
+	return in && seen == 63;
 }
 
-void ConnectionHandler::sockError(QAbstractSocket::SocketError /*socketError*/)
+/****************************************************************************/
+
+static QThreadStorage<Priority*> currentPriority;
+
+PriorityScope::PriorityScope(Priority priority)
 {
-	socket.disconnectFromHost();
-	abortCompletions(ErrConnReset); // TODO: use socketError
+	if (!currentPriority.hasLocalData())
+		currentPriority.setLocalData(new Priority(PriorityNormal));
+
+	m_prev = *currentPriority.localData();
+	*currentPriority.localData() = priority;
 }
 
-void ConnectionHandler::abortCompletions(Error err)
+PriorityScope::~PriorityScope()
 {
-	QMutexLocker locker(&mutex);
+	*currentPriority.localData() = m_prev;
+}
 
-	foreach (Completion *c, pendingCompletions) {
-		c->done = true;
-		c->err = err;
-	}
+Priority PriorityScope::current()
+{
+	if (!currentPriority.hasLocalData())
+		return PriorityNormal;
 
-	gotConfirmation.wakeAll();
+	return *currentPriority.localData();
 }
 
 /****************************************************************************/
 
-Connection* volatile Connection::m_instance = NULL;
-QMutex Connection::instanceMutex;
+static QThreadStorage<int*> currentTag;
 
-Connection::Connection()
-	: QThread(),
-	  watchMutex(QMutex::Recursive),
-	  progressMutex(QMutex::Recursive),
-	  m_maxPacketSize(16384)
+StatsTag::StatsTag(const char *name)
 {
-	QMutexLocker locker(&startupMutex);
+	if (!currentTag.hasLocalData())
+		currentTag.setLocalData(new int(0));
 
-	start();
-	startupDone.wait(&startupMutex);
+	// the component that started it all gets the credit
+	m_prev = *currentTag.localData();
+	if (!m_prev)
+		*currentTag.localData() = RpcMetrics::registerTag(name);
+}
+
+StatsTag::~StatsTag()
+{
+	*currentTag.localData() = m_prev;
+}
 
-	sendInit();
+int StatsTag::current()
+{
+	if (!currentTag.hasLocalData())
+		return 0;
 
-	Connection::m_instance = this;
+	return *currentTag.localData();
 }
 
-Connection::~Connection()
+/****************************************************************************/
+
+static QThreadStorage<quint32*> currentEpoch;
+
+SessionScope::SessionScope(quint32 epoch)
 {
-	Connection::m_instance = NULL;
+	if (!currentEpoch.hasLocalData())
+		currentEpoch.setLocalData(new quint32(0));
 
-	exit();
-	wait();
+	m_prev = *currentEpoch.localData();
+	*currentEpoch.localData() = epoch;
 }
 
-Connection* Connection::instance()
+SessionScope::~SessionScope()
 {
-	// fast path: instance already created
-	if (Connection::m_instance)
-		return Connection::m_instance;
+	*currentEpoch.localData() = m_prev;
+}
 
-	// slow path: create instance
-	QMutexLocker l(&instanceMutex);
+quint32 SessionScope::current()
+{
+	if (!currentEpoch.hasLocalData())
+		return 0;
+
+	return *currentEpoch.localData();
+}
+
+/****************************************************************************/
 
-	if (Connection::m_instance)
-		return Connection::m_instance;
+FlightRecorder::FlightRecorder()
+	: m_ring(NULL)
+	, m_next(0)
+	, m_startTime(0)
+{
+}
 
-	return new Connection();
+FlightRecorder::~FlightRecorder()
+{
+	delete [] m_ring;
 }
 
-void Connection::run()
+void FlightRecorder::setEnabled(bool enable)
 {
-	handler = new ConnectionHandler();
-	QObject::connect(handler, SIGNAL(indication(QByteArray)), this,
-		SLOT(dispatchIndication(QByteArray)), Qt::QueuedConnection);
+	if (enable == isEnabled())
+		return;
 
-	// first look into the environment
-	QString address = QProcessEnvironment::systemEnvironment().value("PEERDRIVE");
+	if (enable) {
+		m_ring = new Entry[Entries];
+		m_next = 0;
+		m_startTime = QDateTime::currentMSecsSinceEpoch();
+		m_clock.start();
+	} else {
+		delete [] m_ring;
+		m_ring = NULL;
+	}
+}
 
-	// then look for per-user daemon
-	if (address.isEmpty()) {
-		// FIXME: add Windows
-		QString path = QString("/tmp/peerdrive-%1/server.info").arg(
-			QProcessEnvironment::systemEnvironment().value("USER"));
+void FlightRecorder::append(int dir, quint32 ref, quint16 msg,
+	const char *payload, int length)
+{
+	Entry &e = m_ring[m_next++ % Entries];
 
-		QFile file(path);
-		if (file.open(QIODevice::ReadOnly | QIODevice::Text))
-			address = file.readLine().trimmed();
+	e.time = m_clock.nsecsElapsed() / 1000;
+	e.ref = ref;
+	e.msg = msg;
+	e.dir = dir;
+	length = qMax(length, 0);
+	e.length = length;
+	e.captured = qMin(length, (int)PayloadSize);
+	memcpy(e.payload, payload, e.captured);
+}
+
+bool FlightRecorder::dump(const QString &fileName) const
+{
+	if (!m_ring)
+		return false;
+
+	QFile file(fileName);
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+		qDebug() << "::PeerDrive::FlightRecorder: cannot open" << fileName;
+		return false;
 	}
 
-	// look for system daemon as last resort
-	if (address.isEmpty()) {
-		// FIXME: add Windows
-		QFile file("/var/run/peerdrive/server.info");
-		if (file.open(QIODevice::ReadOnly | QIODevice::Text))
-			address = file.readLine().trimmed();
+	quint32 count = qMin(m_next, (quint32)Entries);
+	QDataStream out(&file);
+	out << (quint32)Magic << (quint16)Version << m_startTime << count;
+
+	for (quint32 i = m_next - count; i != m_next; i++) {
+		const Entry &e = m_ring[i % Entries];
+		out << e.time << e.ref << e.length << e.msg << e.dir << e.captured;
+		out.writeRawData(e.payload, e.captured);
 	}
 
-	// do we have an address?
-	if (address.isEmpty()) {
-		qDebug() << "::PeerDrive::Connection: don't know where to find a server";
-		goto run;
+	return out.status() == QDataStream::Ok;
+}
+
+/****************************************************************************/
+
+FrameCapture::FrameCapture()
+{
+}
+
+FrameCapture::~FrameCapture()
+{
+	flush();
+}
+
+bool FrameCapture::open(const QString &fileName)
+{
+	m_file.setFileName(fileName);
+	if (!m_file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+		qDebug() << "::PeerDrive::FrameCapture: cannot open" << fileName;
+		return false;
 	}
 
-	if (!address.startsWith("tcp://")) {
-		qDebug() << "::PeerDrive::Connection: unknown address scheme: " << address;
-		goto run;
+	m_out.setDevice(&m_file);
+	m_out << (quint32)Magic << (quint16)Version
+	      << (qint64)QDateTime::currentMSecsSinceEpoch();
+	m_clock.start();
+
+	return true;
+}
+
+void FrameCapture::write(int dir, quint32 ref, quint16 msg, const char *payload,
+	int length)
+{
+	m_out << (qint64)(m_clock.nsecsElapsed() / 1000) << (quint8)dir << ref << msg
+	      << (quint32)length;
+	m_out.writeRawData(payload, length);
+}
+
+void FrameCapture::flush()
+{
+	if (m_file.isOpen())
+		m_file.flush();
+}
+
+bool FrameCapture::readHeader(QDataStream &in, qint64 *startTime)
+{
+	quint32 magic;
+	quint16 version;
+
+	in >> magic >> version >> *startTime;
+	return in.status() == QDataStream::Ok && magic == Magic && version == Version;
+}
+
+bool FrameCapture::read(QDataStream &in, Record *record)
+{
+	quint32 length;
+
+	in >> record->time >> record->dir >> record->ref >> record->msg >> length;
+	if (in.status() != QDataStream::Ok)
+		return false;
+
+	record->payload.resize(length);
+	return in.readRawData(record->payload.data(), length) == (int)length;
+}
+
+/****************************************************************************/
+
+const char * volatile RpcMetrics::m_tagNames[RpcMetrics::MaxTags] = { "<untagged>" };
+QAtomicInt RpcMetrics::m_tagCount(1);
+QMutex RpcMetrics::m_tagMutex;
+
+RpcMetrics::Counters::Counters()
+	: requests(0)
+	, errors(0)
+	, bytesOut(0)
+	, bytesIn(0)
+	, maxLatency(0)
+{
+	memset(latency, 0, sizeof(latency));
+}
+
+void RpcMetrics::Counters::add(const Counters &other)
+{
+	requests += other.requests;
+	errors += other.errors;
+	bytesOut += other.bytesOut;
+	bytesIn += other.bytesIn;
+	maxLatency = qMax(maxLatency, other.maxLatency);
+	for (int i = 0; i < Buckets; i++)
+		latency[i] += other.latency[i];
+}
+
+quint64 RpcMetrics::Counters::percentile(double p) const
+{
+	quint64 total = 0;
+	for (int i = 0; i < Buckets; i++)
+		total += latency[i];
+	if (!total)
+		return 0;
+
+	quint64 rank = qMax<quint64>(1, (quint64)(p * total + 0.5));
+	for (int i = 0; i < Buckets; i++) {
+		if (latency[i] >= rank)
+			return qMin(bucketValue(i), maxLatency);
+		rank -= latency[i];
 	}
 
-	{
-		QStringList urlParts = address.mid(6).split("/");
-		if (urlParts.size() == 2) {
-			QStringList addrParts = urlParts.at(0).split(":");
-			if (addrParts.size() == 2) {
-				QString hostName = addrParts.at(0);
-				quint16 port = addrParts.at(1).toInt();
+	return maxLatency;
+}
 
-				m_cookie = urlParts.at(1);
+int RpcMetrics::bucket(quint64 usecs)
+{
+	if (usecs < 16)
+		return (int)usecs;
 
-				int err = handler->connect(hostName, port);
-				if (err)
-					qDebug() << "::PeerDrive::Connection: connection failed:" << err;
-			} else {
-				qDebug() << "::PeerDrive::Connection: malformed host: "
+	int exp = 4;
+	while (usecs >> (exp+1))
+		exp++;
+
+	int index = 16 + (exp-4)*8 + (int)((usecs >> (exp-3)) & 7);
+	return qMin(index, (int)Buckets - 1);
+}
+
+/*
+ * Lower bound of the values in the bucket.
+ */
+quint64 RpcMetrics::bucketValue(int bucket)
+{
+	if (bucket < 16)
+		return bucket;
+
+	int exp = 4 + (bucket-16) / 8;
+	return (quint64)(8 + (bucket-16) % 8) << (exp-3);
+}
+
+/*
+ * Called by the submitting thread.
+ */
+void RpcMetrics::started(int msg, int tag)
+{
+	m_msgInFlight[msg].ref();
+	m_tagInFlight[tag].ref();
+}
+
+void RpcMetrics::aborted(int msg, int tag)
+{
+	m_msgInFlight[msg].deref();
+	m_tagInFlight[tag].deref();
+}
+
+/*
+ * Called by the I/O thread.
+ */
+void RpcMetrics::finished(int msg, int tag, bool error, int bytesOut,
+	int bytesIn, quint64 usecs)
+{
+	int b = bucket(usecs);
+	Counters *counters[2] = { &m_msgs[msg], &m_tags[tag] };
+
+	for (int i = 0; i < 2; i++) {
+		Counters *c = counters[i];
+		c->requests++;
+		if (error)
+			c->errors++;
+		c->bytesOut += bytesOut;
+		c->bytesIn += bytesIn;
+		c->latency[b]++;
+		if (usecs > c->maxLatency)
+			c->maxLatency = usecs;
+	}
+
+	aborted(msg, tag);
+}
+
+int RpcMetrics::registerTag(const char *name)
+{
+	int count = m_tagCount;
+	for (int i = 0; i < count; i++)
+		if (m_tagNames[i] == name || !strcmp(m_tagNames[i], name))
+			return i;
+
+	QMutexLocker locker(&m_tagMutex);
+
+	count = m_tagCount;
+	for (int i = 0; i < count; i++)
+		if (!strcmp(m_tagNames[i], name))
+			return i;
+
+	if (count >= MaxTags) {
+		qDebug() << "::PeerDrive::RpcMetrics: too many tags, ignoring" << name;
+		return 0;
+	}
+
+	m_tagNames[count] = name;
+	m_tagCount.fetchAndStoreRelease(count + 1);
+	return count;
+}
+
+const char *RpcMetrics::tagName(int tag)
+{
+	return m_tagNames[tag];
+}
+
+int RpcMetrics::tagCount()
+{
+	return m_tagCount;
+}
+
+/****************************************************************************/
+
+// interactive : normal : bulk
+const int ConnectionHandler::laneWeight[LaneCount] = { 8, 4, 1 };
+// 0 means "not bound to a session"
+QAtomicInt ConnectionHandler::nextEpoch(1);
+ConnectionHandler::Completion ConnectionHandler::claimed;
+QSemaphore ConnectionHandler::completed;
+QThreadStorage<QSemaphore*> ConnectionHandler::waiters;
+
+ConnectionHandler::ConnectionHandler()
+	: QObject()
+{
+	m_clock.start();
+	m_recorder.setEnabled(true);
+	socket = &tcpSocket;
+	connected = false;
+	largeFrames = false;
+	linkState = Offline;
+	m_maxPacketSize = 4096;
+	m_epoch = nextEpoch.fetchAndAddRelaxed(1);
+	m_fatal = ErrNoError;
+	reconnectEnabled = false;
+	m_starting = false;
+	m_port = 0;
+	m_backoff = ReconnectMinDelay;
+	m_retryTimer.setSingleShot(true);
+	m_connectTimer.setSingleShot(true);
+
+	QObject::connect(&m_retryTimer, SIGNAL(timeout()), this, SLOT(reconnect()));
+	QObject::connect(&m_connectTimer, SIGNAL(timeout()), this, SLOT(connectTimeout()));
+	QObject::connect(&tcpSocket, SIGNAL(connected()), this, SLOT(sockConnected()));
+	QObject::connect(&tcpSocket, SIGNAL(readyRead()), this, SLOT(sockReadyRead()));
+	QObject::connect(&tcpSocket, SIGNAL(bytesWritten(qint64)), this, SLOT(sockReadySend()));
+	QObject::connect(&tcpSocket, SIGNAL(disconnected()), this, SLOT(sockDisconnected()));
+	QObject::connect(&tcpSocket, SIGNAL(error(QAbstractSocket::SocketError)),
+		this, SLOT(sockError()));
+	QObject::connect(&localSocket, SIGNAL(connected()), this, SLOT(sockConnected()));
+	QObject::connect(&localSocket, SIGNAL(readyRead()), this, SLOT(sockReadyRead()));
+	QObject::connect(&localSocket, SIGNAL(bytesWritten(qint64)), this, SLOT(sockReadySend()));
+	QObject::connect(&localSocket, SIGNAL(disconnected()), this, SLOT(sockDisconnected()));
+	QObject::connect(&localSocket, SIGNAL(error(QLocalSocket::LocalSocketError)),
+		this, SLOT(sockError()));
+	QObject::connect(this, SIGNAL(pushSendQueue()), this,
+		SLOT(sockReadySend()), Qt::QueuedConnection);
+}
+
+ConnectionHandler::~ConnectionHandler()
+{
+	while (socket->bytesToWrite() > 0 && socket->waitForBytesWritten(1000))
+		;
+	disconnect();
+
+	abortCompletions(ErrConnReset);
+	dropFrames();
+}
+
+/*
+ * Start connecting to the daemon in the background. Requests are accepted
+ * right away and sent when the INIT handshake is done.
+ */
+void ConnectionHandler::open(const QString &hostName, quint16 port,
+	const QByteArray &cookie)
+{
+	socket = &tcpSocket;
+	m_host = hostName;
+	m_port = port;
+	m_cookie = cookie;
+
+	connected = true;
+	reconnectEnabled = true;
+	m_fatal = ErrNoError;
+	setStarting(true);
+	reconnect();
+}
+
+void ConnectionHandler::open(const QString &path, const QByteArray &cookie)
+{
+	socket = &localSocket;
+	m_path = path;
+	m_cookie = cookie;
+
+	connected = true;
+	reconnectEnabled = true;
+	m_fatal = ErrNoError;
+	setStarting(true);
+	reconnect();
+}
+
+/*
+ * Wait until the first connection attempt has either succeeded or failed.
+ * Returns true if the daemon is ready.
+ */
+bool ConnectionHandler::waitForReady(int msecs)
+{
+	QMutexLocker locker(&m_startMutex);
+
+	if (m_starting)
+		m_startDone.wait(&m_startMutex, msecs < 0 ? ULONG_MAX : msecs);
+
+	return linkState == Online;
+}
+
+void ConnectionHandler::setStarting(bool starting)
+{
+	QMutexLocker locker(&m_startMutex);
+
+	m_starting = starting;
+	if (!starting)
+		m_startDone.wakeAll();
+}
+
+void ConnectionHandler::disconnect()
+{
+	connected = false;
+	reconnectEnabled = false;
+	if (socket == &tcpSocket)
+		tcpSocket.disconnectFromHost();
+	else
+		localSocket.disconnectFromServer();
+}
+
+/*
+ * Switch to large frames after they have been negotiated. Must be called
+ * before any other request is sent after INIT so that neither side can see a
+ * large frame before.
+ */
+void ConnectionHandler::setLargeFrames(bool enable, unsigned int maxPacketSize)
+{
+	largeFrames = enable;
+	m_buf.setLargeFrames(enable, (int)qMin(maxPacketSize,
+		(unsigned int)~FRAME_LARGE - FrameSlack) + FrameSlack);
+}
+
+/*
+ * Allocate a slot for a new request. The slot is derived from the ref, the
+ * upper bits of the ref act as generation counter. The slot is only claimed
+ * here. The completion is published later together with its ref so that the
+ * I/O thread never sees a half initialized completion or a stale ref.
+ */
+bool ConnectionHandler::claimSlot(quint32 &ref)
+{
+	for (int i = 0; i < SlotCount; i++) {
+		ref = (quint32)nextRef.fetchAndAddRelaxed(1);
+		Slot &slot = m_slots[ref & (SlotCount-1)];
+
+		if (slot.completion.testAndSetAcquire(NULL, &claimed))
+			return true;
+	}
+
+	return false;
+}
+
+void ConnectionHandler::publishCompletion(quint32 ref, Completion *completion)
+{
+	Slot &slot = m_slots[ref & (SlotCount-1)];
+
+	completion->ref = ref;
+	slot.ref = ref;
+	slot.completion.fetchAndStoreRelease(completion);
+}
+
+/*
+ * Atomically take the completion of 'ref' out of the table. Whoever succeeds
+ * owns the completion: either the I/O thread to complete it or the issuer to
+ * cancel it.
+ */
+ConnectionHandler::Completion *ConnectionHandler::takeCompletion(quint32 ref)
+{
+	Slot &slot = m_slots[ref & (SlotCount-1)];
+
+	Completion *c = slot.completion;
+	if (!c || c == &claimed || slot.ref != ref)
+		return NULL;
+
+	if (!slot.completion.testAndSetOrdered(c, NULL))
+		return NULL;
+
+	return c;
+}
+
+Error ConnectionHandler::sendReq(int msg, Completion *completion, Request &req)
+{
+	completion->err = ErrNoError;
+	completion->waiter = NULL;
+
+	if (!connected) {
+		Error err = linkError();
+		fail(completion, err);
+		return err;
+	}
+
+	// whether it fits the session is only known when it is sent
+	int len = req.size();
+	if (6 + len > (int)~FRAME_LARGE) {
+		qDebug() << "::PeerDrive::ConnectionHandler: frame too big:" << len;
+		fail(completion, ErrMSGSIZE);
+		return ErrMSGSIZE;
+	}
+
+	// the handle of the request died with its session
+	if (req.m_epoch && req.m_epoch != m_epoch) {
+		fail(completion, ErrConnReset);
+		return ErrConnReset;
+	}
+
+	quint32 ref;
+	if (!claimSlot(ref)) {
+		fail(completion, ErrNOBUFS);
+		return ErrNOBUFS;
+	}
+
+	FrameBuffer *node = buildFrame(msg, ref, req);
+
+	// Keeps a reference to the frame. Only its length header is written
+	// again when it is replayed. Frames that are bound to a session are not
+	// replayed.
+	if (isIdempotent(msg) && !req.m_epoch) {
+		node->refs.ref();
+		completion->replay = node;
+		completion->priority = req.m_priority;
+	} else
+		completion->replay = NULL;
+
+	int tag = StatsTag::current();
+	completion->req = msg;
+	completion->tag = tag;
+	completion->bytesOut = len;
+	completion->started = m_clock.nsecsElapsed() / 1000;
+	m_metrics.started(msg, tag);
+
+	publishCompletion(ref, completion);
+	pushFrame(node, req.m_priority);
+
+	// Lost a race with a disconnect? If the completion is still registered
+	// it would never be aborted.
+	if (!connected && takeCompletion(ref) == completion) {
+		Error err = linkError();
+		m_metrics.aborted(msg, tag);
+		releaseReplay(completion);
+		fail(completion, err);
+		return err;
+	}
+
+	return ErrNoError;
+}
+
+/*
+ * Fills in everything but the length header, which depends on the session
+ * the frame is sent in. Until then the frame is accounted with a short
+ * header.
+ */
+FrameBuffer *ConnectionHandler::buildFrame(int msg, quint32 ref, Request &req)
+{
+	// take over the buffer
+	FrameBuffer *node = req.m_buffer;
+	req.m_buffer = NULL;
+	int len = node->length - Request::HeaderSize;
+	node->epoch = req.m_epoch;
+
+#if TRACE_LEVEL >= 1
+	qDebug() << "REQ" << msg_names[msg]
+#if TRACE_LEVEL >= 2
+		<< ref << len
+#if TRACE_LEVEL >= 3
+		<< QByteArray(node->mem + Request::HeaderSize, qMin(len, 64)).toHex()
+#endif
+#endif
+		;
+#endif
+
+	uchar *header = (uchar *)node->mem;
+	node->offset = 2;
+	qToBigEndian((quint32)ref, header + 4);
+	qToBigEndian((quint16)((msg << 4) | FLAG_REQ), header + 8);
+
+	return node;
+}
+
+/*
+ * Writes the length header right before the frame is sent. Returns false if
+ * the frame is too big for the current session.
+ */
+bool ConnectionHandler::sealFrame(FrameBuffer *node)
+{
+	int len = node->length - Request::HeaderSize;
+	uchar *header = (uchar *)node->mem;
+
+	if (6 + len <= (largeFrames ? FRAME_SHORT_MAX : FRAME_LEGACY_MAX)) {
+		node->offset = 2;
+		qToBigEndian((quint16)(6 + len), header + 2);
+	} else if (largeFrames) {
+		node->offset = 0;
+		qToBigEndian((quint32)(FRAME_LARGE | (6 + len)), header);
+	} else {
+		qDebug() << "::PeerDrive::ConnectionHandler: frame too big:" << len;
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Requests that only read global state may be sent again after a reconnect.
+ * Anything that uses a handle cannot be replayed because the handles of the
+ * old connection are gone.
+ */
+bool ConnectionHandler::isIdempotent(int msg)
+{
+	switch (msg) {
+		case ENUM_MSG:
+		case LOOKUP_DOC_MSG:
+		case LOOKUP_REV_MSG:
+		case STAT_MSG:
+		case GET_PATH_MSG:
+		case WALK_PATH_MSG:
+		case GET_LINKS_MSG:
+		case PROGRESS_QUERY_MSG:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/*
+ * Multi-producer submission queue: frames are pushed onto a lock-free stack
+ * and the I/O thread takes the whole stack at once. The I/O thread is only
+ * woken up if it was not already notified.
+ */
+void ConnectionHandler::pushFrame(FrameBuffer *node, Priority priority)
+{
+	QAtomicPointer<FrameBuffer> &stack = lanes[priority].stack;
+	FrameBuffer *head;
+	do {
+		head = stack;
+		node->next = head;
+	} while (!stack.testAndSetRelease(head, node));
+
+	if (sendPending.testAndSetOrdered(0, 1))
+		emit pushSendQueue();
+}
+
+/*
+ * A thread can only block on one completion at a time. Hence every thread
+ * has its own semaphore which is attached to the completion while waiting.
+ * This way only the owner is woken up instead of all blocked threads.
+ */
+Error ConnectionHandler::poll(Completion *completion)
+{
+	if (!waiters.hasLocalData())
+		waiters.setLocalData(new QSemaphore);
+
+	QSemaphore *waiter = waiters.localData();
+	if (completion->waiter.testAndSetOrdered(NULL, waiter))
+		waiter->acquire();
+
+	return completion->err;
+}
+
+/*
+ * Mark a completion that never made it into the table as done.
+ */
+void ConnectionHandler::fail(Completion *completion, Error err)
+{
+	completion->err = err;
+	completion->waiter = &completed;
+}
+
+void ConnectionHandler::cancel(Completion *completion)
+{
+	// The I/O thread is either completing it or has it out of the table
+	// for a moment while replaying it after a reconnect.
+	while (!completion->isDone()) {
+		if (takeCompletion(completion->ref) == completion) {
+			m_metrics.aborted(completion->req, completion->tag);
+			releaseReplay(completion);
+			return;
+		}
+		QThread::yieldCurrentThread();
+	}
+}
+
+/*
+ * Drops the reference of a completion to its frame. Only called by the
+ * owner of the completion.
+ */
+void ConnectionHandler::releaseReplay(Completion *completion)
+{
+	if (completion->replay) {
+		FramePool::release(completion->replay);
+		completion->replay = NULL;
+	}
+}
+
+RecycleStack<ConnectionHandler::OnewayCompletion> ConnectionHandler::m_idleOneway;
+QThreadStorage<ConnectionHandler::OnewayCache*> ConnectionHandler::m_onewayCaches;
+
+ConnectionHandler::OnewayCache::~OnewayCache()
+{
+	while (head) {
+		OnewayCompletion *next = head->next;
+		delete head;
+		head = next;
+	}
+}
+
+/*
+ * One-way requests are owned by the handler. The completion lives until the
+ * confirmation arrives or the request is aborted. Completions are recycled
+ * by onewayDone() and taken from a per-thread cache here.
+ */
+Error ConnectionHandler::sendOneway(int msg, Request &req, OnewayGroup *group)
+{
+	if (!m_onewayCaches.hasLocalData())
+		m_onewayCaches.setLocalData(new OnewayCache);
+
+	OnewayCache *cache = m_onewayCaches.localData();
+	if (!cache->head)
+		cache->head = m_idleOneway.takeAll();
+
+	OnewayCompletion *completion = cache->head;
+	if (completion)
+		cache->head = completion->next;
+	else
+		completion = new OnewayCompletion;
+
+	completion->cnf = &completion->frame;
+	completion->reply = NULL;
+	completion->group = group;
+
+	group->sent();
+	Error err = sendReq(msg, completion, req);
+	if (err) {
+		group->done(err);
+		completion->next = cache->head;
+		cache->head = completion;
+	}
+
+	return err;
+}
+
+/*
+ * Only called by the owner of the completion (see takeCompletion()). The
+ * finished() signal of an async reply is raised from the thread of the reply
+ * through a queued invocation so that it is safe to delete the reply at any
+ * time.
+ */
+void ConnectionHandler::complete(Completion *completion)
+{
+	releaseReplay(completion);
+
+	if (completion != &m_init) {
+		bool error = completion->err || completion->msg != completion->req;
+		int bytesIn = completion->dest ? completion->delivered :
+			completion->cnf->size();
+		m_metrics.finished(completion->req, completion->tag, error,
+			completion->bytesOut, error ? 0 : bytesIn,
+			m_clock.nsecsElapsed() / 1000 - completion->started);
+	}
+
+	if (completion->group) {
+		onewayDone(completion);
+		return;
+	}
+
+	if (completion->reply)
+		QMetaObject::invokeMethod(completion->reply, "complete",
+			Qt::QueuedConnection);
+
+	// must be the last access; the owner may free the completion right away
+	QSemaphore *waiter = completion->waiter.fetchAndStoreOrdered(&completed);
+	if (waiter)
+		waiter->release();
+}
+
+void ConnectionHandler::onewayDone(Completion *completion)
+{
+	OnewayCompletion *c = static_cast<OnewayCompletion*>(completion);
+
+	Error err = Connection::result(c->req, c);
+	if (err) {
+		qDebug() << "::PeerDrive::ConnectionHandler: one-way request" << c->req
+		         << "failed:" << err;
+		emit onewayFailed(c->req, err);
+	}
+
+	OnewayGroup *group = c->group;
+	c->frame.clear();
+	if (!m_idleOneway.put(c, MaxIdleOneway))
+		delete c;
+	group->done(err);
+}
+
+/*
+ * Moves the submitted frames of all lanes to the send queues of the I/O
+ * thread. The stacks are LIFO, hence the order is restored while doing so.
+ */
+void ConnectionHandler::collectFrames()
+{
+	for (int i = 0; i < LaneCount; i++) {
+		Lane &lane = lanes[i];
+		FrameBuffer *node = lane.stack.fetchAndStoreAcquire(NULL);
+		if (!node)
+			continue;
+
+		FrameBuffer *queue = NULL;
+		FrameBuffer *last = node;
+		while (node) {
+			FrameBuffer *next = node->next;
+			node->next = queue;
+			queue = node;
+			node = next;
+		}
+
+		if (lane.tail)
+			lane.tail->next = queue;
+		else
+			lane.head = queue;
+		lane.tail = last;
+	}
+}
+
+/*
+ * Appends a frame to a send queue from within the I/O thread.
+ */
+void ConnectionHandler::queueFrame(FrameBuffer *node, Priority priority)
+{
+	Lane &lane = lanes[priority];
+
+	node->next = NULL;
+	if (lane.tail)
+		lane.tail->next = node;
+	else
+		lane.head = node;
+	lane.tail = node;
+}
+
+/*
+ * A frame whose session has ended must not be sent. Its handle may already
+ * belong to another document in the new session.
+ */
+bool ConnectionHandler::isStale(const FrameBuffer *node) const
+{
+	return node->epoch && node->epoch != m_epoch;
+}
+
+void ConnectionHandler::abortFrame(FrameBuffer *node, Error err)
+{
+	quint32 ref = qFromBigEndian<quint32>((const uchar *)node->mem + 4);
+	Completion *c = takeCompletion(ref);
+	if (c) {
+		c->err = err;
+		complete(c);
+	}
+	FramePool::release(node);
+}
+
+/*
+ * Fails the queued frames of the session that just ended right away instead
+ * of when sending resumes.
+ */
+void ConnectionHandler::abortStaleFrames()
+{
+	collectFrames();
+	for (int i = 0; i < LaneCount; i++) {
+		Lane &lane = lanes[i];
+		FrameBuffer **link = &lane.head;
+		lane.tail = NULL;
+		while (*link) {
+			FrameBuffer *node = *link;
+			if (isStale(node)) {
+				*link = node->next;
+				abortFrame(node, ErrConnReset);
+			} else {
+				lane.tail = node;
+				link = &node->next;
+			}
+		}
+	}
+}
+
+void ConnectionHandler::dropFrames()
+{
+	collectFrames();
+	for (int i = 0; i < LaneCount; i++) {
+		FrameBuffer *node = lanes[i].head;
+		while (node) {
+			FrameBuffer *next = node->next;
+			FramePool::release(node);
+			node = next;
+		}
+		lanes[i].head = lanes[i].tail = NULL;
+		lanes[i].deficit = 0;
+	}
+}
+
+/*
+ * Hands queued frames to the socket. Each round every lane may send up to its
+ * weighted quantum, unused credit is kept for the next round as long as the
+ * lane has frames. The frames are written one by one, the socket buffers them
+ * anyway and gathering them first would only add a copy. Stops when the
+ * socket buffer is above the watermark and resumes on bytesWritten().
+ */
+void ConnectionHandler::sockReadySend()
+{
+	sendPending.fetchAndStoreOrdered(0);
+	collectFrames();
+
+	// hold everything back until the connection is up again
+	if (linkState != Online)
+		return;
+
+	while (socket->bytesToWrite() < SendWatermark) {
+		FrameBuffer *round = NULL, **last = &round;
+		bool pending = false;
+
+		for (int i = 0; i < LaneCount; i++) {
+			Lane &lane = lanes[i];
+			if (!lane.head) {
+				lane.deficit = 0;
+				continue;
+			}
+
+			lane.deficit += laneWeight[i] * SendQuantum;
+			while (lane.head && lane.head->size() <= lane.deficit) {
+				FrameBuffer *node = lane.head;
+				lane.head = node->next;
+
+				// submitted just before the session ended
+				if (isStale(node)) {
+					abortFrame(node, ErrConnReset);
+					continue;
+				}
+				if (!sealFrame(node)) {
+					abortFrame(node, ErrMSGSIZE);
+					continue;
+				}
+				lane.deficit -= node->size();
+
+				*last = node;
+				last = &node->next;
+			}
+			*last = NULL;
+
+			if (lane.head)
+				pending = true;
+			else
+				lane.tail = NULL;
+		}
+
+		bool failed = false;
+		for (FrameBuffer *node = round; node && !failed; node = node->next)
+			failed = socket->write(node->data(), node->size()) != node->size();
+
+		while (round) {
+			FrameBuffer *next = round->next;
+			if (tracing())
+				traceSent(round);
+			FramePool::release(round);
+			round = next;
+		}
+
+		if (failed) {
+			linkDown();
+			return;
+		}
+
+		if (!pending)
+			break;
+	}
+}
+
+void ConnectionHandler::sockReadyRead()
+{
+	Frame frame;
+
+	if (m_capture.isOpen())
+		m_capture.flush();
+
+	m_buf.fill(socket);
+	while (m_buf.next(frame)) {
+		const uchar *header = (const uchar *)frame.constData();
+		quint32 ref = qFromBigEndian<quint32>(header);
+		quint16 msg = qFromBigEndian<quint16>(header + 4);
+		int type = msg & 3;
+		int len = frame.size()-6;
+		m_recorder.record(FlightRecorder::DirReceived, ref, msg,
+			frame.constData() + 6, len);
+		if (m_capture.isOpen())
+			m_capture.write(FlightRecorder::DirReceived, ref, msg,
+				frame.constData() + 6, len);
+		msg >>= 4;
+
+#if TRACE_LEVEL >= 1
+		qDebug() << "cnf" << msg_names[msg]
+#if TRACE_LEVEL >= 2
+			<< ref << len
+#if TRACE_LEVEL >= 3
+			<< QByteArray::fromRawData(frame.constData() + 6, qMin(len, 64)).toHex()
+#endif
+#endif
+			;
+#endif
+
+		if (type == FLAG_CNF) {
+			Completion *c = takeCompletion(ref);
+			if (c == &m_init) {
+				initDone(msg, frame.mid(6));
+				if (linkState != Online)
+					return;
+			} else if (c) {
+				c->msg = msg;
+				if (c->dest && msg == READ_MSG)
+					deliver(c, frame.constData() + 6, len);
+				else
+					*(c->cnf) = frame.mid(6);
+				complete(c);
+			}
+		} else if (type == FLAG_IND) {
+			// dispatch with message header
+			emit indication(frame.mid(4));
+		}
+	}
+
+	if (m_buf.isBroken()) {
+		qDebug() << "::PeerDrive::ConnectionHandler: malformed frame";
+		linkDown();
+	}
+}
+
+/*
+ * Decodes a READ confirmation in place and copies the payload straight to
+ * the buffer of the reader. The frame is not handed out, so it does not keep
+ * the receive chunk alive either.
+ */
+void ConnectionHandler::deliver(Completion *completion, const char *data, int size)
+{
+	ReadCnfCodec cnf;
+
+	if (!cnf.ParseFromArray(data, size)) {
+		completion->err = ErrBadRPC;
+		return;
+	}
+
+	completion->delivered = qMin(cnf.data.size, completion->destSize);
+	memcpy(completion->dest, cnf.data.data, completion->delivered);
+}
+
+/*
+ * Frames are built with the layout of a Request, no matter which header is
+ * actually sent.
+ */
+void ConnectionHandler::traceSent(const FrameBuffer *buffer)
+{
+	const uchar *header = (const uchar *)buffer->mem;
+	quint32 ref = qFromBigEndian<quint32>(header + 4);
+	quint16 msg = qFromBigEndian<quint16>(header + 8);
+	const char *payload = buffer->mem + Request::HeaderSize;
+	int len = buffer->length - Request::HeaderSize;
+
+	m_recorder.record(FlightRecorder::DirSent, ref, msg, payload, len);
+	if (m_capture.isOpen())
+		m_capture.write(FlightRecorder::DirSent, ref, msg, payload, len);
+}
+
+bool ConnectionHandler::setCaptureFile(const QString &fileName)
+{
+	return m_capture.open(fileName);
+}
+
+void ConnectionHandler::setRecorderFile(const QString &fileName)
+{
+	m_recorderFile = fileName;
+}
+
+/*
+ * May be called from any thread. The ring is only touched by the I/O thread,
+ * other threads wait until it has written the file.
+ */
+bool ConnectionHandler::dumpRecorder(const QString &fileName)
+{
+	if (QThread::currentThread() != thread()) {
+		bool ok = false;
+		QMetaObject::invokeMethod(this, "dumpRecorder",
+			Qt::BlockingQueuedConnection, Q_RETURN_ARG(bool, ok),
+			Q_ARG(QString, fileName));
+		return ok;
+	}
+
+	return m_recorder.dump(fileName);
+}
+
+void ConnectionHandler::sockDisconnected()
+{
+	linkDown();
+}
+
+void ConnectionHandler::sockError()
+{
+	linkDown(); // TODO: use socket error
+}
+
+/*
+ * The connection went away or a reconnect attempt failed. Requests that were
+ * already sent are lost: idempotent ones are queued again, all others fail.
+ * Queued requests stay where they are and are sent after the reconnect,
+ * except for those that are bound to the lost session.
+ */
+void ConnectionHandler::linkDown()
+{
+	LinkState prev = linkState;
+	if (prev == Offline)
+		return;
+
+	// keep a trace of what happened before the connection broke
+	if (prev != Connecting && !m_recorderFile.isEmpty())
+		m_recorder.dump(m_recorderFile);
+	if (m_capture.isOpen())
+		m_capture.flush();
+
+	linkState = Offline;
+	m_connectTimer.stop();
+	socket->close();
+	setLargeFrames(false);
+	m_buf.clear();
+
+	if (!reconnectEnabled) {
+		connected = false;
+		abortCompletions(linkError());
+		dropFrames();
+		setStarting(false);
+		return;
+	}
+
+	if (prev == Online) {
+		qDebug() << "::PeerDrive::ConnectionHandler: connection lost, reconnecting";
+		m_epoch = nextEpoch.fetchAndAddRelaxed(1);
+		abortStaleFrames();
+		replayCompletions();
+		m_lostSince.start();
+		m_backoff = ReconnectMinDelay;
+		emit connectionLost();
+	} else if (prev == Initializing) {
+		takeCompletion(m_init.ref);
+	}
+
+	retryLater();
+}
+
+void ConnectionHandler::retryLater()
+{
+	// fail fast if the daemon could not be reached in the first place
+	if (connected && (!m_lostSince.isValid() || m_lostSince.elapsed() > ReconnectGrace)) {
+		qDebug() << "::PeerDrive::ConnectionHandler: daemon not reachable";
+		connected = false;
+		abortCompletions(ErrConnReset);
+		dropFrames();
+	}
+	setStarting(false);
+
+	m_retryTimer.start(m_backoff);
+	m_backoff = qMin(m_backoff * 2, (int)ReconnectMaxDelay);
+}
+
+void ConnectionHandler::reconnect()
+{
+	linkState = Connecting;
+	m_connectTimer.start(ConnectTimeout);
+	if (socket == &tcpSocket)
+		tcpSocket.connectToHost(m_host, m_port);
+	else
+		localSocket.connectToServer(m_path);
+}
+
+void ConnectionHandler::connectTimeout()
+{
+	if (linkState == Connecting)
+		linkDown();
+}
+
+/*
+ * Do the INIT handshake before any queued request is let through.
+ */
+void ConnectionHandler::sockConnected()
+{
+	if (linkState != Connecting || !reconnectEnabled)
+		return;
+
+	m_connectTimer.stop();
+	if (socket == &tcpSocket) {
+		// requests are small and latency bound
+		tcpSocket.setSocketOption(QAbstractSocket::LowDelayOption, 1);
+	}
+
+	linkState = Initializing;
+
+	InitReq req;
+	req.set_major(2);
+	req.set_minor(0);
+	req.set_cookie(m_cookie.constData(), m_cookie.size());
+	req.set_large_frames(true);
+	Request rawReq(req);
+
+	quint32 ref;
+	if (!claimSlot(ref)) {
+		linkDown();
+		return;
+	}
+
+	m_init.cnf = &m_initCnf;
+	m_init.reply = NULL;
+	m_init.waiter = NULL;
+	m_init.replay = NULL;
+
+	FrameBuffer *node = buildFrame(INIT_MSG, ref, rawReq);
+	sealFrame(node);
+	publishCompletion(ref, &m_init);
+	socket->write(node->data(), node->size());
+	if (tracing())
+		traceSent(node);
+	FramePool::release(node);
+}
+
+void ConnectionHandler::initDone(int msg, const Frame &frame)
+{
+	InitCnf cnf;
+
+	if (msg == ERROR_MSG) {
+		ErrorCnf errCnf;
+		if (errCnf.ParseFromArray(frame.constData(), frame.size()) &&
+		    static_cast<Error>(errCnf.error() + 1) == ErrRPCMISMATCH) {
+			qDebug() << "::PeerDrive::ConnectionHandler: daemon rejected protocol version";
+			versionMismatch();
+			return;
+		}
+	}
+
+	if (msg != INIT_MSG || !cnf.ParseFromArray(frame.constData(), frame.size())) {
+		qDebug() << "::PeerDrive::ConnectionHandler: INIT failed";
+		linkDown();
+		return;
+	}
+
+	if (cnf.major() != 2 || cnf.minor() != 0) {
+		qDebug() << "::PeerDrive::ConnectionHandler: unsupported server version:"
+			<< cnf.major() << ":" << cnf.minor();
+		versionMismatch();
+		return;
+	}
+
+	setLargeFrames(cnf.large_frames(), cnf.max_packet_size());
+	m_maxPacketSize = cnf.max_packet_size();
+	linkState = Online;
+	connected = true;
+	m_backoff = ReconnectMinDelay;
+	setStarting(false);
+
+	emit ready();
+	sockReadySend();
+}
+
+/*
+ * Reconnecting would only get the same answer again. Everything that is
+ * pending or still to come fails with ErrRPCMISMATCH.
+ */
+void ConnectionHandler::versionMismatch()
+{
+	m_fatal = ErrRPCMISMATCH;
+	reconnectEnabled = false;
+	m_retryTimer.stop();
+	linkDown();
+}
+
+/*
+ * Called when the connection was lost. Requests that are still queued were not
+ * sent yet and are left alone. All others are out on the old connection: the
+ * idempotent ones are queued again, the rest fails.
+ */
+void ConnectionHandler::replayCompletions()
+{
+	QSet<quint32> queued;
+
+	collectFrames();
+	for (int i = 0; i < LaneCount; i++)
+		for (FrameBuffer *node = lanes[i].head; node; node = node->next)
+			queued.insert(qFromBigEndian<quint32>((const uchar *)node->mem + 4));
+
+	for (int i = 0; i < SlotCount; i++) {
+		Slot &slot = m_slots[i];
+		quint32 ref = slot.ref;
+		if (queued.contains(ref))
+			continue;
+
+		Completion *c = takeCompletion(ref);
+		if (!c)
+			continue;
+
+		if (c->replay && slot.completion.testAndSetOrdered(NULL, c)) {
+			c->replay->refs.ref();
+			queueFrame(c->replay, c->priority);
+		} else {
+			c->err = ErrConnReset;
+			complete(c);
+		}
+	}
+}
+
+void ConnectionHandler::abortCompletions(Error err)
+{
+	for (int i = 0; i < SlotCount; i++) {
+		Completion *c = takeCompletion(m_slots[i].ref);
+		if (c) {
+			c->err = err;
+			complete(c);
+		}
+	}
+}
+
+/****************************************************************************/
+
+Connection* volatile Connection::m_pool[Connection::MaxPoolSize];
+QAtomicInt Connection::m_poolSize;
+QAtomicInt Connection::m_nextShard;
+QThreadStorage<int*> Connection::m_shard;
+QMutex Connection::instanceMutex;
+
+Connection::Connection(int index)
+	: QThread(),
+	  m_index(index),
+	  m_established(false),
+	  watchMutex(QMutex::Recursive),
+	  progressMutex(QMutex::Recursive),
+	  m_progressRestore(NULL)
+{
+	QMutexLocker locker(&startupMutex);
+
+	// only waits for the I/O thread, connecting is done in the background
+	start();
+	startupDone.wait(&startupMutex);
+}
+
+Connection::~Connection()
+{
+	for (int i = 0; i < MaxPoolSize; i++) {
+		if (Connection::m_pool[i] == this)
+			Connection::m_pool[i] = NULL;
+	}
+
+	// cancels the request while the handler is still there
+	delete m_progressRestore;
+
+	exit();
+	wait();
+}
+
+Connection* Connection::instance()
+{
+	int size = poolSize();
+	if (size == 1)
+		return connection(0);
+
+	if (!m_shard.hasLocalData())
+		m_shard.setLocalData(new int(m_nextShard.fetchAndAddRelaxed(1)));
+
+	return connection(*m_shard.localData() % size);
+}
+
+Connection* Connection::primary()
+{
+	return connection(0);
+}
+
+Connection* Connection::connection(int index)
+{
+	// fast path: instance already created
+	if (Connection::m_pool[index])
+		return Connection::m_pool[index];
+
+	// slow path: create instance
+	QMutexLocker l(&instanceMutex);
+
+	if (!Connection::m_pool[index])
+		Connection::m_pool[index] = new Connection(index);
+
+	return Connection::m_pool[index];
+}
+
+int Connection::poolSize()
+{
+	int size = m_poolSize;
+	if (size)
+		return size;
+
+	size = QProcessEnvironment::systemEnvironment().value(
+		"PEERDRIVE_CONNECTIONS", "1").toInt();
+	size = qBound(1, size, (int)MaxPoolSize);
+
+	// an explicit setPoolSize() takes precedence
+	m_poolSize.testAndSetOrdered(0, size);
+	return m_poolSize;
+}
+
+void Connection::setPoolSize(int size)
+{
+	m_poolSize = qBound(1, size, (int)MaxPoolSize);
+}
+
+unsigned int Connection::maxPacketSize()
+{
+	// the daemon tells the packet size in the INIT handshake
+	handler->waitForReady(-1);
+	return handler->maxPacketSize();
+}
+
+/*
+ * The session that requests are sent on, see ConnectionHandler. Handles are
+ * only valid as long as it does not change.
+ */
+quint32 Connection::epoch() const
+{
+	return handler->epoch();
+}
+
+bool Connection::isReady() const
+{
+	return handler->isReady();
+}
+
+bool Connection::waitForReady(int msecs)
+{
+	return handler->waitForReady(msecs);
+}
+
+void Connection::run()
+{
+	qRegisterMetaType<Frame>("Frame");
+	qRegisterMetaType<PeerDrive::Error>("PeerDrive::Error");
+
+	handler = new ConnectionHandler();
+
+	// The flight recorder is always running unless switched off. If a file
+	// is given the recording is written there whenever the connection breaks.
+	QString recorder = QProcessEnvironment::systemEnvironment().value(
+		"PEERDRIVE_RECORDER");
+	if (recorder == "off")
+		handler->setRecorderEnabled(false);
+	else if (!recorder.isEmpty())
+		handler->setRecorderFile(m_index ? recorder + "." + QString::number(m_index)
+		                                 : recorder);
+
+	// capture everything for tools/pdreplay
+	QString capture = QProcessEnvironment::systemEnvironment().value(
+		"PEERDRIVE_CAPTURE");
+	if (!capture.isEmpty())
+		handler->setCaptureFile(m_index ? capture + "." + QString::number(m_index)
+		                                : capture);
+	QObject::connect(handler, SIGNAL(indication(Frame)), this,
+		SLOT(dispatchIndication(Frame)), Qt::QueuedConnection);
+	QObject::connect(handler, SIGNAL(ready()), this, SLOT(sessionReady()),
+		Qt::QueuedConnection);
+	QObject::connect(handler, SIGNAL(connectionLost()), this, SIGNAL(lost()),
+		Qt::QueuedConnection);
+	QObject::connect(handler, SIGNAL(onewayFailed(int, PeerDrive::Error)), this,
+		SLOT(onewayFailed(int, PeerDrive::Error)), Qt::QueuedConnection);
+
+	// first look into the environment
+	QString address = QProcessEnvironment::systemEnvironment().value("PEERDRIVE");
+
+	// then look for per-user daemon
+	if (address.isEmpty()) {
+		// FIXME: add Windows
+		QString path = QString("/tmp/peerdrive-%1/server.info").arg(
+			QProcessEnvironment::systemEnvironment().value("USER"));
+
+		QFile file(path);
+		if (file.open(QIODevice::ReadOnly | QIODevice::Text))
+			address = file.readLine().trimmed();
+	}
+
+	// look for system daemon as last resort
+	if (address.isEmpty()) {
+		// FIXME: add Windows
+		QFile file("/var/run/peerdrive/server.info");
+		if (file.open(QIODevice::ReadOnly | QIODevice::Text))
+			address = file.readLine().trimmed();
+	}
+
+	// do we have an address?
+	if (address.isEmpty()) {
+		qDebug() << "::PeerDrive::Connection: don't know where to find a server";
+		goto run;
+	}
+
+	if (address.startsWith("unix://")) {
+		// unix://<path>[?<cookie>]
+		QString path = address.mid(7);
+		int sep = path.indexOf('?');
+		if (sep >= 0) {
+			m_cookie = path.mid(sep+1);
+			path.truncate(sep);
+		}
+
+		handler->open(path, QByteArray::fromHex(m_cookie.toLatin1()));
+		goto run;
+	}
+
+	if (!address.startsWith("tcp://")) {
+		qDebug() << "::PeerDrive::Connection: unknown address scheme: " << address;
+		goto run;
+	}
+
+	{
+		QStringList urlParts = address.mid(6).split("/");
+		if (urlParts.size() == 2) {
+			QStringList addrParts = urlParts.at(0).split(":");
+			if (addrParts.size() == 2) {
+				QString hostName = addrParts.at(0);
+				quint16 port = addrParts.at(1).toInt();
+
+				m_cookie = urlParts.at(1);
+
+				handler->open(hostName, port, QByteArray::fromHex(m_cookie.toLatin1()));
+			} else {
+				qDebug() << "::PeerDrive::Connection: malformed host: "
 				         << urlParts.at(0);
 			}
 		} else {
@@ -359,97 +2105,455 @@ void Connection::run()
 		}
 	}
 
-run:
-	startupDone.wakeAll();
-	exec();
-	delete handler;
+run:
+	startupDone.wakeAll();
+	exec();
+	delete handler;
+}
+
+Error Connection::rpc(int msg, const QByteArray &req, QByteArray &cnf)
+{
+	Request raw(req);
+	Frame frame;
+
+	Error err = rpc(msg, raw, frame);
+	cnf = frame.toByteArray();
+
+	return err;
+}
+
+Error Connection::rpc(int msg, const QByteArray &req)
+{
+	Request raw(req);
+	return rpc(msg, raw);
+}
+
+Error Connection::rpc(int msg, Request &req, Frame &cnf)
+{
+	cnf.clear();
+
+	ConnectionHandler::Completion completion;
+	completion.cnf = &cnf;
+	completion.reply = NULL;
+
+	return _rpc(msg, req, &completion);
+}
+
+Error Connection::rpc(int msg, Request &req)
+{
+	Frame cnf;
+
+	ConnectionHandler::Completion completion;
+	completion.cnf = &cnf;
+	completion.reply = NULL;
+
+	return _rpc(msg, req, &completion);
+}
+
+PendingReply *Connection::rpcAsync(int msg, const QByteArray &req)
+{
+	Request raw(req);
+	return rpcAsync(msg, raw);
+}
+
+PendingReply *Connection::rpcAsync(int msg, Request &req)
+{
+	PendingReply *reply = new PendingReply(handler, msg);
+
+	Error ret = handler->sendReq(msg, &reply->m_completion, req);
+	if (ret)
+		QMetaObject::invokeMethod(reply, "complete", Qt::QueuedConnection);
+
+	return reply;
+}
+
+Error Connection::rpcOneway(int msg, Request &req, OnewayGroup *group)
+{
+	return handler->sendOneway(msg, req, group ? group : &m_oneway);
+}
+
+Error Connection::flushOneway()
+{
+	return m_oneway.flush();
+}
+
+/*
+ * Flushes all connections of the pool which were created so far.
+ */
+Error Connection::flushAll()
+{
+	Error ret = ErrNoError;
+
+	for (int i = 0; i < MaxPoolSize; i++) {
+		Connection *conn = m_pool[i];
+		if (!conn)
+			continue;
+
+		Error err = conn->flushOneway();
+		if (!ret)
+			ret = err;
+	}
+
+	return ret;
+}
+
+static RpcStats makeStats(const QString &name, const RpcMetrics::Counters &c,
+	int inFlight)
+{
+	RpcStats stats;
+
+	stats.name = name;
+	stats.requests = c.requests;
+	stats.errors = c.errors;
+	stats.bytesOut = c.bytesOut;
+	stats.bytesIn = c.bytesIn;
+	stats.inFlight = inFlight;
+	stats.p50 = c.percentile(0.5);
+	stats.p90 = c.percentile(0.9);
+	stats.p99 = c.percentile(0.99);
+	stats.max = c.maxLatency;
+
+	return stats;
+}
+
+/*
+ * Sums up the metrics of all connections of the pool. Only message types and
+ * tags that were used are returned.
+ */
+void Connection::statistics(QList<RpcStats> *messages, QList<RpcStats> *tags)
+{
+	if (messages) {
+		for (int msg = 0; msg < MSG_COUNT; msg++) {
+			RpcMetrics::Counters sum;
+			int inFlight = 0;
+
+			for (int i = 0; i < MaxPoolSize; i++) {
+				Connection *conn = m_pool[i];
+				if (!conn)
+					continue;
+
+				const RpcMetrics &metrics = conn->handler->metrics();
+				sum.add(metrics.message(msg));
+				inFlight += metrics.messageInFlight(msg);
+			}
+
+			if (sum.requests || inFlight)
+				messages->append(makeStats(msg_names[msg], sum, inFlight));
+		}
+	}
+
+	if (tags) {
+		int count = RpcMetrics::tagCount();
+		for (int tag = 0; tag < count; tag++) {
+			RpcMetrics::Counters sum;
+			int inFlight = 0;
+
+			for (int i = 0; i < MaxPoolSize; i++) {
+				Connection *conn = m_pool[i];
+				if (!conn)
+					continue;
+
+				const RpcMetrics &metrics = conn->handler->metrics();
+				sum.add(metrics.tag(tag));
+				inFlight += metrics.tagInFlight(tag);
+			}
+
+			if (sum.requests || inFlight)
+				tags->append(makeStats(RpcMetrics::tagName(tag), sum, inFlight));
+		}
+	}
+}
+
+/*
+ * Dumps the flight recorders of all connections. The first connection writes
+ * to the given file, the others append their index to the name.
+ */
+bool Connection::dumpRecorders(const QString &fileName)
+{
+	bool ok = true;
+
+	for (int i = 0; i < MaxPoolSize; i++) {
+		Connection *conn = m_pool[i];
+		if (!conn)
+			continue;
+
+		QString name = i ? fileName + "." + QString::number(i) : fileName;
+		if (!conn->handler->dumpRecorder(name))
+			ok = false;
+	}
+
+	return ok;
+}
+
+void Connection::onewayFailed(int msg, PeerDrive::Error err)
+{
+	Q_UNUSED(msg);
+	emit requestFailed(err);
+}
+
+Error Connection::_rpc(int msg, Request &req, ConnectionHandler::Completion *completion)
+{
+	Error ret = handler->sendReq(msg, completion, req);
+	if (ret)
+		return ret;
+
+	handler->poll(completion);
+
+	return result(msg, completion);
+}
+
+Error Connection::result(int msg, ConnectionHandler::Completion *completion)
+{
+	if (completion->err)
+		return completion->err;
+
+	if (completion->msg == msg) {
+		return ErrNoError;
+	} else if (completion->msg == ERROR_MSG) {
+		ErrorCnf errCnf;
+		if (!errCnf.ParseFromArray(completion->cnf->constData(),
+		                           completion->cnf->size()))
+			return ErrBadRPC;
+		return static_cast<Error>(errCnf.error() + 1);
+	} else
+		return ErrBadRPC;
+}
+
+PendingReply::PendingReply(ConnectionHandler *handler, int msg)
+	: QObject()
+	, m_handler(handler)
+	, m_msg(msg)
+{
+	m_completion.cnf = &m_cnf;
+	m_completion.reply = this;
+}
+
+PendingReply::~PendingReply()
+{
+	// synchronizes with a concurrent completion in the I/O thread
+	m_handler->cancel(&m_completion);
+}
+
+bool PendingReply::isFinished() const
+{
+	return m_completion.isDone();
+}
+
+Error PendingReply::wait()
+{
+	if (!m_completion.isDone())
+		m_handler->poll(&m_completion);
+
+	return Connection::result(m_msg, &m_completion);
+}
+
+void PendingReply::complete()
+{
+	emit finished();
+}
+
+/****************************************************************************/
+
+AttachmentSink::~AttachmentSink()
+{
+}
+
+/****************************************************************************/
+
+PendingCall::PendingCall()
+	: m_handler(NULL)
+	, m_msg(0)
+{
+	m_completion.cnf = &m_cnf;
+	m_completion.reply = NULL;
+}
+
+PendingCall::~PendingCall()
+{
+	cancel();
+}
+
+Error PendingCall::send(Connection *conn, int msg, Request &req)
+{
+	cancel();
+
+	m_msg = msg;
+	Error err = conn->handler->sendReq(msg, &m_completion, req);
+	if (!err)
+		m_handler = conn->handler;
+
+	return err;
+}
+
+Error PendingCall::wait()
+{
+	if (!m_handler)
+		return ErrBadF;
+
+	m_handler->poll(&m_completion);
+	m_handler = NULL;
+
+	return Connection::result(m_msg, &m_completion);
 }
 
-void Connection::sendInit()
+void PendingCall::cancel()
 {
-	InitReq req;
-	InitCnf cnf;
-	QByteArray rawReq, rawCnf;
+	if (!m_handler)
+		return;
 
-	req.set_major(2);
-	req.set_minor(0);
-	QByteArray cookie = QByteArray::fromHex(m_cookie.toLatin1());
-	req.set_cookie(cookie.constData(), cookie.size());
+	m_handler->cancel(&m_completion);
+	m_handler = NULL;
+	m_cnf.clear();
+}
 
-	rawReq.resize(req.ByteSize());
-	req.SerializeWithCachedSizesToArray((google::protobuf::uint8*)rawReq.data());
+/****************************************************************************/
 
-	Error err = rpc(INIT_MSG, rawReq, rawCnf);
-	if (err) {
-		qDebug() << "::PeerDrive::Connection: INIT_MSG failed:" << err;
-		goto failed;
-	}
+OnewayGroup::OnewayGroup()
+{
+}
 
-	if (!cnf.ParseFromArray(rawCnf.constData(), rawCnf.size())) {
-		err = ErrBadRPC;
-		goto failed;
-	}
+OnewayGroup::~OnewayGroup()
+{
+	// the handler still refers to us until everything is confirmed
+	flush();
+}
 
-	if (cnf.major() != 2 || cnf.minor() != 0) {
-		qDebug() << "::PeerDrive::Connection: unsupported server version:" <<
-			cnf.major() << ":" << cnf.minor();
-		err = ErrRPCMISMATCH;
-		goto failed;
+/*
+ * Always takes the mutex: the last done() still holds it after m_pending
+ * dropped to zero and the group must not go away before it has let go.
+ */
+Error OnewayGroup::flush()
+{
+	{
+		QMutexLocker locker(&m_mutex);
+		while (m_pending)
+			m_idle.wait(&m_mutex);
 	}
 
-	m_maxPacketSize = cnf.max_packet_size();
-	return;
+	return static_cast<Error>(m_error.fetchAndStoreOrdered(ErrNoError));
+}
 
-failed:
-	handler->disconnect();
+void OnewayGroup::sent()
+{
+	m_pending.ref();
 }
 
-Error Connection::rpc(int msg, const QByteArray &req, QByteArray &cnf)
+void OnewayGroup::done(Error err)
 {
-	cnf.clear();
+	if (err)
+		m_error.testAndSetOrdered(ErrNoError, err);
 
-	ConnectionHandler::Completion completion;
-	completion.cnf = &cnf;
+	QMutexLocker locker(&m_mutex);
+	if (!m_pending.deref())
+		m_idle.wakeAll();
+}
 
-	return _rpc(msg, req, &completion);
+/****************************************************************************/
+
+/*
+ * The handler finished the INIT handshake. Everything the daemon knew about
+ * this session is gone after a reconnect and has to be set up again.
+ */
+void Connection::sessionReady()
+{
+	if (m_established)
+		restoreSession();
+	else
+		m_established = true;
+
+	emit ready();
 }
 
-Error Connection::rpc(int msg, const QByteArray &req)
+/*
+ * The daemon was restarted and the handler is connected again. The watches
+ * and progress notifications are lost on the daemon side and registered
+ * again. Progress items that ended in the meantime would never finish
+ * otherwise, so all known items are finished and the running ones started
+ * again.
+ *
+ * Nothing is waited for here. This usually runs in the GUI thread and
+ * other threads must not stall on the mutexes for a round trip per watch.
+ * Failed watches are reported through requestFailed(), the running
+ * operations are dispatched by progressRestored().
+ */
+void Connection::restoreSession()
 {
-	QByteArray cnf;
+	{
+		QMutexLocker lock(&watchMutex);
 
-	ConnectionHandler::Completion completion;
-	completion.cnf = &cnf;
+		foreach (const DId &doc, m_docWatches.keys())
+			sendWatchAdd(WatchAddReq::DOC, doc.toStdString(), true);
 
-	return _rpc(msg, req, &completion);
+		foreach (const RId &rev, m_revWatches.keys())
+			sendWatchAdd(WatchAddReq::REV, rev.toStdString(), true);
+	}
+
+	QMutexLocker lock(&progressMutex);
+
+	delete m_progressRestore;
+	m_progressRestore = NULL;
+
+	if (m_progressWatches.isEmpty())
+		return;
+
+	foreach (unsigned int tag, m_progressItems.keys()) {
+		delete m_progressItems.take(tag);
+		foreach (ProgressWatcher *w, m_progressWatches)
+			emit w->finished(tag);
+	}
+
+	WatchProgressReq req;
+	req.set_enable(true);
+	Request rawReq(req);
+	Error err = rpcOneway(WATCH_PROGRESS_MSG, rawReq);
+	if (err) {
+		qDebug() << "::PeerDrive::Connection: restore progress failed:" << err;
+		return;
+	}
+
+	Request query;
+	m_progressRestore = rpcAsync(PROGRESS_QUERY_MSG, query);
+	QObject::connect(m_progressRestore, SIGNAL(finished()), this,
+		SLOT(progressRestored()));
 }
 
-Error Connection::_rpc(int msg, const QByteArray &req, ConnectionHandler::Completion *completion)
+/*
+ * The daemon answered which operations are running after a reconnect. The
+ * indications that were dispatched in the meantime came before the answer,
+ * so items that they already started are only updated.
+ */
+void Connection::progressRestored()
 {
-	Error ret = handler->sendReq(msg, completion, req);
-	if (ret)
-		return ret;
+	QMutexLocker lock(&progressMutex);
 
-	ret = handler->poll(completion);
-	if (ret)
-		return ret;
+	PendingReply *reply = m_progressRestore;
+	if (!reply || reply != sender())
+		return;
+	m_progressRestore = NULL;
 
-	if (completion->msg == msg) {
-		return ErrNoError;
-	} else if (completion->msg == ERROR_MSG) {
-		ErrorCnf errCnf;
-		if (!errCnf.ParseFromArray(completion->cnf->constData(),
-		                           completion->cnf->size()))
-			return ErrBadRPC;
-		return static_cast<Error>(errCnf.error() + 1);
-	} else
-		return ErrBadRPC;
+	ProgressQueryCnf cnf;
+	Error err = reply->wait(cnf);
+	reply->deleteLater();
+	if (err) {
+		qDebug() << "::PeerDrive::Connection: restore progress failed:" << err;
+		return;
+	}
+
+	if (m_progressWatches.isEmpty())
+		return;
+
+	for (int i = 0; i < cnf.items_size(); i++) {
+		const ProgressQueryCnf_Item &item = cnf.items(i);
+		if (!m_progressItems.contains(item.item().tag()))
+			dispatchProgressStart(item.item(), true);
+		dispatchProgress(item.state(), true);
+	}
 }
 
-void Connection::dispatchIndication(const QByteArray &buf)
+void Connection::dispatchIndication(const Frame &buf)
 {
 	quint16 msg = qFromBigEndian<quint16>((const uchar *)buf.constData()) >> 4;
-	QByteArray packet = buf.mid(2);
+	Frame packet = buf.mid(2);
 
 	switch (msg) {
 		case WATCH_MSG:
@@ -479,7 +2583,7 @@ void Connection::dispatchIndication(const QByteArray &buf)
 	}
 }
 
-void Connection::dispatchWatch(const QByteArray &packet)
+void Connection::dispatchWatch(const Frame &packet)
 {
 	QMutexLocker lock(&watchMutex);
 
@@ -566,7 +2670,7 @@ void Connection::dispatchProgress(const ProgressInd &ind, bool dispatch)
 			emit w->changed(tag);
 }
 
-void Connection::dispatchProgressEnd(const QByteArray &packet)
+void Connection::dispatchProgressEnd(const Frame &packet)
 {
 	ProgressEndInd ind;
 	if (!ind.ParseFromArray(packet.constData(), packet.size()))
@@ -584,6 +2688,45 @@ void Connection::dispatchProgressEnd(const QByteArray &packet)
 		emit w->finished(tag);
 }
 
+/*
+ * Enable progress notifications and fetch all ongoing operations. Must be
+ * called with the progressMutex held.
+ */
+Error Connection::enableProgress(bool dispatch)
+{
+	Frame rawCnf;
+
+	// enable notifications
+	WatchProgressReq req;
+	req.set_enable(true);
+	Request rawReq(req);
+	Error err = rpc(WATCH_PROGRESS_MSG, rawReq);
+	if (err) {
+		qDebug() << "::PeerDrive::Connection::enableProgress: enable failed:" << err;
+		return err;
+	}
+
+	// query ongoing operations
+	Request query;
+	err = rpc(PROGRESS_QUERY_MSG, query, rawCnf);
+	if (err) {
+		qDebug() << "::PeerDrive::Connection::enableProgress: query failed:" << err;
+		return err;
+	}
+
+	ProgressQueryCnf cnf;
+	if (!cnf.ParseFromArray(rawCnf.constData(), rawCnf.size()))
+		return ErrBadRPC;
+
+	for (int i = 0; i < cnf.items_size(); i++) {
+		const ProgressQueryCnf_Item &item = cnf.items(i);
+		dispatchProgressStart(item.item(), dispatch);
+		dispatchProgress(item.state(), dispatch);
+	}
+
+	return ErrNoError;
+}
+
 void Connection::addProgressWatch(ProgressWatcher *watch)
 {
 	QMutexLocker lock(&progressMutex);
@@ -592,38 +2735,8 @@ void Connection::addProgressWatch(ProgressWatcher *watch)
 	 * If we're the first then we have to query all ongoing operations and
 	 * request to be notified in the future.
 	 */
-	if (m_progressWatches.isEmpty()) {
-		QByteArray rawReq, rawCnf;
-
-		// enable notifications
-		WatchProgressReq req;
-		req.set_enable(true);
-		rawReq.resize(req.ByteSize());
-		req.SerializeWithCachedSizesToArray((google::protobuf::uint8*)rawReq.data());
-		Error err = rpc(WATCH_PROGRESS_MSG, rawReq);
-		if (err) {
-			qDebug() << "::PeerDrive::Connection::addProgressWatch: enable failed:" << err;
-			return;
-		}
-
-		// query ongoing operations
-		rawReq.resize(0);
-		err = rpc(PROGRESS_QUERY_MSG, rawReq, rawCnf);
-		if (err) {
-			qDebug() << "::PeerDrive::Connection::addProgressWatch: query failed:" << err;
-			return;
-		}
-
-		ProgressQueryCnf cnf;
-		if (!cnf.ParseFromArray(rawCnf.constData(), rawCnf.size()))
-			return;
-
-		for (int i = 0; i < cnf.items_size(); i++) {
-			const ProgressQueryCnf_Item &item = cnf.items(i);
-			dispatchProgressStart(item.item(), false);
-			dispatchProgress(item.state(), false);
-		}
-	}
+	if (m_progressWatches.isEmpty() && enableProgress(false))
+		return;
 
 	m_progressWatches.append(watch);
 }
@@ -644,10 +2757,8 @@ void Connection::delProgressWatch(ProgressWatcher *watch)
 
 		// disable notification
 		WatchProgressReq req;
-		QByteArray rawReq;
 		req.set_enable(false);
-		rawReq.resize(req.ByteSize());
-		req.SerializeWithCachedSizesToArray((google::protobuf::uint8*)rawReq.data());
+		Request rawReq(req);
 		Error err = rpc(WATCH_PROGRESS_MSG, rawReq);
 		if (err)
 			qDebug() << "::PeerDrive::Connection::delProgressWatch failed:" << err;
@@ -664,6 +2775,27 @@ QList<unsigned int> Connection::progressTags() const
 	return m_progressItems.keys();
 }
 
+/*
+ * Restored watches are sent one-way, their failures are reported through
+ * requestFailed().
+ */
+Error Connection::sendWatchAdd(WatchAddReq::Type type, const std::string &element,
+	bool oneway)
+{
+	WatchAddReq req;
+
+	req.set_type(type);
+	req.set_element(element);
+
+	// All watch requests share one lane. A WATCH_REM that is still queued on
+	// a slower lane could otherwise overtake a later WATCH_ADD.
+	Request rawReq(req);
+	rawReq.setPriority(PriorityInteractive);
+	if (oneway)
+		return rpcOneway(WATCH_ADD_MSG, rawReq);
+	return rpc(WATCH_ADD_MSG, rawReq);
+}
+
 Error Connection::addWatch(LinkWatcher *watch, const DId &doc)
 {
 	QMutexLocker lock(&watchMutex);
@@ -672,16 +2804,7 @@ Error Connection::addWatch(LinkWatcher *watch, const DId &doc)
 	if (m_docWatches.contains(doc)) {
 		m_docWatches[doc].append(watch);
 	} else {
-		WatchAddReq req;
-		QByteArray rawReq;
-
-		req.set_type(WatchAddReq::DOC);
-		req.set_element(doc.toStdString());
-
-		rawReq.resize(req.ByteSize());
-		req.SerializeWithCachedSizesToArray((google::protobuf::uint8*)rawReq.data());
-
-		err = rpc(WATCH_ADD_MSG, rawReq);
+		err = sendWatchAdd(WatchAddReq::DOC, doc.toStdString());
 		if (!err)
 			m_docWatches[doc].append(watch);
 		else
@@ -699,16 +2822,7 @@ Error Connection::addWatch(LinkWatcher *watch, const RId &rev)
 	if (m_revWatches.contains(rev)) {
 		m_revWatches[rev].append(watch);
 	} else {
-		WatchAddReq req;
-		QByteArray rawReq;
-
-		req.set_type(WatchAddReq::REV);
-		req.set_element(rev.toStdString());
-
-		rawReq.resize(req.ByteSize());
-		req.SerializeWithCachedSizesToArray((google::protobuf::uint8*)rawReq.data());
-
-		err = rpc(WATCH_ADD_MSG, rawReq);
+		err = sendWatchAdd(WatchAddReq::REV, rev.toStdString());
 		if (!err)
 			m_revWatches[rev].append(watch);
 		else
@@ -726,15 +2840,14 @@ void Connection::delWatch(LinkWatcher *watch, const DId &doc)
 
 	if (watches.isEmpty()) {
 		WatchRemReq req;
-		QByteArray rawReq;
 
 		req.set_type(WatchRemReq::DOC);
 		req.set_element(doc.toStdString());
 
-		rawReq.resize(req.ByteSize());
-		req.SerializeWithCachedSizesToArray((google::protobuf::uint8*)rawReq.data());
+		Request rawReq(req);
+		rawReq.setPriority(PriorityInteractive);
 
-		Error err = rpc(WATCH_REM_MSG, rawReq);
+		Error err = rpcOneway(WATCH_REM_MSG, rawReq);
 		if (err)
 			qDebug() << "::PeerDrive::Connection: delWatch failed:" << err;
 		m_docWatches.remove(doc);
@@ -749,15 +2862,14 @@ void Connection::delWatch(LinkWatcher *watch, const RId &rev)
 
 	if (watches.isEmpty()) {
 		WatchRemReq req;
-		QByteArray rawReq;
 
 		req.set_type(WatchRemReq::REV);
 		req.set_element(rev.toStdString());
 
-		rawReq.resize(req.ByteSize());
-		req.SerializeWithCachedSizesToArray((google::protobuf::uint8*)rawReq.data());
+		Request rawReq(req);
+		rawReq.setPriority(PriorityInteractive);
 
-		Error err = rpc(WATCH_REM_MSG, rawReq);
+		Error err = rpcOneway(WATCH_REM_MSG, rawReq);
 		if (err)
 			qDebug() << "::PeerDrive::Connection: delWatch failed:" << err;
 		m_revWatches.remove(rev);
@@ -1045,9 +3157,9 @@ void LinkWatcher::addWatch(const Link &item)
 
 	bool added;
 	if (item.isDocLink())
-		added = Connection::instance()->addWatch(this, item.doc()) == 0;
+		added = Connection::primary()->addWatch(this, item.doc()) == 0;
 	else
-		added = Connection::instance()->addWatch(this, item.rev()) == 0;
+		added = Connection::primary()->addWatch(this, item.rev()) == 0;
 
 	if (added)
 		watchedLinks.append(item);
@@ -1062,9 +3174,9 @@ void LinkWatcher::removeWatch(const Link &item)
 
 	watchedLinks.removeAll(item);
 	if (item.isDocLink())
-		Connection::instance()->delWatch(this, item.doc());
+		Connection::primary()->delWatch(this, item.doc());
 	else
-		Connection::instance()->delWatch(this, item.rev());
+		Connection::primary()->delWatch(this, item.rev());
 }
 
 void LinkWatcher::dispatch(const Link &item, int event)
@@ -1097,65 +3209,65 @@ void LinkWatcher::dispatch(const Link &item, int event)
 ProgressWatcher::ProgressWatcher(QObject *parent)
 	: QObject(parent)
 {
-	Connection::instance()->addProgressWatch(this);
+	Connection::primary()->addProgressWatch(this);
 }
 
 ProgressWatcher::~ProgressWatcher()
 {
-	Connection::instance()->delProgressWatch(this);
+	Connection::primary()->delProgressWatch(this);
 }
 
 Link ProgressWatcher::source(unsigned int tag) const
 {
-	Connection::Progress *p = Connection::instance()->findProgress(tag);
+	Connection::Progress *p = Connection::primary()->findProgress(tag);
 	return p ? Link(p->src, p->src) : Link();
 }
 
 Link ProgressWatcher::destination(unsigned int tag) const
 {
-	Connection::Progress *p = Connection::instance()->findProgress(tag);
+	Connection::Progress *p = Connection::primary()->findProgress(tag);
 	return p ? Link(p->dst, p->dst) : Link();
 }
 
 Link ProgressWatcher::item(unsigned int tag) const
 {
-	Connection::Progress *p = Connection::instance()->findProgress(tag);
+	Connection::Progress *p = Connection::primary()->findProgress(tag);
 	return p ? p->item : Link();
 }
 
 ProgressWatcher::Type ProgressWatcher::type(unsigned int tag) const
 {
-	Connection::Progress *p = Connection::instance()->findProgress(tag);
+	Connection::Progress *p = Connection::primary()->findProgress(tag);
 	return p ? p->type : Synchronization;
 }
 
 ProgressWatcher::State ProgressWatcher::state(unsigned int tag) const
 {
-	Connection::Progress *p = Connection::instance()->findProgress(tag);
+	Connection::Progress *p = Connection::primary()->findProgress(tag);
 	return p ? p->state : StateError;
 }
 
 Error ProgressWatcher::error(unsigned int tag) const
 {
-	Connection::Progress *p = Connection::instance()->findProgress(tag);
+	Connection::Progress *p = Connection::primary()->findProgress(tag);
 	return p ? p->error : ErrNoError;
 }
 
 Link ProgressWatcher::errorItem(unsigned int tag) const
 {
-	Connection::Progress *p = Connection::instance()->findProgress(tag);
+	Connection::Progress *p = Connection::primary()->findProgress(tag);
 	return p ? p->errorItem : Link();
 }
 
 int ProgressWatcher::progress(unsigned int tag) const
 {
-	Connection::Progress *p = Connection::instance()->findProgress(tag);
+	Connection::Progress *p = Connection::primary()->findProgress(tag);
 	return p ? p->progress : 0;
 }
 
 QList<unsigned int> ProgressWatcher::tags() const
 {
-	return Connection::instance()->progressTags();
+	return Connection::primary()->progressTags();
 }
 
 int ProgressWatcher::pause(unsigned int tag)
@@ -1190,11 +3302,90 @@ int ProgressWatcher::stop(unsigned int tag)
 
 /****************************************************************************/
 
+void setConnectionPoolSize(int size)
+{
+	Connection::setPoolSize(size);
+}
+
+int connectionPoolSize()
+{
+	return Connection::poolSize();
+}
+
+Error flushRequests()
+{
+	return Connection::flushAll();
+}
+
+QList<RpcStats> rpcStatistics()
+{
+	QList<RpcStats> stats;
+	Connection::statistics(&stats, NULL);
+	return stats;
+}
+
+QList<RpcStats> rpcTagStatistics()
+{
+	QList<RpcStats> stats;
+	Connection::statistics(NULL, &stats);
+	return stats;
+}
+
+static void dumpStats(const QList<RpcStats> &stats)
+{
+	foreach (const RpcStats &s, stats) {
+		qDebug() << "::PeerDrive::Stats:" << qPrintable(s.name.leftJustified(20))
+		         << "req" << s.requests << "err" << s.errors
+		         << "out" << s.bytesOut << "in" << s.bytesIn
+		         << "inflight" << s.inFlight
+		         << "p50" << s.p50 << "p90" << s.p90 << "p99" << s.p99
+		         << "max" << s.max;
+	}
+}
+
+bool dumpFlightRecorder(const QString &fileName)
+{
+	return Connection::dumpRecorders(fileName);
+}
+
+void dumpRpcStatistics()
+{
+	QList<RpcStats> messages, tags;
+	Connection::statistics(&messages, &tags);
+
+	dumpStats(messages);
+	dumpStats(tags);
+}
+
+bool isConnected()
+{
+	return Connection::primary()->isReady();
+}
+
+bool waitForConnected(int msecs)
+{
+	return Connection::primary()->waitForReady(msecs);
+}
+
+ConnectionWatcher::ConnectionWatcher(QObject *parent)
+	: QObject(parent)
+{
+	Connection *conn = Connection::primary();
+
+	connect(conn, SIGNAL(ready()), this, SIGNAL(ready()));
+	connect(conn, SIGNAL(lost()), this, SIGNAL(lost()));
+	connect(conn, SIGNAL(requestFailed(PeerDrive::Error)), this,
+		SIGNAL(requestFailed(PeerDrive::Error)));
+}
+
+/****************************************************************************/
+
 Mounts::Mounts()
 	: m_sysStore(NULL)
 {
 	EnumCnf cnf;
-	QByteArray rawReq, rawCnf;
+	Request rawReq;
+	Frame rawCnf;
 	Error err = Connection::instance()->rpc(ENUM_MSG, rawReq, rawCnf);
 	if (err) {
 		qDebug() << "::PeerDrive::Mounts: EnumReq failed:" << err << "\n";
@@ -1326,7 +3517,7 @@ namespace PeerDrive {
 			fetch(rid, stores);
 		}
 
-		RevInfoPrivate(const StatCnf &cnf)
+		RevInfoPrivate(const StatCnfCodec &cnf)
 			: m_error(ErrNoError)
 		{
 			decode(cnf);
@@ -1373,50 +3564,53 @@ namespace PeerDrive {
 	private:
 		void fetch(const RId &rid, const QList<DId> *stores)
 		{
-			StatReq req;
-			StatCnf cnf;
+			StatReq &req = threadMessage<StatReq>();
+			StatCnfCodec cnf;
+			Frame rawCnf;
 
 			m_exists = false;
 			m_flags = 0;
 
-			req.set_rev(rid.toStdString());
+			QByteArray rev = rid.toByteArray();
+			req.set_rev(rev.constData(), rev.size());
 			if (stores) {
 				QList<DId>::const_iterator i;
-				for (i = stores->constBegin(); i != stores->constEnd(); i++)
-					req.add_stores((*i).toStdString());
+				for (i = stores->constBegin(); i != stores->constEnd(); i++) {
+					QByteArray store = (*i).toByteArray();
+					req.add_stores(store.constData(), store.size());
+				}
 			}
 
-			m_error = Connection::defaultRPC<StatReq, StatCnf>(STAT_MSG, req, cnf);
+			m_error = Connection::defaultRPC(Connection::instance(), STAT_MSG,
+				req, cnf, rawCnf);
 			if (m_error)
 				return;
 
 			decode(cnf);
 		}
 
-		void decode(const StatCnf &cnf)
+		void decode(const StatCnfCodec &cnf)
 		{
-			m_flags = cnf.flags();
-			m_dataSize = cnf.data().size();
-			m_dataHash = PId(cnf.data().hash());
-			for (int j = 0; j < cnf.attachments_size(); j++) {
-				const StatCnf_Attachment & a = cnf.attachments(j);
-				QString name(a.name().c_str());
+			m_flags = cnf.flags;
+			m_dataSize = cnf.dataSize;
+			m_dataHash = PId(cnf.dataHash.toByteArray());
+			for (int j = 0; j < cnf.attachments.size(); j++) {
+				const StatCnfCodec::Attachment &a = cnf.attachments[j];
+				QString name = QString::fromAscii(a.name.data, a.name.size);
 
 				Attachment &attachment = m_attachments[name];
-				attachment.size = a.size();
-				attachment.hash = PId(a.hash());
-				attachment.crtime.setMSecsSinceEpoch(a.crtime() / 1000);
-				attachment.mtime.setMSecsSinceEpoch(a.mtime() / 1000);
-			}
-			for (int j = 0; j < cnf.parents_size(); j++) {
-				RId rid(cnf.parents(j));
-				m_parents.append(rid);
+				attachment.size = a.size;
+				attachment.hash = PId(a.hash.toByteArray());
+				attachment.crtime.setMSecsSinceEpoch(a.crtime / 1000);
+				attachment.mtime.setMSecsSinceEpoch(a.mtime / 1000);
 			}
-			m_mtime.setMSecsSinceEpoch(cnf.mtime() / 1000);
-			m_crtime.setMSecsSinceEpoch(cnf.crtime() / 1000);
-			m_type = QString::fromUtf8(cnf.type_code().c_str());
-			m_creator = QString::fromUtf8(cnf.creator_code().c_str());
-			m_comment = QString::fromUtf8(cnf.comment().c_str());
+			for (int j = 0; j < cnf.parents.size(); j++)
+				m_parents.append(RId(cnf.parents[j].toByteArray()));
+			m_mtime.setMSecsSinceEpoch(cnf.mtime / 1000);
+			m_crtime.setMSecsSinceEpoch(cnf.crtime / 1000);
+			m_type = QString::fromUtf8(cnf.typeCode.data, cnf.typeCode.size);
+			m_creator = QString::fromUtf8(cnf.creatorCode.data, cnf.creatorCode.size);
+			m_comment = QString::fromUtf8(cnf.comment.data, cnf.comment.size);
 			m_exists = true;
 		}
 	};
@@ -1748,14 +3942,22 @@ QList<RId> LinkInfo::revLinks() const
 
 Document::Document()
 {
+	m_conn = NULL;
 	m_open = false;
+	m_epoch = 0;
 	m_error = ErrBadF;
+	m_priority = PriorityBulk;
+	m_pipelineDepth = DefaultPipelineDepth;
 }
 
 Document::Document(const Link &link)
 {
+	m_conn = NULL;
 	m_open = false;
+	m_epoch = 0;
 	m_error = ErrBadF;
+	m_priority = PriorityBulk;
+	m_pipelineDepth = DefaultPipelineDepth;
 	m_link = link;
 }
 
@@ -1791,12 +3993,17 @@ bool Document::peek()
 		return false;
 	}
 
-	PeekReq req;
-	PeekCnf cnf;
-
-	req.set_store(m_link.store().toStdString());
-	req.set_rev(m_link.rev().toStdString());
-	m_error = Connection::defaultRPC<PeekReq, PeekCnf>(PEEK_MSG, req, cnf);
+	PeekReq &req = threadMessage<PeekReq>();
+	PeekCnf &cnf = threadMessage<PeekCnf>();
+
+	QByteArray store = m_link.store().toByteArray();
+	QByteArray rev = m_link.rev().toByteArray();
+	req.set_store(store.constData(), store.size());
+	req.set_rev(rev.constData(), rev.size());
+	m_conn = Connection::instance();
+	m_epoch = m_conn->epoch();
+	SessionScope session(m_epoch);
+	m_error = Connection::defaultRPC<PeekReq, PeekCnf>(m_conn, PEEK_MSG, req, cnf);
 	if (m_error)
 		return false;
 
@@ -1821,7 +4028,10 @@ bool Document::update(const QString &creator)
 	req.set_rev(m_link.rev().toStdString());
 	if (!creator.isNull())
 		req.set_creator_code(creator.toUtf8().constData());
-	m_error = Connection::defaultRPC<UpdateReq, UpdateCnf>(UPDATE_MSG, req, cnf);
+	m_conn = Connection::instance();
+	m_epoch = m_conn->epoch();
+	SessionScope session(m_epoch);
+	m_error = Connection::defaultRPC<UpdateReq, UpdateCnf>(m_conn, UPDATE_MSG, req, cnf);
 	if (m_error)
 		return false;
 
@@ -1846,7 +4056,10 @@ bool Document::resume(const QString &creator)
 	req.set_rev(m_link.rev().toStdString());
 	if (!creator.isNull())
 		req.set_creator_code(creator.toUtf8().constData());
-	m_error = Connection::defaultRPC<ResumeReq, ResumeCnf>(RESUME_MSG, req, cnf);
+	m_conn = Connection::instance();
+	m_epoch = m_conn->epoch();
+	SessionScope session(m_epoch);
+	m_error = Connection::defaultRPC<ResumeReq, ResumeCnf>(m_conn, RESUME_MSG, req, cnf);
 	if (m_error)
 		return false;
 
@@ -1862,12 +4075,14 @@ Value Document::get(const QString &selector)
 		return Value();
 	}
 
-	GetDataReq req;
-	GetDataCnf cnf;
+	SessionScope session(m_epoch);
+	GetDataReq &req = threadMessage<GetDataReq>();
+	GetDataCnf &cnf = threadMessage<GetDataCnf>();
+	QByteArray sel = selector.toAscii();
 	req.set_handle(m_handle);
-	req.set_selector(selector.toStdString());
+	req.set_selector(sel.constData(), sel.size());
 
-	m_error = Connection::defaultRPC<GetDataReq, GetDataCnf>(GET_DATA_MSG, req, cnf);
+	m_error = Connection::defaultRPC<GetDataReq, GetDataCnf>(m_conn, GET_DATA_MSG, req, cnf);
 	if (m_error)
 		return Value();
 
@@ -1884,12 +4099,13 @@ bool Document::set(const QString &selector, const Value &value)
 
 	QByteArray data = value.toByteArray();
 
+	SessionScope session(m_epoch);
 	SetDataReq req;
 	req.set_handle(m_handle);
 	req.set_selector(selector.toStdString());
 	req.set_data(data.constData(), data.size());
 
-	m_error = Connection::defaultRPC<SetDataReq>(SET_DATA_MSG, req);
+	m_error = Connection::defaultRPC<SetDataReq>(m_conn, SET_DATA_MSG, req);
 	if (m_error)
 		return false;
 
@@ -1901,6 +4117,26 @@ qint64 Document::pos(const QString &attachment) const
 	return m_pos.value(attachment, 0);
 }
 
+Priority Document::priority() const
+{
+	return m_priority;
+}
+
+void Document::setPriority(Priority priority)
+{
+	m_priority = priority;
+}
+
+int Document::pipelineDepth() const
+{
+	return m_pipelineDepth;
+}
+
+void Document::setPipelineDepth(int depth)
+{
+	m_pipelineDepth = qBound(1, depth, (int)MaxPipelineDepth);
+}
+
 bool Document::seek(const QString &attachment, qint64 pos)
 {
 	if (!m_open || pos < 0)
@@ -1910,36 +4146,75 @@ bool Document::seek(const QString &attachment, qint64 pos)
 	return true;
 }
 
-qint64 Document::read(const QString &attachment, char *data, qint64 maxSize, qint64 off)
+/*
+ * Reads into data or, if a sink is given, hands the data to the sink packet
+ * by packet.
+ */
+qint64 Document::read(const QString &attachment, char *data, qint64 maxSize, qint64 off,
+	AttachmentSink *sink)
 {
 	if (!m_open) {
 		m_error = ErrBadF;
 		return -1;
 	}
 
+	PriorityScope scope(m_priority);
+	SessionScope session(m_epoch);
+	StatsTag tag("Document I/O");
+	QByteArray part = attachment.toAscii();
+	unsigned int mps = m_conn->maxPacketSize();
+
+	// Window of pipelined requests. The confirmations are taken in the order
+	// of the requests. Without a sink the I/O thread copies the data straight
+	// into place. Calls that are still pending when returning are cancelled
+	// by their destructor.
+	PendingCall window[MaxPipelineDepth];
+	int depth = m_pipelineDepth;
+	int head = 0, pending = 0;
+	qint64 requested = 0;
 	qint64 len = 0;
-	unsigned int mps = Connection::instance()->maxPacketSize();
 
-	while (maxSize > 0) {
-		unsigned int chunk = maxSize > mps ? mps : maxSize;
+	while (len < maxSize) {
+		while (pending < depth && requested < maxSize) {
+			unsigned int chunk = qMin<qint64>(maxSize - requested, mps);
+			ReadReqCodec req(m_handle, part, off + requested, chunk);
+			PendingCall &call = window[(head + pending) % depth];
 
-		ReadReq req;
-		ReadCnf cnf;
+			call.setDestination(sink ? NULL : data + requested, chunk);
+			m_error = call.send(m_conn, req);
+			if (m_error)
+				return -1;
 
-		req.set_handle(m_handle);
-		req.set_part(attachment.toStdString());
-		req.set_offset(off);
-		req.set_length(chunk);
-		m_error = Connection::defaultRPC<ReadReq, ReadCnf>(READ_MSG, req, cnf);
-		if (m_error)
-			return -1;
+			requested += chunk;
+			pending++;
+		}
 
-		unsigned int size = cnf.data().copy(data, chunk);
-		off += size;
-		len += size;
-		data += size;
-		maxSize -= size;
+		PendingCall &call = window[head];
+		head = (head + 1) % depth;
+		pending--;
+
+		// a short read means the end of the attachment
+		unsigned int chunk = qMin<qint64>(maxSize - len, mps);
+		unsigned int size;
+		if (sink) {
+			ReadCnfCodec cnf;
+			m_error = call.wait(cnf);
+			if (m_error)
+				return -1;
+
+			size = qMin<unsigned int>(cnf.data.size, chunk);
+			if (size && !sink->write(cnf.data.data, size)) {
+				m_error = ErrINTR;
+				return -1;
+			}
+		} else {
+			m_error = call.wait();
+			if (m_error)
+				return -1;
 
+			size = call.delivered();
+		}
+		len += size;
 		if (size < chunk)
 			break;
 	}
@@ -1973,26 +4248,99 @@ qint64 Document::read(const QString &attachment, QByteArray &data, qint64 maxSiz
 
 qint64 Document::readAll(const QString &attachment, QByteArray &data)
 {
-	QByteArray tmp;
-
-	tmp.resize(0x10000);
 	data.resize(0);
+	if (!m_open) {
+		m_error = ErrBadF;
+		return -1;
+	}
 
-	qint64 off = 0;
-	qint64 len;
-	do {
-		len = read(attachment, tmp.data(), 0x10000, off);
-		if (len < 0) {
+	PriorityScope scope(m_priority);
+	SessionScope session(m_epoch);
+	StatsTag tag("Document I/O");
+	QByteArray part = attachment.toAscii();
+	unsigned int mps = m_conn->maxPacketSize();
+
+	// Ask for the size and the first packet at once. Small attachments are
+	// done after a single round trip, the FSTAT is cancelled then.
+	FStatReq statReq;
+	statReq.set_handle(m_handle);
+	PendingCall stat, first;
+	m_error = stat.send(m_conn, statReq);
+	if (!m_error)
+		m_error = first.send(m_conn, ReadReqCodec(m_handle, part, 0, mps));
+	if (m_error)
+		return -1;
+
+	ReadCnfCodec readCnf;
+	m_error = first.wait(readCnf);
+	if (m_error)
+		return -1;
+
+	unsigned int head = qMin<unsigned int>(readCnf.data.size, mps);
+	if (head < mps) {
+		data = QByteArray(readCnf.data.data, head);
+		return head;
+	}
+
+	qint64 size = -1;
+	StatCnfCodec statCnf;
+	if (!stat.wait(statCnf)) {
+		for (int i = 0; i < statCnf.attachments.size(); i++) {
+			const Wire::Bytes &name = statCnf.attachments[i].name;
+			if (name.size == part.size() &&
+			    !memcmp(name.data, part.constData(), name.size)) {
+				size = statCnf.attachments[i].size;
+				break;
+			}
+		}
+	}
+
+	// a QByteArray cannot hold more, use the AttachmentSink variant
+	const qint64 maxSize = 0x7f000000;
+	if (size > maxSize) {
+		m_error = ErrFBIG;
+		return -1;
+	}
+
+	// Allocate the destination once and read the rest straight into it. The
+	// attachment can only grow through this handle, so its size is known. If
+	// it is not, grow the buffer until a short read.
+	qint64 len = head;
+	qint64 chunk = size >= 0 ? size - head : 0x10000;
+	data.resize(head + qMax<qint64>(chunk, 0));
+	memcpy(data.data(), readCnf.data.data, head);
+
+	while (chunk > 0) {
+		qint64 ret = read(attachment, data.data() + len, chunk, len);
+		if (ret < 0) {
+			data.resize(0);
+			return ret;
+		}
+
+		len += ret;
+		if (ret < chunk || size >= 0)
+			break;
+
+		chunk = qMin<qint64>(len, 0x1000000);
+		if (len + chunk > maxSize) {
 			data.resize(0);
-			return len;
+			m_error = ErrFBIG;
+			return -1;
 		}
+		data.resize(len + chunk);
+	}
 
-		data.append(tmp);
-		off += len;
-	} while (len == 0x10000);
+	data.resize(len);
+	return len;
+}
 
-	data.resize(off);
-	return off;
+/*
+ * Streams the whole attachment to the sink. Only the packets in flight are
+ * buffered, regardless of the size of the attachment.
+ */
+qint64 Document::readAll(const QString &attachment, AttachmentSink *sink)
+{
+	return read(attachment, NULL, Q_INT64_C(0x7fffffffffffffff), 0, sink);
 }
 
 bool Document::write(const QString &attachment, const char *data, qint64 size)
@@ -2002,33 +4350,52 @@ bool Document::write(const QString &attachment, const char *data, qint64 size)
 		return false;
 	}
 
+	PriorityScope scope(m_priority);
+	SessionScope session(m_epoch);
+	StatsTag tag("Document I/O");
+	QByteArray part = attachment.toAscii();
 	qint64 len = 0;
-	unsigned int mps = Connection::instance()->maxPacketSize();
+	unsigned int mps = m_conn->maxPacketSize();
+
+	// Stream the first chunks back to back. Only when the window is full
+	// the oldest confirmation is waited for, which bounds the data that is
+	// queued but not yet accepted by the daemon.
+	PendingCall window[MaxPipelineDepth];
+	int depth = m_pipelineDepth;
+	int head = 0, pending = 0;
 
-	// buffer the first chunks
 	while (len+mps < size) {
-		WriteBufferReq req;
+		if (pending == depth) {
+			m_error = window[head].wait();
+			if (m_error)
+				return false;
+			head = (head + 1) % depth;
+			pending--;
+		}
 
-		req.set_handle(m_handle);
-		req.set_part(attachment.toStdString());
-		req.set_data(data, mps);
-		m_error = Connection::defaultRPC<WriteBufferReq>(WRITE_BUFFER_MSG, req);
+		WriteBufferReqCodec req(m_handle, part, data, mps);
+		m_error = window[(head + pending) % depth].send(m_conn, req);
 		if (m_error)
 			return false;
 
+		pending++;
 		data += mps;
 		len += mps;
 	}
 
+	// All chunks must have arrived before the commit. Otherwise the daemon
+	// would commit a buffer with a hole where a chunk failed.
+	for (; pending > 0; pending--) {
+		m_error = window[head].wait();
+		if (m_error)
+			return false;
+		head = (head + 1) % depth;
+	}
+
 	// commit the last chunk
-	WriteCommitReq req;
 	qint64 off = pos(attachment);
-
-	req.set_handle(m_handle);
-	req.set_part(attachment.toStdString());
-	req.set_offset(off);
-	req.set_data(data, size-len);
-	m_error = Connection::defaultRPC<WriteCommitReq>(WRITE_COMMIT_MSG, req);
+	WriteCommitReqCodec req(m_handle, part, off, data, size-len);
+	m_error = Connection::call(m_conn, req);
 	if (m_error)
 		return false;
 
@@ -2076,12 +4443,15 @@ bool Document::resize(const QString &attachment, qint64 size)
 		return false;
 	}
 
+	PriorityScope scope(m_priority);
+	SessionScope session(m_epoch);
+	StatsTag tag("Document I/O");
 	TruncReq req;
 	req.set_handle(m_handle);
 	req.set_part(attachment.toStdString());
 	req.set_offset(size);
 
-	m_error = Connection::defaultRPC<TruncReq>(TRUNC_MSG, req);
+	m_error = Connection::defaultRPC<TruncReq>(m_conn, TRUNC_MSG, req);
 	if (m_error)
 		return false;
 
@@ -2093,11 +4463,13 @@ RevInfo Document::info() const
 	if (!m_open)
 		return RevInfo();
 
+	SessionScope session(m_epoch);
 	FStatReq req;
-	StatCnf cnf;
+	StatCnfCodec cnf;
+	Frame rawCnf;
 	req.set_handle(m_handle);
 
-	int error = Connection::defaultRPC(FSTAT_MSG, req, cnf);
+	int error = Connection::defaultRPC(m_conn, FSTAT_MSG, req, cnf, rawCnf);
 	if (error)
 		return RevInfo();
 
@@ -2125,9 +4497,14 @@ void Document::close()
 	m_pos.clear();
 	m_type = QString();
 
+	// the handle is gone anyway if its session has ended
+	if (m_conn->epoch() != m_epoch)
+		return;
+
+	SessionScope session(m_epoch);
 	CloseReq req;
 	req.set_handle(m_handle);
-	Connection::defaultRPC<CloseReq>(CLOSE_MSG, req);
+	Connection::defaultRPCOneway<CloseReq>(m_conn, CLOSE_MSG, req);
 }
 
 bool Document::commit(const QString &comment)
@@ -2137,6 +4514,7 @@ bool Document::commit(const QString &comment)
 		return false;
 	}
 
+	SessionScope session(m_epoch);
 	CommitReq req;
 	CommitCnf cnf;
 
@@ -2144,7 +4522,7 @@ bool Document::commit(const QString &comment)
 	if (!comment.isNull())
 		req.set_comment(comment.toUtf8().constData());
 
-	m_error = Connection::defaultRPC<CommitReq, CommitCnf>(COMMIT_MSG, req, cnf);
+	m_error = Connection::defaultRPC<CommitReq, CommitCnf>(m_conn, COMMIT_MSG, req, cnf);
 	if (m_error)
 		return false;
 
@@ -2159,6 +4537,7 @@ bool Document::suspend(const QString &comment)
 		return false;
 	}
 
+	SessionScope session(m_epoch);
 	SuspendReq req;
 	SuspendCnf cnf;
 
@@ -2166,7 +4545,7 @@ bool Document::suspend(const QString &comment)
 	if (!comment.isNull())
 		req.set_comment(comment.toUtf8().constData());
 
-	m_error = Connection::defaultRPC<SuspendReq, SuspendCnf>(SUSPEND_MSG, req, cnf);
+	m_error = Connection::defaultRPC<SuspendReq, SuspendCnf>(m_conn, SUSPEND_MSG, req, cnf);
 	if (m_error)
 		return false;
 
@@ -2176,9 +4555,11 @@ bool Document::suspend(const QString &comment)
 
 
 Replicator::Replicator()
-	: m_open(false)
+	: m_conn(NULL)
+	, m_open(false)
 	, m_error(ErrNoError)
 	, m_handle(0)
+	, m_epoch(0)
 {
 }
 
@@ -2203,7 +4584,10 @@ bool Replicator::replicate(const Link &item, const DId &dstStore, QDateTime dept
 			req.set_depth(depth.toMSecsSinceEpoch() * 1000);
 		req.set_verbose(verbose);
 
-		m_error = Connection::defaultRPC(REPLICATE_DOC_MSG, req, cnf);
+		m_conn = Connection::instance();
+		m_epoch = m_conn->epoch();
+		SessionScope session(m_epoch);
+		m_error = Connection::defaultRPC(m_conn, REPLICATE_DOC_MSG, req, cnf);
 		if (m_error)
 			return false;
 
@@ -2220,7 +4604,10 @@ bool Replicator::replicate(const Link &item, const DId &dstStore, QDateTime dept
 			req.set_depth(depth.toMSecsSinceEpoch() * 1000);
 		req.set_verbose(verbose);
 
-		m_error = Connection::defaultRPC(REPLICATE_REV_MSG, req, cnf);
+		m_conn = Connection::instance();
+		m_epoch = m_conn->epoch();
+		SessionScope session(m_epoch);
+		m_error = Connection::defaultRPC(m_conn, REPLICATE_REV_MSG, req, cnf);
 		if (m_error)
 			return false;
 
@@ -2242,9 +4629,12 @@ Error Replicator::error() const
 void Replicator::release()
 {
 	if (m_open) {
-		CloseReq req;
-		req.set_handle(m_handle);
-		Connection::defaultRPC<CloseReq>(CLOSE_MSG, req);
+		if (m_conn->epoch() == m_epoch) {
+			SessionScope session(m_epoch);
+			CloseReq req;
+			req.set_handle(m_handle);
+			Connection::defaultRPCOneway<CloseReq>(m_conn, CLOSE_MSG, req);
+		}
 
 		m_open = false;
 	}
@@ -43,6 +43,7 @@ uint qHash(const PeerDrive::Link&);
 namespace PeerDrive {
 
 class EnumCnf_Store; // FIXME: remove from here
+class Connection;
 
 enum Error {
 	ErrNoError = 0,
@@ -433,6 +434,117 @@ signals:
 	friend class Connection;
 };
 
+/*
+ * Requests are sent to the daemon in three classes. Interactive requests are
+ * meant for small metadata queries that block a user interface. Bulk requests
+ * carry attachment data. The connection shares the socket between the classes
+ * by weight so that interactive requests see a bounded latency while large
+ * transfers are running.
+ */
+enum Priority {
+	PriorityInteractive = 0,
+	PriorityNormal = 1,
+	PriorityBulk = 2
+};
+
+/*
+ * Sets the priority of all requests that are issued by the current thread
+ * while the object exists. Scopes may be nested.
+ */
+class PriorityScope {
+public:
+	PriorityScope(Priority priority);
+	~PriorityScope();
+
+	static Priority current();
+
+private:
+	Priority m_prev;
+};
+
+/*
+ * Attributes all requests that are issued by the current thread while the
+ * object exists to a component in the RPC statistics. The name must be a
+ * string literal. Scopes may be nested, the outermost one wins.
+ */
+class StatsTag {
+public:
+	StatsTag(const char *name);
+	~StatsTag();
+
+	static int current();
+
+private:
+	int m_prev;
+};
+
+/*
+ * Request statistics of a message type or a StatsTag, summed up over all
+ * connections. Latencies are in microseconds.
+ */
+struct RpcStats {
+	QString name;
+	quint64 requests;
+	quint64 errors;
+	quint64 bytesOut;
+	quint64 bytesIn;
+	int inFlight;
+	quint64 p50;
+	quint64 p90;
+	quint64 p99;
+	quint64 max;
+};
+
+QList<RpcStats> rpcStatistics();
+QList<RpcStats> rpcTagStatistics();
+void dumpRpcStatistics();
+
+/*
+ * Every connection keeps the last frames that were exchanged with the daemon.
+ * Writes them to a file which can be decoded with the pdrecorder tool. Set
+ * $PEERDRIVE_RECORDER to a file name to get a dump whenever a connection
+ * breaks, or to "off" to disable the recording.
+ */
+bool dumpFlightRecorder(const QString &fileName);
+
+/*
+ * Number of connections to the daemon. Each connection is served by its own
+ * thread and the calling threads are distributed among them. Defaults to the
+ * value of $PEERDRIVE_CONNECTIONS or one. Should be set before the first
+ * request is made.
+ */
+void setConnectionPoolSize(int size);
+int connectionPoolSize();
+
+/*
+ * The connection to the daemon is established in the background when it is
+ * first needed. Requests made in the meantime are queued and fail with
+ * ErrConnReset if the daemon cannot be reached, or with ErrRPCMISMATCH if it
+ * speaks another protocol version.
+ */
+bool isConnected();
+bool waitForConnected(int msecs = 30000);
+
+/*
+ * Closing handles and removing watches does not wait for the daemon. Waits
+ * until all such requests are confirmed and returns the first error that
+ * occurred since the last call.
+ */
+Error flushRequests();
+
+class ConnectionWatcher : public QObject
+{
+	Q_OBJECT
+
+public:
+	ConnectionWatcher(QObject *parent = NULL);
+
+signals:
+	void ready();
+	void lost();
+	void requestFailed(PeerDrive::Error error);
+};
+
 class Mounts {
 public:
 	struct Store {
@@ -550,6 +662,16 @@ private:
 	QList<RId> m_revLinks;
 };
 
+/*
+ * Receives an attachment piece by piece, see Document::readAll(). The pieces
+ * arrive in order. Returning false stops the transfer with ErrINTR.
+ */
+class AttachmentSink {
+public:
+	virtual ~AttachmentSink();
+	virtual bool write(const char *data, qint64 size) = 0;
+};
+
 /**
  *
  * The Document will track the revision of the document that was last used. That
@@ -594,6 +716,7 @@ public:
 	qint64 read(const QString &attachment, char *data, qint64 maxSize);
 	qint64 read(const QString &attachment, QByteArray &data, qint64 maxSize);
 	qint64 readAll(const QString &attachment, QByteArray &data);
+	qint64 readAll(const QString &attachment, AttachmentSink *sink);
 
 	bool write(const QString &attachment, const char *data, qint64 size);
 	bool write(const QString &attachment, const char *data);
@@ -621,12 +744,34 @@ public:
 	bool commit(const QString &comment = QString());
 	bool suspend(const QString &comment = QString());
 
+	/*
+	 * Priority of the attachment transfers of this document (read, write,
+	 * resize). Defaults to PriorityBulk. All other requests use the
+	 * priority of the calling thread.
+	 */
+	Priority priority() const;
+	void setPriority(Priority priority);
+
+	/*
+	 * Number of packets that attachment reads and writes keep in flight.
+	 * Deeper pipelines hide the latency of the link at the cost of buffer
+	 * memory. Defaults to DefaultPipelineDepth.
+	 */
+	enum { DefaultPipelineDepth = 8, MaxPipelineDepth = 64 };
+	int pipelineDepth() const;
+	void setPipelineDepth(int depth);
+
 private:
-	qint64 read(const QString &attachment, char *data, qint64 maxSize, qint64 off);
+	qint64 read(const QString &attachment, char *data, qint64 maxSize, qint64 off,
+		AttachmentSink *sink = NULL);
 
+	Connection *m_conn;
 	bool m_open;
 	unsigned int m_handle;
+	quint32 m_epoch;
 	Error m_error;
+	Priority m_priority;
+	int m_pipelineDepth;
 	Link m_link;
 	QMap<QString, qint64> m_pos;
 	mutable QString m_type;
@@ -643,9 +788,11 @@ public:
 	void release();
 
 private:
+	Connection *m_conn;
 	bool m_open;
 	Error m_error;
 	unsigned int m_handle;
+	quint32 m_epoch;
 };
 
 }
@@ -654,5 +801,6 @@ Q_DECLARE_METATYPE(PeerDrive::DId);
 Q_DECLARE_METATYPE(PeerDrive::RId);
 Q_DECLARE_METATYPE(PeerDrive::PId);
 Q_DECLARE_METATYPE(PeerDrive::Link);
+Q_DECLARE_METATYPE(PeerDrive::Error);
 
 #endif
@@ -18,12 +18,22 @@
 #ifndef _PEERDRIVE_INTERNAL_H_
 #define _PEERDRIVE_INTERNAL_H_
 
+#include <QAtomicInt>
+#include <QAtomicPointer>
 #include <QByteArray>
+#include <QDataStream>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QtDebug>
+#include <QLocalSocket>
 #include <QMap>
 #include <QMutex>
-#include <QQueue>
+#include <QSemaphore>
 #include <QTcpSocket>
 #include <QThread>
+#include <QThreadStorage>
+#include <QTimer>
+#include <QVarLengthArray>
 #include <QWaitCondition>
 
 #include "peerdrive.h"
@@ -75,11 +85,757 @@
 #define GET_DATA_MSG        0x02b
 #define SET_DATA_MSG        0x02c
 #define GET_LINKS_MSG       0x02d
+#define MSG_COUNT           0x02e
+
+#define FLAG_REQ	0
+#define FLAG_CNF	1
+#define FLAG_IND	2
+#define FLAG_RSP	3
+
+/*
+ * Every frame starts with a 16 bit length. If large frames were negotiated
+ * during INIT then frames bigger than FRAME_SHORT_MAX start with a 32 bit
+ * length instead which has the FRAME_LARGE bit set.
+ */
+#define FRAME_SHORT_MAX     0x7fff
+#define FRAME_LEGACY_MAX    0xffff
+#define FRAME_LARGE         0x80000000
 
 namespace PeerDrive {
 
 class LinkWatcher;
 class ProgressWatcher;
+class PendingReply;
+class OnewayGroup;
+struct FrameBuffer;
+
+/*
+ * Read-only view of a received frame. The data stays in the receive chunk of
+ * the RecvBuffer, a FrameBuffer which every frame holds a reference to.
+ * Creating or copying a frame never copies the payload.
+ */
+class Frame
+{
+public:
+	Frame() : m_chunk(NULL), m_offset(0), m_size(0) { }
+	Frame(FrameBuffer *chunk, int offset, int size);
+	Frame(const Frame &other);
+	~Frame();
+	Frame &operator=(const Frame &other);
+
+	const char *constData() const;
+	int size() const { return m_size; }
+	bool isEmpty() const { return m_size == 0; }
+	void clear() { *this = Frame(); }
+
+	Frame mid(int pos) const
+	{
+		return Frame(m_chunk, m_offset + pos, m_size - pos);
+	}
+
+	QByteArray toByteArray() const { return QByteArray(constData(), m_size); }
+
+private:
+	FrameBuffer *m_chunk;
+	int m_offset;
+	int m_size;
+};
+
+/*
+ * Receive buffer for the socket. Data is appended behind the write cursor of
+ * the current chunk and frames are cut out at the read cursor. Nothing is
+ * moved when a frame is consumed. Only a partially received frame is copied
+ * when a new chunk has to be started, which is bounded by the frame size.
+ *
+ * The chunks come from the FramePool. Frames that were handed out keep a
+ * reference to their chunk but never look past their own end, hence data
+ * may still be appended to a shared chunk. Nothing is moved in it though.
+ */
+class RecvBuffer
+{
+public:
+	RecvBuffer(int chunkSize = 0x20000);
+	~RecvBuffer();
+
+	char *reserve(int len);
+	void commit(int len) { m_write += len; }
+	int fill(QIODevice *device);
+	bool next(Frame &frame);
+	bool isBroken() const { return m_broken; }
+	void clear();
+	void setLargeFrames(bool enable, int maxFrame);
+
+private:
+	Q_DISABLE_COPY(RecvBuffer)
+	FrameBuffer *m_chunk;
+	int m_chunkSize;
+	int m_read;
+	int m_write;
+	int m_expect;
+	int m_maxFrame;
+	bool m_broken;
+	volatile bool m_large;
+};
+
+/*
+ * Helpers to read and write the protobuf wire format by hand. Only field
+ * numbers below 16 are supported because their tag fits into one byte.
+ */
+class Wire
+{
+public:
+	enum Type { Varint = 0, Fixed64 = 1, Delimited = 2, Fixed32 = 5 };
+
+	/*
+	 * A bytes field as a view into the received frame. Only valid as long as
+	 * the frame is kept.
+	 */
+	struct Bytes {
+		Bytes() : data(NULL), size(0) { }
+
+		QByteArray toByteArray() const { return QByteArray(data, size); }
+		std::string toStdString() const { return std::string(data, size); }
+
+		const char *data;
+		int size;
+	};
+
+	static inline int varintSize(quint64 value)
+	{
+		int size = 1;
+		while (value >= 0x80) {
+			value >>= 7;
+			size++;
+		}
+		return size;
+	}
+
+	static inline int varintFieldSize(quint64 value)
+	{
+		return 1 + varintSize(value);
+	}
+
+	static inline int bytesFieldSize(int size)
+	{
+		return 1 + varintSize(size) + size;
+	}
+
+	static inline uchar *putVarint(uchar *out, quint64 value)
+	{
+		while (value >= 0x80) {
+			*out++ = (uchar)value | 0x80;
+			value >>= 7;
+		}
+		*out++ = (uchar)value;
+		return out;
+	}
+
+	static inline uchar *putVarintField(uchar *out, int field, quint64 value)
+	{
+		*out++ = (field << 3) | Varint;
+		return putVarint(out, value);
+	}
+
+	static inline uchar *putBytesField(uchar *out, int field, const char *data,
+		int size)
+	{
+		*out++ = (field << 3) | Delimited;
+		out = putVarint(out, size);
+		memcpy(out, data, size);
+		return out + size;
+	}
+
+	// all getters return NULL if the input is malformed or truncated
+	static inline const uchar *getVarint(const uchar *in, const uchar *end,
+		quint64 *value)
+	{
+		quint64 result = 0;
+		for (int shift = 0; shift < 64 && in < end; shift += 7) {
+			uchar b = *in++;
+			result |= (quint64)(b & 0x7f) << shift;
+			if (!(b & 0x80)) {
+				*value = result;
+				return in;
+			}
+		}
+		return NULL;
+	}
+
+	static inline const uchar *getBytes(const uchar *in, const uchar *end,
+		Bytes *value)
+	{
+		quint64 size;
+		in = getVarint(in, end, &size);
+		if (!in || size > (quint64)(end - in))
+			return NULL;
+		value->data = (const char *)in;
+		value->size = size;
+		return in + size;
+	}
+
+	static const uchar *skip(const uchar *in, const uchar *end, int type);
+};
+
+/*
+ * Hand written codecs of the messages that make up most of the traffic.
+ * They have the same interface as the generated classes, so they can be
+ * used with Request and Connection::defaultRPC(). The encoders take the
+ * attachment name as raw bytes and the payload without copying it, and
+ * write everything directly into the frame. The decoders return views into
+ * the frame instead of copies. They must be used with the variants of
+ * defaultRPC() and call() that hand out the frame to the caller.
+ */
+struct ReadReqCodec {
+	ReadReqCodec(quint32 handle, const QByteArray &part, quint64 offset,
+		quint32 length)
+		: handle(handle), part(part), offset(offset), length(length) { }
+
+	int ByteSize() const
+	{
+		return Wire::varintFieldSize(handle) + Wire::bytesFieldSize(part.size())
+			+ Wire::varintFieldSize(offset) + Wire::varintFieldSize(length);
+	}
+
+	uchar *SerializeWithCachedSizesToArray(uchar *out) const
+	{
+		out = Wire::putVarintField(out, 1, handle);
+		out = Wire::putBytesField(out, 2, part.constData(), part.size());
+		out = Wire::putVarintField(out, 3, offset);
+		return Wire::putVarintField(out, 4, length);
+	}
+
+	quint32 handle;
+	QByteArray part;
+	quint64 offset;
+	quint32 length;
+};
+
+struct ReadCnfCodec {
+	bool ParseFromArray(const void *data, int size);
+
+	Wire::Bytes data;
+};
+
+struct WriteBufferReqCodec {
+	WriteBufferReqCodec(quint32 handle, const QByteArray &part,
+		const char *data, int size)
+		: handle(handle), part(part), data(data), size(size) { }
+
+	int ByteSize() const
+	{
+		return Wire::varintFieldSize(handle) + Wire::bytesFieldSize(part.size())
+			+ Wire::bytesFieldSize(size);
+	}
+
+	uchar *SerializeWithCachedSizesToArray(uchar *out) const
+	{
+		out = Wire::putVarintField(out, 1, handle);
+		out = Wire::putBytesField(out, 2, part.constData(), part.size());
+		return Wire::putBytesField(out, 3, data, size);
+	}
+
+	quint32 handle;
+	QByteArray part;
+	const char *data;
+	int size;
+};
+
+struct WriteCommitReqCodec {
+	WriteCommitReqCodec(quint32 handle, const QByteArray &part, quint64 offset,
+		const char *data, int size)
+		: handle(handle), part(part), offset(offset), data(data), size(size) { }
+
+	int ByteSize() const
+	{
+		return Wire::varintFieldSize(handle) + Wire::bytesFieldSize(part.size())
+			+ Wire::varintFieldSize(offset) + Wire::bytesFieldSize(size);
+	}
+
+	uchar *SerializeWithCachedSizesToArray(uchar *out) const
+	{
+		out = Wire::putVarintField(out, 1, handle);
+		out = Wire::putBytesField(out, 2, part.constData(), part.size());
+		out = Wire::putVarintField(out, 3, offset);
+		return Wire::putBytesField(out, 4, data, size);
+	}
+
+	quint32 handle;
+	QByteArray part;
+	quint64 offset;
+	const char *data;
+	int size;
+};
+
+struct StatCnfCodec {
+	struct Attachment {
+		Wire::Bytes name;
+		quint64 size;
+		Wire::Bytes hash;
+		quint64 crtime;
+		quint64 mtime;
+	};
+
+	bool ParseFromArray(const void *data, int size);
+
+	quint32 flags;
+	quint64 dataSize;
+	Wire::Bytes dataHash;
+	QVarLengthArray<Attachment, 8> attachments;
+	QVarLengthArray<Wire::Bytes, 4> parents;
+	quint64 crtime;
+	quint64 mtime;
+	Wire::Bytes typeCode;
+	Wire::Bytes creatorCode;
+	Wire::Bytes comment;
+};
+
+/*
+ * Compile time description of the protocol. Maps every request type to its
+ * message id and the type of its confirmation. Requests which are only
+ * confirmed by their status have NoCnf. See Connection::call().
+ */
+struct NoCnf { };
+
+template <typename R> struct MessageTraits;
+
+#define PEERDRIVE_MESSAGE(req, msg, cnf) \
+	template <> struct MessageTraits<req> { \
+		enum { Msg = msg }; \
+		typedef cnf Cnf; \
+	};
+
+PEERDRIVE_MESSAGE(InitReq,             INIT_MSG,           InitCnf)
+PEERDRIVE_MESSAGE(LookupDocReq,        LOOKUP_DOC_MSG,     LookupDocCnf)
+PEERDRIVE_MESSAGE(LookupRevReq,        LOOKUP_REV_MSG,     LookupRevCnf)
+PEERDRIVE_MESSAGE(StatReq,             STAT_MSG,           StatCnf)
+PEERDRIVE_MESSAGE(PeekReq,             PEEK_MSG,           PeekCnf)
+PEERDRIVE_MESSAGE(CreateReq,           CREATE_MSG,         CreateCnf)
+PEERDRIVE_MESSAGE(ForkReq,             FORK_MSG,           ForkCnf)
+PEERDRIVE_MESSAGE(UpdateReq,           UPDATE_MSG,         UpdateCnf)
+PEERDRIVE_MESSAGE(ResumeReq,           RESUME_MSG,         ResumeCnf)
+PEERDRIVE_MESSAGE(ReadReq,             READ_MSG,           ReadCnf)
+PEERDRIVE_MESSAGE(TruncReq,            TRUNC_MSG,          NoCnf)
+PEERDRIVE_MESSAGE(WriteBufferReq,      WRITE_BUFFER_MSG,   NoCnf)
+PEERDRIVE_MESSAGE(WriteCommitReq,      WRITE_COMMIT_MSG,   NoCnf)
+PEERDRIVE_MESSAGE(FStatReq,            FSTAT_MSG,          StatCnf)
+PEERDRIVE_MESSAGE(SetFlagsReq,         SET_FLAGS_MSG,      NoCnf)
+PEERDRIVE_MESSAGE(SetTypeReq,          SET_TYPE_MSG,       NoCnf)
+PEERDRIVE_MESSAGE(SetMTimeReq,         SET_MTIME_MSG,      NoCnf)
+PEERDRIVE_MESSAGE(MergeReq,            MERGE_MSG,          NoCnf)
+PEERDRIVE_MESSAGE(RebaseReq,           REBASE_MSG,         NoCnf)
+PEERDRIVE_MESSAGE(CommitReq,           COMMIT_MSG,         CommitCnf)
+PEERDRIVE_MESSAGE(SuspendReq,          SUSPEND_MSG,        SuspendCnf)
+PEERDRIVE_MESSAGE(CloseReq,            CLOSE_MSG,          NoCnf)
+PEERDRIVE_MESSAGE(WatchAddReq,         WATCH_ADD_MSG,      NoCnf)
+PEERDRIVE_MESSAGE(WatchRemReq,         WATCH_REM_MSG,      NoCnf)
+PEERDRIVE_MESSAGE(WatchProgressReq,    WATCH_PROGRESS_MSG, NoCnf)
+PEERDRIVE_MESSAGE(ForgetReq,           FORGET_MSG,         NoCnf)
+PEERDRIVE_MESSAGE(DeleteDocReq,        DELETE_DOC_MSG,     NoCnf)
+PEERDRIVE_MESSAGE(DeleteRevReq,        DELETE_REV_MSG,     NoCnf)
+PEERDRIVE_MESSAGE(ForwardDocReq,       FORWARD_DOC_MSG,    NoCnf)
+PEERDRIVE_MESSAGE(ReplicateDocReq,     REPLICATE_DOC_MSG,  ReplicateDocCnf)
+PEERDRIVE_MESSAGE(ReplicateRevReq,     REPLICATE_REV_MSG,  ReplicateRevCnf)
+PEERDRIVE_MESSAGE(MountReq,            MOUNT_MSG,          MountCnf)
+PEERDRIVE_MESSAGE(UnmountReq,          UNMOUNT_MSG,        NoCnf)
+PEERDRIVE_MESSAGE(GetPathReq,          GET_PATH_MSG,       GetPathCnf)
+PEERDRIVE_MESSAGE(ProgressStartReq,    PROGRESS_START_MSG, NoCnf)
+PEERDRIVE_MESSAGE(ProgressEndReq,      PROGRESS_END_MSG,   NoCnf)
+PEERDRIVE_MESSAGE(WalkPathReq,         WALK_PATH_MSG,      WalkPathCnf)
+PEERDRIVE_MESSAGE(GetDataReq,          GET_DATA_MSG,       GetDataCnf)
+PEERDRIVE_MESSAGE(SetDataReq,          SET_DATA_MSG,       NoCnf)
+PEERDRIVE_MESSAGE(GetLinksReq,         GET_LINKS_MSG,      GetLinksCnf)
+
+// the hand written codecs
+PEERDRIVE_MESSAGE(ReadReqCodec,        READ_MSG,           ReadCnfCodec)
+PEERDRIVE_MESSAGE(WriteBufferReqCodec, WRITE_BUFFER_MSG,   NoCnf)
+PEERDRIVE_MESSAGE(WriteCommitReqCodec, WRITE_COMMIT_MSG,   NoCnf)
+
+#undef PEERDRIVE_MESSAGE
+
+// only defined for requests without confirmation data
+template <typename C> struct StatusOnly;
+template <> struct StatusOnly<NoCnf> { enum { Check = 1 }; };
+
+/*
+ * Returns the message object of the calling thread for requests which are
+ * not covered by a codec, cleared for reuse. Protobuf keeps the memory of
+ * string and repeated fields across Clear(), hence filling the same object
+ * again does not allocate once it has grown. The object must not be held
+ * across another call that uses the same message type.
+ *
+ * This takes the place of protobuf arenas. Arenas need protobuf 3, while
+ * the library still builds against the protobuf 2 of Qt 4 era systems. And
+ * up to protobuf 3.21 string and bytes fields keep their characters in a
+ * std::string, which allocates from the heap even on an arena. A cleared
+ * message keeps that memory instead.
+ */
+template <typename M>
+M &threadMessage()
+{
+	static QThreadStorage<M*> storage;
+
+	if (!storage.hasLocalData())
+		storage.setLocalData(new M);
+
+	M *msg = storage.localData();
+	msg->Clear();
+	return *msg;
+}
+
+/*
+ * Lock-free stack of idle objects which are freed by one thread and taken by
+ * others. Objects are only ever taken all at once, so there is no ABA problem
+ * and no need for a lock. The number of objects on the stack is bounded, the
+ * caller has to delete what does not fit anymore.
+ */
+template <typename T>
+class RecycleStack
+{
+public:
+	bool put(T *obj, int limit)
+	{
+		if (m_count.fetchAndAddRelaxed(1) >= limit) {
+			m_count.deref();
+			return false;
+		}
+
+		T *head;
+		do {
+			head = m_stack;
+			obj->next = head;
+		} while (!m_stack.testAndSetRelease(head, obj));
+
+		return true;
+	}
+
+	T *takeAll()
+	{
+		T *list = m_stack.fetchAndStoreAcquire(NULL);
+		int count = 0;
+		for (T *obj = list; obj; obj = obj->next)
+			count++;
+		m_count.fetchAndAddRelaxed(-count);
+
+		return list;
+	}
+
+private:
+	QAtomicPointer<T> m_stack;
+	QAtomicInt m_count;
+};
+
+/*
+ * Buffer of an outgoing frame, allocated together with its header struct.
+ * The frame is built with the layout of a Request. offset points to the
+ * header that is actually sent. A buffer is shared by the send queue and a
+ * completion which keeps it for a replay, see ConnectionHandler::sendReq().
+ * epoch is the daemon session the frame is bound to, or 0.
+ */
+struct FrameBuffer
+{
+	char *mem;
+	int capacity;
+	int length;
+	int offset;
+	int sizeClass;
+	quint32 epoch;
+	QAtomicInt refs;
+	FrameBuffer *next;
+
+	const char *data() const { return mem + offset; }
+	int size() const { return length - offset; }
+};
+
+/*
+ * Frame buffers are recycled in power of two size classes. Every thread
+ * takes buffers from a cache of its own which is refilled from the buffers
+ * that were released by the I/O threads. The idle memory per size class is
+ * bounded. Buffers above the largest class are allocated and freed directly.
+ */
+class FramePool
+{
+public:
+	static FrameBuffer *alloc(int length);
+	static void release(FrameBuffer *buffer);
+
+private:
+	enum {
+		MinShift = 8,
+		MaxShift = 21,
+		Classes = MaxShift - MinShift + 1,
+		MaxIdle = 256,
+		MaxIdleBytes = 8 << 20
+	};
+
+	struct Cache {
+		Cache() { memset(free, 0, sizeof(free)); }
+		~Cache();
+		FrameBuffer *free[Classes];
+	};
+
+	static int sizeClass(int length);
+	static FrameBuffer *create(int sizeClass, int length);
+	static void destroy(FrameBuffer *buffer);
+
+	static RecycleStack<FrameBuffer> m_released[Classes];
+	static QThreadStorage<Cache*> m_caches;
+};
+
+inline Frame::Frame(FrameBuffer *chunk, int offset, int size)
+	: m_chunk(chunk), m_offset(offset), m_size(size)
+{
+	if (m_chunk)
+		m_chunk->refs.ref();
+}
+
+inline Frame::Frame(const Frame &other)
+	: m_chunk(other.m_chunk), m_offset(other.m_offset), m_size(other.m_size)
+{
+	if (m_chunk)
+		m_chunk->refs.ref();
+}
+
+inline Frame::~Frame()
+{
+	if (m_chunk)
+		FramePool::release(m_chunk);
+}
+
+inline Frame &Frame::operator=(const Frame &other)
+{
+	if (other.m_chunk)
+		other.m_chunk->refs.ref();
+	if (m_chunk)
+		FramePool::release(m_chunk);
+
+	m_chunk = other.m_chunk;
+	m_offset = other.m_offset;
+	m_size = other.m_size;
+	return *this;
+}
+
+inline const char *Frame::constData() const
+{
+	return m_chunk ? m_chunk->mem + m_offset : "";
+}
+
+/*
+ * Binds all requests that are issued by the current thread while the object
+ * exists to one session of the daemon, see ConnectionHandler::epoch(). Used
+ * for requests that carry a handle. Such a request fails with ErrConnReset
+ * instead of being sent on a later session, where the handle number may
+ * already belong to another document. Scopes may be nested.
+ */
+class SessionScope {
+public:
+	SessionScope(quint32 epoch);
+	~SessionScope();
+
+	static quint32 current();
+
+private:
+	quint32 m_prev;
+};
+
+/*
+ * Outgoing request frame. Room for the frame header is reserved in front of
+ * the body so that the message can be serialized in place. The header is
+ * filled in by the ConnectionHandler which takes over the buffer. Hence the
+ * frame is built exactly once and never copied on its way to the socket.
+ * The buffer comes from the FramePool and goes back to it once it was sent.
+ */
+class Request
+{
+public:
+	// room for the largest header; a short header starts at offset 2
+	static const int HeaderSize = 10;
+
+	Request()
+		: m_buffer(FramePool::alloc(HeaderSize))
+		, m_priority(PriorityScope::current())
+		, m_epoch(SessionScope::current())
+	{ }
+
+	explicit Request(const QByteArray &body);
+
+	template <typename R>
+	explicit Request(const R &msg)
+		: m_buffer(FramePool::alloc(HeaderSize + msg.ByteSize()))
+		, m_priority(PriorityScope::current())
+		, m_epoch(SessionScope::current())
+	{
+		msg.SerializeWithCachedSizesToArray(
+			(google::protobuf::uint8*)m_buffer->mem + HeaderSize);
+	}
+
+	~Request()
+	{
+		if (m_buffer)
+			FramePool::release(m_buffer);
+	}
+
+	int size() const { return m_buffer->length - HeaderSize; }
+
+	Priority priority() const { return m_priority; }
+	void setPriority(Priority priority) { m_priority = priority; }
+
+private:
+	Q_DISABLE_COPY(Request)
+	friend class ConnectionHandler;
+	FrameBuffer *m_buffer;
+	Priority m_priority;
+	quint32 m_epoch;
+};
+
+/*
+ * Statistics of the requests of one connection, per message type and per
+ * StatsTag. Everything but the in-flight gauges is only updated by the I/O
+ * thread when a request completes. Readers in other threads may see slightly
+ * stale values which is fine for statistics.
+ */
+class RpcMetrics
+{
+public:
+	enum { MaxTags = 16, Buckets = 256 };
+
+	/*
+	 * Latencies are kept in a log-linear histogram with microsecond
+	 * resolution. Values below 16us get their own bucket, everything above
+	 * is split into eight buckets per power of two.
+	 */
+	struct Counters {
+		Counters();
+		void add(const Counters &other);
+		quint64 percentile(double p) const;
+
+		quint64 requests;
+		quint64 errors;
+		quint64 bytesOut;
+		quint64 bytesIn;
+		quint64 maxLatency;
+		quint32 latency[Buckets];
+	};
+
+	void started(int msg, int tag);
+	void aborted(int msg, int tag);
+	void finished(int msg, int tag, bool error, int bytesOut, int bytesIn,
+		quint64 usecs);
+
+	const Counters &message(int msg) const { return m_msgs[msg]; }
+	const Counters &tag(int tag) const { return m_tags[tag]; }
+	int messageInFlight(int msg) const { return m_msgInFlight[msg]; }
+	int tagInFlight(int tag) const { return m_tagInFlight[tag]; }
+
+	static int registerTag(const char *name);
+	static const char *tagName(int tag);
+	static int tagCount();
+
+private:
+	static int bucket(quint64 usecs);
+	static quint64 bucketValue(int bucket);
+
+	Counters m_msgs[MSG_COUNT];
+	Counters m_tags[MaxTags];
+	QAtomicInt m_msgInFlight[MSG_COUNT];
+	QAtomicInt m_tagInFlight[MaxTags];
+
+	static const char * volatile m_tagNames[MaxTags];
+	static QAtomicInt m_tagCount;
+	static QMutex m_tagMutex;
+};
+
+/*
+ * Keeps the last frames that were sent and received in a fixed ring. Each
+ * entry has the time, the header and the first bytes of the payload. Frames
+ * are only recorded and dumped by the I/O thread, hence no locking at all
+ * is needed. The ring is allocated once and never grows.
+ *
+ * Dump format (big endian): magic, version, wall clock of the start in ms
+ * since the epoch, number of entries and the entries themselves, oldest
+ * first. See tools/pdrecorder for a decoder.
+ */
+class FlightRecorder
+{
+public:
+	enum { Entries = 4096, PayloadSize = 40 };
+	enum { Magic = 0x50444652, Version = 1 };
+	enum { DirSent = 0, DirReceived = 1 };
+
+	struct Entry {
+		qint64 time;
+		quint32 ref;
+		quint32 length;
+		quint16 msg;
+		quint8 dir;
+		quint8 captured;
+		char payload[PayloadSize];
+	};
+
+	FlightRecorder();
+	~FlightRecorder();
+
+	bool isEnabled() const { return m_ring != NULL; }
+	void setEnabled(bool enable);
+
+	inline void record(int dir, quint32 ref, quint16 msg, const char *payload,
+		int length)
+	{
+		if (m_ring)
+			append(dir, ref, msg, payload, length);
+	}
+
+	bool dump(const QString &fileName) const;
+
+private:
+	void append(int dir, quint32 ref, quint16 msg, const char *payload,
+		int length);
+
+	Entry *m_ring;
+	quint32 m_next;
+	qint64 m_startTime;
+	QElapsedTimer m_clock;
+};
+
+/*
+ * Writes every frame that is sent or received completely to a file together
+ * with the time in microseconds since the capture was started. Used by the
+ * I/O thread only. The file is read back with read() by tools/pdreplay.
+ *
+ * File format (big endian): magic, version, wall clock of the start in ms
+ * since the epoch and then the records until the end of the file.
+ */
+class FrameCapture
+{
+public:
+	enum { Magic = 0x50444350, Version = 1 };
+
+	struct Record {
+		qint64 time;
+		quint8 dir;
+		quint32 ref;
+		quint16 msg;
+		QByteArray payload;
+	};
+
+	FrameCapture();
+	~FrameCapture();
+
+	bool open(const QString &fileName);
+	bool isOpen() const { return m_file.isOpen(); }
+	void write(int dir, quint32 ref, quint16 msg, const char *payload,
+		int length);
+	void flush();
+
+	static bool readHeader(QDataStream &in, qint64 *startTime);
+	static bool read(QDataStream &in, Record *record);
+
+private:
+	QFile m_file;
+	QDataStream m_out;
+	QElapsedTimer m_clock;
+};
+
+const char *messageName(int msg);
 
 class ConnectionHandler : public QObject
 {
@@ -89,40 +845,357 @@ public:
 	ConnectionHandler();
 	~ConnectionHandler();
 
-	int connect(const QString &hostName, quint16 port);
+	void open(const QString &hostName, quint16 port, const QByteArray &cookie);
+	void open(const QString &path, const QByteArray &cookie);
 	void disconnect();
+	void setLargeFrames(bool enable, unsigned int maxPacketSize = 0);
+
+	bool waitForReady(int msecs);
+	bool isReady() const { return linkState == Online; }
+	unsigned int maxPacketSize() const { return m_maxPacketSize; }
+	quint32 epoch() const { return m_epoch; }
+	const RpcMetrics &metrics() const { return m_metrics; }
+	void setRecorderEnabled(bool enable) { m_recorder.setEnabled(enable); }
+	void setRecorderFile(const QString &fileName);
+	bool setCaptureFile(const QString &fileName);
 
 	struct Completion {
-		volatile bool done;
+		Completion() : group(NULL), waiter(NULL), replay(NULL), dest(NULL) { }
+		bool isDone() const { return waiter == &completed; }
+
 		volatile Error err;
 		int msg;
-		QByteArray *cnf;
+		int req;
+		quint32 ref;
+		Frame *cnf;
+		PendingReply *reply;
+		// set for one-way requests, see sendOneway()
+		OnewayGroup *group;
+		// NULL, the semaphore of the waiting thread or &completed
+		QAtomicPointer<QSemaphore> waiter;
+
+		// frame of idempotent requests to replay them after a reconnect
+		FrameBuffer *replay;
+		Priority priority;
+
+		// buffer for the payload of a READ confirmation, see deliver()
+		char *dest;
+		int destSize;
+		int delivered;
+
+		// bookkeeping for the RpcMetrics
+		int tag;
+		int bytesOut;
+		qint64 started;
 	};
 
-	Error sendReq(int msg, Completion *completion, const QByteArray &req);
+	Error sendReq(int msg, Completion *completion, Request &req);
+	Error sendOneway(int msg, Request &req, OnewayGroup *group);
 	Error poll(Completion *completion);
+	void cancel(Completion *completion);
+	static void fail(Completion *completion, Error err);
 
 signals:
 	void pushSendQueue();
-	void indication(const QByteArray &ind);
+	void indication(const Frame &ind);
+	void connectionLost();
+	void ready();
+	void onewayFailed(int msg, PeerDrive::Error err);
+
+public slots:
+	bool dumpRecorder(const QString &fileName);
 
 private slots:
 	void sockReadyRead();
 	void sockReadySend();
+	void sockConnected();
 	void sockDisconnected();
-	void sockError(QAbstractSocket::SocketError socketError);
+	void sockError();
+	void reconnect();
+	void connectTimeout();
 
 private:
+	/*
+	 * Pending completions are kept in a fixed table indexed by the lower
+	 * bits of the request reference. A slot holds the full reference so
+	 * that late confirmations of an earlier generation are dropped.
+	 */
+	enum { SlotCount = 16384 };
+
+	/*
+	 * The connection is established in the background, including the INIT
+	 * handshake. Requests are queued until then. A lost connection is
+	 * re-established with an exponential backoff. Requests are held back in
+	 * the meantime. If the daemon does not come back within the grace period
+	 * they fail. If the daemon cannot be reached at all they fail right away
+	 * while the handler keeps trying in the background. A daemon that speaks
+	 * another protocol version is given up on: all requests fail with
+	 * ErrRPCMISMATCH until the handler is opened again.
+	 *
+	 * Every session with the daemon gets a new epoch, unique across all
+	 * connections. It is taken when the previous session is lost, so while
+	 * the connection is down the epoch is the one of the coming session.
+	 * Frames that are bound to another epoch are never sent.
+	 */
+	enum LinkState { Offline, Connecting, Initializing, Online };
+
+	enum {
+		ConnectTimeout = 3000,
+		ReconnectMinDelay = 50,
+		ReconnectMaxDelay = 5000,
+		ReconnectGrace = 10000
+	};
+
+	struct Slot {
+		Slot() : ref(0) { }
+		QAtomicPointer<Completion> completion;
+		volatile quint32 ref;
+	};
+
+	/*
+	 * Every priority has its own submission stack and send queue. The queues
+	 * are served by deficit round robin with a byte quantum per priority.
+	 * Only as much is handed to the socket as it can send right away so that
+	 * a backlog of bulk frames cannot delay later interactive requests.
+	 */
+	enum {
+		LaneCount = 3,
+		SendQuantum = 16 * 1024,
+		SendWatermark = 64 * 1024
+	};
+
+	// headers of a READ confirmation around a packet of maxPacketSize bytes
+	enum { FrameSlack = 256 };
+
+	// recycled through a RecycleStack like the frame buffers
+	struct OnewayCompletion : Completion {
+		Frame frame;
+		OnewayCompletion *next;
+	};
+
+	struct OnewayCache {
+		OnewayCache() : head(NULL) { }
+		~OnewayCache();
+		OnewayCompletion *head;
+	};
+
+	enum { MaxIdleOneway = 1024 };
+
+	struct Lane {
+		Lane() : head(NULL), tail(NULL), deficit(0) { }
+		QAtomicPointer<FrameBuffer> stack;
+		FrameBuffer *head;
+		FrameBuffer *tail;
+		int deficit;
+	};
+
+	bool claimSlot(quint32 &ref);
+	void publishCompletion(quint32 ref, Completion *completion);
+	Completion *takeCompletion(quint32 ref);
+	FrameBuffer *buildFrame(int msg, quint32 ref, Request &req);
+	bool sealFrame(FrameBuffer *node);
+	void pushFrame(FrameBuffer *node, Priority priority);
+	void queueFrame(FrameBuffer *node, Priority priority);
+	void collectFrames();
+	void dropFrames();
+	bool isStale(const FrameBuffer *node) const;
+	void abortFrame(FrameBuffer *node, Error err);
+	void abortStaleFrames();
+	void complete(Completion *completion);
+	void onewayDone(Completion *completion);
+	void deliver(Completion *completion, const char *data, int size);
+	bool tracing() const { return m_recorder.isEnabled() || m_capture.isOpen(); }
+	void traceSent(const FrameBuffer *buffer);
+	void releaseReplay(Completion *completion);
 	void abortCompletions(Error err);
+	void replayCompletions();
+	void linkDown();
+	void retryLater();
+	void setStarting(bool starting);
+	void initDone(int msg, const Frame &cnf);
+	void versionMismatch();
+	Error linkError() const { return m_fatal ? m_fatal : ErrConnReset; }
+	static bool isIdempotent(int msg);
 
-	QTcpSocket socket;
-	QQueue<QByteArray> sendQueue;
-	QMap<quint32, Completion*> pendingCompletions;
-	quint32 nextRef;
-	QByteArray m_buf;
+	QTcpSocket tcpSocket;
+	QLocalSocket localSocket;
+	QIODevice *socket;
+	volatile bool connected;
+	volatile bool largeFrames;
+	volatile LinkState linkState;
+	volatile unsigned int m_maxPacketSize;
+	volatile quint32 m_epoch;
+	volatile Error m_fatal;
+	bool reconnectEnabled;
+	bool m_starting;
+	QMutex m_startMutex;
+	QWaitCondition m_startDone;
+	QString m_host;
+	quint16 m_port;
+	QString m_path;
+	QByteArray m_cookie;
+	int m_backoff;
+	QTimer m_retryTimer;
+	QTimer m_connectTimer;
+	QElapsedTimer m_lostSince;
+	Completion m_init;
+	Frame m_initCnf;
+	Lane lanes[LaneCount];
+	QAtomicInt sendPending;
+	Slot m_slots[SlotCount];
+	QAtomicInt nextRef;
+	RecvBuffer m_buf;
+	RpcMetrics m_metrics;
+	QElapsedTimer m_clock;
+	FlightRecorder m_recorder;
+	QString m_recorderFile;
+	FrameCapture m_capture;
 
-	QMutex mutex;
-	QWaitCondition gotConfirmation;
+	static const int laneWeight[LaneCount];
+	static QAtomicInt nextEpoch;
+	static Completion claimed;
+	static QSemaphore completed;
+	static QThreadStorage<QSemaphore*> waiters;
+	static RecycleStack<OnewayCompletion> m_idleOneway;
+	static QThreadStorage<OnewayCache*> m_onewayCaches;
+};
+
+/*
+ * Handle for a request that was sent with Connection::rpcAsync(). The
+ * confirmation can be waited for, polled with isFinished() or delivered by the
+ * finished() signal in the thread that issued the request. The caller owns the
+ * object. Deleting it before the confirmation arrived is allowed and just
+ * discards the result.
+ */
+class PendingReply : public QObject
+{
+	Q_OBJECT
+
+public:
+	~PendingReply();
+
+	bool isFinished() const;
+	Error wait();
+	const Frame &confirmation() const { return m_cnf; }
+
+	template <typename C>
+	Error wait(C &cnf)
+	{
+		Error err = wait();
+		if (err)
+			return err;
+
+		if (!cnf.ParseFromArray(m_cnf.constData(), m_cnf.size())) {
+			qDebug() << m_cnf.toByteArray().toHex();
+			return ErrBadRPC;
+		}
+
+		return ErrNoError;
+	}
+
+signals:
+	void finished();
+
+private slots:
+	void complete();
+
+private:
+	PendingReply(ConnectionHandler *handler, int msg);
+	friend class Connection;
+
+	ConnectionHandler *m_handler;
+	ConnectionHandler::Completion m_completion;
+	Frame m_cnf;
+	int m_msg;
+};
+
+/*
+ * Pipelined request of the thread that sent it. Unlike a PendingReply it is
+ * no QObject and lives wherever the caller puts it, so a window of requests
+ * can be kept in an array on the stack. The confirmation can only be waited
+ * for. A call that is still pending when it is destroyed or reused is
+ * cancelled.
+ */
+class PendingCall
+{
+public:
+	PendingCall();
+	~PendingCall();
+
+	bool isPending() const { return m_handler != NULL; }
+
+	/*
+	 * Registers a buffer for the payload of a READ confirmation before the
+	 * request is sent. The I/O thread copies the data straight into it
+	 * instead of handing out the frame. delivered() tells how much it was.
+	 */
+	void setDestination(char *data, int size)
+	{
+		m_completion.dest = data;
+		m_completion.destSize = size;
+		m_completion.delivered = 0;
+	}
+
+	int delivered() const { return m_completion.delivered; }
+
+	Error send(Connection *conn, int msg, Request &req);
+	Error wait();
+	void cancel();
+	const Frame &confirmation() const { return m_cnf; }
+
+	template <typename R>
+	Error send(Connection *conn, const R &req)
+	{
+		Request rawReq(req);
+		return send(conn, MessageTraits<R>::Msg, rawReq);
+	}
+
+	template <typename C>
+	Error wait(C &cnf)
+	{
+		Error err = wait();
+		if (err)
+			return err;
+
+		if (!cnf.ParseFromArray(m_cnf.constData(), m_cnf.size())) {
+			qDebug() << m_cnf.toByteArray().toHex();
+			return ErrBadRPC;
+		}
+
+		return ErrNoError;
+	}
+
+private:
+	Q_DISABLE_COPY(PendingCall)
+
+	ConnectionHandler *m_handler;
+	ConnectionHandler::Completion m_completion;
+	Frame m_cnf;
+	int m_msg;
+};
+
+/*
+ * Tracks one-way requests. They are sent without waiting for the daemon but
+ * their confirmations are still checked. The first error is kept until the
+ * next flush().
+ */
+class OnewayGroup
+{
+public:
+	OnewayGroup();
+	~OnewayGroup();
+
+	Error flush();
+
+private:
+	friend class ConnectionHandler;
+	void sent();
+	void done(Error err);
+
+	QAtomicInt m_pending;
+	QAtomicInt m_error;
+	QMutex m_mutex;
+	QWaitCondition m_idle;
 };
 
 class Connection : public QThread
@@ -132,23 +1205,68 @@ class Connection : public QThread
 public:
 	Error rpc(int msg, const QByteArray &req);
 	Error rpc(int msg, const QByteArray &req, QByteArray &cnf);
+	Error rpc(int msg, Request &req);
+	Error rpc(int msg, Request &req, Frame &cnf);
+	PendingReply *rpcAsync(int msg, const QByteArray &req);
+	PendingReply *rpcAsync(int msg, Request &req);
+	Error rpcOneway(int msg, Request &req, OnewayGroup *group = NULL);
+	Error flushOneway();
+	static Error flushAll();
+	static void statistics(QList<RpcStats> *messages, QList<RpcStats> *tags);
+	static bool dumpRecorders(const QString &fileName);
+
+	/*
+	 * The library may use a pool of daemon connections, each with its own I/O
+	 * thread. instance() returns the connection of the calling thread. Threads
+	 * are assigned round-robin to the connections of the pool. Handles are
+	 * only valid on the connection that returned them, so objects that hold a
+	 * handle must stick to that connection. They are also bound to the
+	 * session of the daemon, see epoch() and SessionScope. Watches and
+	 * progress notifications are always managed by the primary connection.
+	 */
 	static Connection *instance();
+	static Connection *primary();
+	static int poolSize();
+	static void setPoolSize(int size);
 
 	template <typename R, typename C>
 	static Error defaultRPC(int msg, const R &req, C &cnf)
 	{
-		QByteArray rawReq;
+		return defaultRPC(Connection::instance(), msg, req, cnf);
+	}
+
+	template <typename R, typename C>
+	static Error defaultRPC(Connection *conn, int msg, const R &req, C &cnf)
+	{
+		Request rawReq(req);
+		Frame rawCnf;
+		Error err = conn->rpc(msg, rawReq, rawCnf);
+		if (err)
+			return err;
 
-		rawReq.resize(req.ByteSize());
-		req.SerializeWithCachedSizesToArray((google::protobuf::uint8*)rawReq.data());
+		if (!cnf.ParseFromArray(rawCnf.constData(), rawCnf.size())) {
+			qDebug() << rawCnf.toByteArray().toHex();
+			return ErrBadRPC;
+		}
+
+		return ErrNoError;
+	}
 
-		QByteArray rawCnf;
-		Error err = Connection::instance()->rpc(msg, rawReq, rawCnf);
+	/*
+	 * Like above but hands out the frame of the confirmation. Needed by the
+	 * hand written decoders which point into the frame.
+	 */
+	template <typename R, typename C>
+	static Error defaultRPC(Connection *conn, int msg, const R &req, C &cnf,
+		Frame &rawCnf)
+	{
+		Request rawReq(req);
+		Error err = conn->rpc(msg, rawReq, rawCnf);
 		if (err)
 			return err;
 
 		if (!cnf.ParseFromArray(rawCnf.constData(), rawCnf.size())) {
-			qDebug() << rawCnf.toHex();
+			qDebug() << rawCnf.toByteArray().toHex();
 			return ErrBadRPC;
 		}
 
@@ -158,12 +1276,79 @@ public:
 	template <typename R>
 	static Error defaultRPC(int msg, const R &req)
 	{
-		QByteArray rawReq;
+		return defaultRPC(Connection::instance(), msg, req);
+	}
+
+	template <typename R>
+	static Error defaultRPC(Connection *conn, int msg, const R &req)
+	{
+		Request rawReq(req);
+		return conn->rpc(msg, rawReq);
+	}
 
-		rawReq.resize(req.ByteSize());
-		req.SerializeWithCachedSizesToArray((google::protobuf::uint8*)rawReq.data());
+	/*
+	 * Sends a request whose confirmation carries no data without waiting
+	 * for it. Only errors that prevent sending are returned. Errors of the
+	 * daemon end up in the group, or in the connection wide group if none
+	 * is given, and are signalled through requestFailed().
+	 */
+	template <typename R>
+	static Error defaultRPCOneway(Connection *conn, int msg, const R &req,
+		OnewayGroup *group = NULL)
+	{
+		Request rawReq(req);
+		return conn->rpcOneway(msg, rawReq, group);
+	}
 
-		return Connection::instance()->rpc(msg, rawReq);
+	/*
+	 * Type safe variants of the above. The message id and the type of the
+	 * confirmation are taken from the MessageTraits of the request.
+	 */
+	template <typename R>
+	static Error call(Connection *conn, const R &req,
+		typename MessageTraits<R>::Cnf &cnf)
+	{
+		return defaultRPC(conn, MessageTraits<R>::Msg, req, cnf);
+	}
+
+	template <typename R>
+	static Error call(Connection *conn, const R &req,
+		typename MessageTraits<R>::Cnf &cnf, Frame &rawCnf)
+	{
+		return defaultRPC(conn, MessageTraits<R>::Msg, req, cnf, rawCnf);
+	}
+
+	template <typename R>
+	static Error call(Connection *conn, const R &req)
+	{
+		(void)StatusOnly<typename MessageTraits<R>::Cnf>::Check;
+		return defaultRPC(conn, MessageTraits<R>::Msg, req);
+	}
+
+	template <typename R>
+	static Error callOneway(Connection *conn, const R &req,
+		OnewayGroup *group = NULL)
+	{
+		(void)StatusOnly<typename MessageTraits<R>::Cnf>::Check;
+		return defaultRPCOneway(conn, MessageTraits<R>::Msg, req, group);
+	}
+
+	/*
+	 * Pipelined variant of defaultRPC(). The request is sent immediately and
+	 * the confirmation is retrieved later with PendingReply::wait(cnf). This
+	 * way a single thread may keep many requests in flight.
+	 */
+	template <typename R>
+	static PendingReply *defaultRPCAsync(int msg, const R &req)
+	{
+		return defaultRPCAsync(Connection::instance(), msg, req);
+	}
+
+	template <typename R>
+	static PendingReply *defaultRPCAsync(Connection *conn, int msg, const R &req)
+	{
+		Request rawReq(req);
+		return conn->rpcAsync(msg, rawReq);
 	}
 
 	Error addWatch(LinkWatcher *watch, const DId &doc);
@@ -173,7 +1358,15 @@ public:
 	void addProgressWatch(ProgressWatcher *watch);
 	void delProgressWatch(ProgressWatcher *watch);
 
-	unsigned int maxPacketSize() { return m_maxPacketSize; }
+	/*
+	 * Waits for the first connection attempt. While the daemon cannot be
+	 * reached this is the size of the last session, or 4096 if there never
+	 * was one. Requests that are built with it fail in this case anyway.
+	 */
+	unsigned int maxPacketSize();
+	quint32 epoch() const;
+	bool isReady() const;
+	bool waitForReady(int msecs = 30000);
 
 	struct Progress {
 		DId src;
@@ -189,23 +1382,39 @@ public:
 	QList<unsigned int> progressTags() const;
 
 protected:
-	Error _rpc(int msg, const QByteArray &req, ConnectionHandler::Completion *completion);
+	Error _rpc(int msg, Request &req, ConnectionHandler::Completion *completion);
+	static Error result(int msg, ConnectionHandler::Completion *completion);
 	void run();
 
+signals:
+	void ready();
+	void lost();
+	void requestFailed(PeerDrive::Error err);
 
 private slots:
-	void dispatchIndication(const QByteArray &packet);
-	void dispatchWatch(const QByteArray &packet);
+	void sessionReady();
+	void onewayFailed(int msg, PeerDrive::Error err);
+	void dispatchIndication(const Frame &packet);
+	void dispatchWatch(const Frame &packet);
 	void dispatchProgressStart(const ProgressStartInd &ind, bool dispatch);
 	void dispatchProgress(const ProgressInd &ind, bool dispatch);
-	void dispatchProgressEnd(const QByteArray &packet);
+	void dispatchProgressEnd(const Frame &packet);
+	void progressRestored();
 
 private:
-	Connection();
+	Connection(int index);
 	~Connection();
-	void sendInit();
+	void restoreSession();
+	Error sendWatchAdd(WatchAddReq::Type type, const std::string &element,
+		bool oneway = false);
+	Error enableProgress(bool dispatch);
+	friend class PendingReply;
+	friend class PendingCall;
+	friend class ConnectionHandler;
 
+	int m_index;
 	QString m_cookie;
+	bool m_established;
 
 	QMap<DId, QList<LinkWatcher*> > m_docWatches;
 	QMap<RId, QList<LinkWatcher*> > m_revWatches;
@@ -214,14 +1423,22 @@ private:
 
 	QMap<unsigned int, Progress*> m_progressItems;
 	QMutex progressMutex;
+	PendingReply *m_progressRestore;
 
 	QMutex startupMutex;
 	QWaitCondition startupDone;
 	ConnectionHandler *handler;
-	unsigned int m_maxPacketSize;
+	OnewayGroup m_oneway;
+
+	enum { MaxPoolSize = 16 };
+
+	static Connection *connection(int index);
 
 	static QMutex instanceMutex;
-	static Connection* volatile m_instance;
+	static Connection* volatile m_pool[MaxPoolSize];
+	static QAtomicInt m_poolSize;
+	static QAtomicInt m_nextShard;
+	static QThreadStorage<int*> m_shard;
 };
 
 }
@@ -1,3 +1,3 @@
 TEMPLATE = subdirs
-SUBDIRS = peerdrive-qt apps
+SUBDIRS = peerdrive-qt apps bench tools
 CONFIG += ordered
@@ -0,0 +1,93 @@
+/*
+ * PeerDrive
+ * Copyright (C) 2013  Jan Klötzke <jan DOT kloetzke AT freenet DOT de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QCoreApplication>
+#include <QStringList>
+#include <iostream>
+
+#include "mockdaemon.h"
+
+static const char *help =
+	"PeerDrive mock daemon\n"
+	"\n"
+	"USAGE: pdmockd [OPTIONS]\n"
+	"\n"
+	"Options:\n"
+	"    --port PORT        TCP port, a free one is chosen by default\n"
+	"    --unix PATH        Listen additionally on a unix domain socket\n"
+	"    --latency USEC     Delay every confirmation\n"
+	"    --jitter USEC      Randomly vary the latency by up to USEC\n"
+	"    --bandwidth BYTES  Bytes per second in each direction\n"
+	"    --packet BYTES     Maximum packet size announced to the clients\n"
+	"    --legacy           Do not offer large frames\n"
+	"    --stores LABELS    Comma separated labels of the mounted stores\n"
+	"\n"
+	"All stores are kept in memory. The address of the daemon is printed in\n"
+	"a form that can be passed to the clients through the environment.\n";
+
+int main(int argc, char** argv)
+{
+	QCoreApplication app(argc, argv);
+	QStringList arguments(QCoreApplication::arguments());
+	MockOptions options;
+
+	for (int i = 1; i < arguments.size(); i++) {
+		QString arg = arguments.at(i);
+
+		if (arg == "--help" || arg == "-h") {
+			std::cout << help;
+			return 0;
+		} else if (arg == "--legacy") {
+			options.largeFrames = false;
+			continue;
+		}
+
+		if (i + 1 >= arguments.size()) {
+			std::cerr << help;
+			return 1;
+		}
+
+		QString value = arguments.at(++i);
+		if (arg == "--port")
+			options.port = value.toUShort();
+		else if (arg == "--unix")
+			options.localPath = value;
+		else if (arg == "--latency")
+			options.latency = value.toInt();
+		else if (arg == "--jitter")
+			options.jitter = value.toInt();
+		else if (arg == "--bandwidth")
+			options.bandwidth = value.toLongLong();
+		else if (arg == "--packet")
+			options.maxPacketSize = value.toUInt();
+		else if (arg == "--stores")
+			options.stores = value.split(',', QString::SkipEmptyParts);
+		else {
+			std::cerr << help;
+			return 1;
+		}
+	}
+
+	MockDaemon daemon(options);
+	std::cout << "PEERDRIVE=" << qPrintable(daemon.address()) << "\n";
+	if (!daemon.localAddress().isEmpty())
+		std::cout << "PEERDRIVE=" << qPrintable(daemon.localAddress()) << "\n";
+	std::cout.flush();
+
+	return app.exec();
+}
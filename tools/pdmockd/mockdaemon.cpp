@@ -0,0 +1,1504 @@
+/*
+ * PeerDrive
+ * Copyright (C) 2013  Jan Klötzke <jan DOT kloetzke AT freenet DOT de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <climits>
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QtEndian>
+
+#include <peerdrive-qt/peerdrive.h>
+#include <peerdrive-qt/peerdrive_internal.h>
+
+#include "mockdaemon.h"
+
+using namespace PeerDrive;
+
+typedef google::protobuf::RepeatedPtrField<std::string> StringList;
+
+// attachments are held in a QByteArray
+static const quint64 MaxAttachmentSize = INT_MAX;
+
+template <typename R>
+static bool parse(R *req, const QByteArray &raw)
+{
+	return req->ParseFromArray(raw.constData(), raw.size());
+}
+
+template <typename C>
+static QByteArray serialize(const C &cnf)
+{
+	QByteArray raw;
+	raw.resize(cnf.ByteSize());
+	cnf.SerializeWithCachedSizesToArray((google::protobuf::uint8*)raw.data());
+	return raw;
+}
+
+static inline QByteArray bytes(const std::string &str)
+{
+	return QByteArray(str.data(), str.size());
+}
+
+static inline std::string str(const QByteArray &ba)
+{
+	return std::string(ba.constData(), ba.size());
+}
+
+static QList<QByteArray> toList(const StringList &list)
+{
+	QList<QByteArray> ret;
+	for (int i = 0; i < list.size(); i++)
+		ret << bytes(list.Get(i));
+	return ret;
+}
+
+static inline int fail(ErrorCode err)
+{
+	return err + 1;
+}
+
+static QByteArray hash(const QByteArray &data)
+{
+	return QCryptographicHash::hash(data, QCryptographicHash::Md5);
+}
+
+static void fillStat(const MockRevision &rev, StatCnf *cnf)
+{
+	cnf->set_flags(rev.flags);
+	cnf->mutable_data()->set_size(rev.data.size());
+	cnf->mutable_data()->set_hash(str(hash(rev.data)));
+
+	QMapIterator<QByteArray, MockRevision::Attachment> i(rev.attachments);
+	while (i.hasNext()) {
+		i.next();
+		StatCnf_Attachment *a = cnf->add_attachments();
+		a->set_name(str(i.key()));
+		a->set_size(i.value().data.size());
+		a->set_hash(str(hash(i.value().data)));
+		a->set_crtime(i.value().crtime);
+		a->set_mtime(i.value().mtime);
+	}
+
+	foreach (const QByteArray &parent, rev.parents)
+		cnf->add_parents(str(parent));
+	cnf->set_crtime(rev.crtime);
+	cnf->set_mtime(rev.mtime);
+	cnf->set_type_code(str(rev.typeCode));
+	cnf->set_creator_code(str(rev.creatorCode));
+	cnf->set_comment(str(rev.comment));
+}
+
+static void fillStore(const MockStore *store, EnumCnf_Store *cnf)
+{
+	cnf->set_sid(str(store->sid));
+	cnf->set_src(store->src.toUtf8().constData());
+	cnf->set_type("mock");
+	cnf->set_label(store->label.toUtf8().constData());
+}
+
+static void collectLinks(const Value &value, GetLinksCnf *cnf)
+{
+	switch (value.type()) {
+		case Value::LIST:
+			for (int i = 0; i < value.size(); i++)
+				collectLinks(value[i], cnf);
+			break;
+		case Value::DICT:
+			foreach (const QString &key, value.keys())
+				collectLinks(value[key], cnf);
+			break;
+		case Value::LINK:
+		{
+			Link link = value.asLink();
+			if (link.isRevLink())
+				cnf->add_rev_links(link.rev().toStdString());
+			else if (link.isDocLink())
+				cnf->add_doc_links(link.doc().toStdString());
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+/*
+ * Walks a selector like "org.peerdrive.folder/0" down the structured data.
+ * Returns NULL if some element on the way does not exist.
+ */
+static Value *selectValue(Value *value, const QStringList &path)
+{
+	foreach (const QString &key, path) {
+		if (value->type() == Value::DICT) {
+			if (!value->contains(key))
+				return NULL;
+			value = &(*value)[key];
+		} else if (value->type() == Value::LIST) {
+			bool ok;
+			int i = key.toInt(&ok);
+			if (!ok || i < 0 || i >= value->size())
+				return NULL;
+			value = &(*value)[i];
+		} else
+			return NULL;
+	}
+
+	return value;
+}
+
+/*****************************************************************************/
+
+MockDaemon::MockDaemon(const MockOptions &options, QObject *parent)
+	: QThread(parent)
+	, m_options(options)
+	, m_port(options.port)
+{
+	QMutexLocker locker(&m_startupMutex);
+
+	start();
+	m_startupDone.wait(&m_startupMutex);
+}
+
+MockDaemon::~MockDaemon()
+{
+	exit();
+	wait();
+}
+
+QString MockDaemon::address() const
+{
+	return QString("tcp://127.0.0.1:%1/00").arg(m_port);
+}
+
+QString MockDaemon::localAddress() const
+{
+	if (m_localPath.isEmpty())
+		return QString();
+
+	return QString("unix://%1").arg(m_localPath);
+}
+
+void MockDaemon::run()
+{
+	// the state must outlive all sessions, which are owned by the servers
+	MockState state(m_options);
+	QTcpServer server;
+	new MockAcceptor(&server, &state, m_options);
+
+	if (!server.listen(QHostAddress::LocalHost, m_port))
+		qDebug() << "pdmockd: cannot listen:" << server.errorString();
+
+	QLocalServer *local = NULL;
+	if (!m_options.localPath.isEmpty()) {
+		local = new QLocalServer;
+		new MockAcceptor(local, &state, m_options);
+		QLocalServer::removeServer(m_options.localPath);
+		if (local->listen(m_options.localPath))
+			m_localPath = local->fullServerName();
+		else
+			qDebug() << "pdmockd: cannot listen:" << local->errorString();
+	}
+
+	m_startupMutex.lock();
+	m_port = server.serverPort();
+	m_startupDone.wakeAll();
+	m_startupMutex.unlock();
+
+	exec();
+
+	delete local;
+}
+
+MockAcceptor::MockAcceptor(QObject *server, MockState *state,
+	const MockOptions &options)
+	: QObject(server)
+	, m_state(state)
+	, m_options(options)
+{
+	connect(server, SIGNAL(newConnection()), this, SLOT(newConnection()));
+}
+
+void MockAcceptor::newConnection()
+{
+	if (QTcpServer *server = qobject_cast<QTcpServer*>(sender())) {
+		while (server->hasPendingConnections()) {
+			QTcpSocket *socket = server->nextPendingConnection();
+			socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+			connect(socket, SIGNAL(disconnected()), socket, SLOT(deleteLater()));
+			new MockSession(socket, m_state, m_options);
+		}
+	} else if (QLocalServer *server = qobject_cast<QLocalServer*>(sender())) {
+		while (server->hasPendingConnections()) {
+			QLocalSocket *socket = server->nextPendingConnection();
+			connect(socket, SIGNAL(disconnected()), socket, SLOT(deleteLater()));
+			new MockSession(socket, m_state, m_options);
+		}
+	}
+}
+
+/*****************************************************************************/
+
+MockSession::MockSession(QIODevice *socket, MockState *state,
+	const MockOptions &options)
+	: QObject(socket)
+	, m_socket(socket)
+	, m_state(state)
+	, m_options(options)
+	, m_large(false)
+	, m_upFree(0)
+	, m_downFree(0)
+{
+	m_timer.setSingleShot(true);
+	m_clock.start();
+	m_state->addSession(this);
+
+	connect(socket, SIGNAL(readyRead()), this, SLOT(readyRead()));
+	connect(&m_timer, SIGNAL(timeout()), this, SLOT(sendDue()));
+}
+
+MockSession::~MockSession()
+{
+	m_state->delSession(this);
+}
+
+void MockSession::readyRead()
+{
+	m_buf.append(m_socket->readAll());
+
+	int pos = 0;
+	while (m_buf.size() - pos > 2) {
+		const uchar *frame = (const uchar *)m_buf.constData() + pos;
+		int header = 2;
+		int expect;
+
+		if (m_large && (*frame & 0x80)) {
+			if (m_buf.size() - pos < 4)
+				break;
+			header = 4;
+			expect = qFromBigEndian<quint32>(frame) & ~FRAME_LARGE;
+		} else
+			expect = qFromBigEndian<quint16>(frame);
+
+		if (pos + expect + header > m_buf.size())
+			break;
+
+		quint32 ref = qFromBigEndian<quint32>(frame + header);
+		quint16 msg = qFromBigEndian<quint16>(frame + header + 4);
+		if ((msg & 3) == FLAG_REQ)
+			handle(ref, msg >> 4, m_buf.mid(pos + header + 6, expect - 6));
+
+		pos += expect + header;
+	}
+
+	m_buf.remove(0, pos);
+}
+
+void MockSession::handle(quint32 ref, int msg, const QByteArray &body)
+{
+	if (msg == INIT_MSG) {
+		// The cookie is not checked. The confirmation is not delayed so that
+		// clients do not run into their connect timeout.
+		InitReq req;
+		parse(&req, body);
+
+		InitCnf cnf;
+		cnf.set_major(2);
+		cnf.set_minor(0);
+		cnf.set_max_packet_size(m_options.maxPacketSize);
+		cnf.set_large_frames(m_options.largeFrames && req.large_frames());
+		send(ref, msg, FLAG_CNF, serialize(cnf), now());
+
+		// switch after the confirmation went out in the old format
+		m_large = cnf.large_frames();
+		return;
+	}
+
+	// the request must have been transferred before the daemon can start
+	qint64 ready = transfer(&m_upFree, now(), body.size() + 10) + latency();
+
+	QByteArray cnf;
+	int err = m_state->handle(this, msg, body, &cnf);
+	if (err) {
+		ErrorCnf errCnf;
+		errCnf.set_error((ErrorCode)(err - 1));
+		send(ref, ERROR_MSG, FLAG_CNF, serialize(errCnf), ready);
+	} else
+		send(ref, msg, FLAG_CNF, cnf, ready);
+}
+
+void MockSession::indicate(int msg, const QByteArray &body)
+{
+	send(0, msg, FLAG_IND, body, now() + latency());
+}
+
+qint64 MockSession::transfer(qint64 *linkFree, qint64 start, int size) const
+{
+	if (m_options.bandwidth <= 0)
+		return start;
+
+	*linkFree = qMax(start, *linkFree) + size * Q_INT64_C(1000000) /
+		m_options.bandwidth;
+	return *linkFree;
+}
+
+qint64 MockSession::latency() const
+{
+	qint64 ret = m_options.latency;
+	if (m_options.jitter > 0)
+		ret += qrand() % (2 * m_options.jitter + 1) - m_options.jitter;
+
+	return qMax<qint64>(0, ret);
+}
+
+void MockSession::send(quint32 ref, int msg, int flag, const QByteArray &body,
+	qint64 ready)
+{
+	int len = 6 + body.size();
+	uchar header[10];
+	int offset = 0;
+
+	if (m_large && len > FRAME_SHORT_MAX) {
+		qToBigEndian((quint32)(FRAME_LARGE | len), header);
+	} else {
+		offset = 2;
+		qToBigEndian((quint16)len, header + 2);
+	}
+	qToBigEndian((quint32)ref, header + 4);
+	qToBigEndian((quint16)((msg << 4) | flag), header + 8);
+
+	Pending p;
+	p.frame.reserve(10 - offset + body.size());
+	p.frame.append((const char *)header + offset, 10 - offset);
+	p.frame.append(body);
+	p.due = transfer(&m_downFree, ready, p.frame.size());
+
+	qint64 current = now();
+	if (p.due <= current && m_pending.isEmpty()) {
+		m_socket->write(p.frame);
+		return;
+	}
+
+	int i = m_pending.size();
+	while (i > 0 && m_pending.at(i-1).due > p.due)
+		i--;
+	m_pending.insert(i, p);
+
+	if (i == 0)
+		m_timer.start(qMax<qint64>(0, (p.due - current + 999) / 1000));
+}
+
+void MockSession::sendDue()
+{
+	qint64 current = now();
+
+	while (!m_pending.isEmpty() && m_pending.first().due <= current)
+		m_socket->write(m_pending.takeFirst().frame);
+
+	if (!m_pending.isEmpty())
+		m_timer.start(qMax<qint64>(0, (m_pending.first().due - current + 999) / 1000));
+}
+
+/*****************************************************************************/
+
+MockState::MockState(const MockOptions &options)
+	: m_options(options)
+	, m_nextHandle(1)
+	, m_nextId(0)
+{
+	for (unsigned int i = 0; i < sizeof(m_handlers) / sizeof(m_handlers[0]); i++)
+		m_handlers[i] = NULL;
+
+	m_handlers[ENUM_MSG] = &MockState::doEnum;
+	m_handlers[LOOKUP_DOC_MSG] = &MockState::doLookupDoc;
+	m_handlers[LOOKUP_REV_MSG] = &MockState::doLookupRev;
+	m_handlers[STAT_MSG] = &MockState::doStat;
+	m_handlers[PEEK_MSG] = &MockState::doPeek;
+	m_handlers[CREATE_MSG] = &MockState::doCreate;
+	m_handlers[FORK_MSG] = &MockState::doFork;
+	m_handlers[UPDATE_MSG] = &MockState::doUpdate;
+	m_handlers[RESUME_MSG] = &MockState::doResume;
+	m_handlers[READ_MSG] = &MockState::doRead;
+	m_handlers[TRUNC_MSG] = &MockState::doTrunc;
+	m_handlers[WRITE_BUFFER_MSG] = &MockState::doWriteBuffer;
+	m_handlers[WRITE_COMMIT_MSG] = &MockState::doWriteCommit;
+	m_handlers[FSTAT_MSG] = &MockState::doFStat;
+	m_handlers[SET_FLAGS_MSG] = &MockState::doSetFlags;
+	m_handlers[SET_TYPE_MSG] = &MockState::doSetType;
+	m_handlers[SET_MTIME_MSG] = &MockState::doSetMTime;
+	m_handlers[MERGE_MSG] = &MockState::doMerge;
+	m_handlers[REBASE_MSG] = &MockState::doRebase;
+	m_handlers[COMMIT_MSG] = &MockState::doCommit;
+	m_handlers[SUSPEND_MSG] = &MockState::doSuspend;
+	m_handlers[CLOSE_MSG] = &MockState::doClose;
+	m_handlers[WATCH_ADD_MSG] = &MockState::doWatchAdd;
+	m_handlers[WATCH_REM_MSG] = &MockState::doWatchRem;
+	m_handlers[WATCH_PROGRESS_MSG] = &MockState::doWatchProgress;
+	m_handlers[FORGET_MSG] = &MockState::doForget;
+	m_handlers[DELETE_DOC_MSG] = &MockState::doDeleteDoc;
+	m_handlers[DELETE_REV_MSG] = &MockState::doDeleteRev;
+	m_handlers[FORWARD_DOC_MSG] = &MockState::doForwardDoc;
+	m_handlers[REPLICATE_DOC_MSG] = &MockState::doReplicateDoc;
+	m_handlers[REPLICATE_REV_MSG] = &MockState::doReplicateRev;
+	m_handlers[MOUNT_MSG] = &MockState::doMount;
+	m_handlers[UNMOUNT_MSG] = &MockState::doUnmount;
+	m_handlers[GET_PATH_MSG] = &MockState::doGetPath;
+	m_handlers[PROGRESS_START_MSG] = &MockState::doProgressStart;
+	m_handlers[PROGRESS_END_MSG] = &MockState::doProgressEnd;
+	m_handlers[PROGRESS_QUERY_MSG] = &MockState::doProgressQuery;
+	m_handlers[WALK_PATH_MSG] = &MockState::doWalkPath;
+	m_handlers[GET_DATA_MSG] = &MockState::doGetData;
+	m_handlers[SET_DATA_MSG] = &MockState::doSetData;
+	m_handlers[GET_LINKS_MSG] = &MockState::doGetLinks;
+
+	m_sysStore = mount("sys");
+	foreach (const QString &label, options.stores)
+		mount(label);
+}
+
+MockState::~MockState()
+{
+	qDeleteAll(m_stores);
+}
+
+void MockState::addSession(MockSession *session)
+{
+	m_sessions.append(session);
+}
+
+void MockState::delSession(MockSession *session)
+{
+	m_sessions.removeAll(session);
+}
+
+int MockState::handle(MockSession *session, int msg, const QByteArray &req,
+	QByteArray *cnf)
+{
+	if (msg < 0 || msg >= (int)(sizeof(m_handlers) / sizeof(m_handlers[0])) ||
+	    !m_handlers[msg])
+		return fail(ERR_ENOSYS);
+
+	return (this->*m_handlers[msg])(session, req, cnf);
+}
+
+quint64 MockState::now()
+{
+	return (quint64)QDateTime::currentMSecsSinceEpoch() * 1000;
+}
+
+QByteArray MockState::newId()
+{
+	return hash(QByteArray::number(m_nextId++) + "pdmockd");
+}
+
+MockStore *MockState::mount(const QString &label)
+{
+	MockStore *store = new MockStore;
+	store->sid = newId();
+	store->label = label;
+	store->src = "mock:" + label;
+
+	// the root document of a store has the same id as the store itself
+	Value data(Value::DICT);
+	data["org.peerdrive.folder"] = Value(Value::LIST);
+
+	MockRevision root;
+	root.flags = 0;
+	root.data = data.toByteArray();
+	root.crtime = root.mtime = now();
+	root.typeCode = "org.peerdrive.store";
+	root.creatorCode = "org.peerdrive.pdmockd";
+	store->docs.insert(store->sid, commitRev(store, root));
+
+	m_stores.append(store);
+	return store;
+}
+
+MockStore *MockState::findStore(const QByteArray &sid)
+{
+	foreach (MockStore *store, m_stores)
+		if (store->sid == sid)
+			return store;
+
+	return NULL;
+}
+
+QList<MockStore*> MockState::selectStores(const QList<QByteArray> &sids)
+{
+	if (sids.isEmpty())
+		return m_stores;
+
+	QList<MockStore*> ret;
+	foreach (const QByteArray &sid, sids)
+		if (MockStore *store = findStore(sid))
+			ret << store;
+
+	return ret;
+}
+
+const MockRevision *MockState::findRev(const QList<MockStore*> &stores,
+	const QByteArray &rev)
+{
+	foreach (MockStore *store, stores) {
+		QHash<QByteArray, MockRevision>::const_iterator i = store->revs.find(rev);
+		if (i != store->revs.constEnd())
+			return &i.value();
+	}
+
+	return NULL;
+}
+
+MockHandle *MockState::findHandle(quint32 handle, bool write)
+{
+	QHash<quint32, MockHandle>::iterator i = m_handles.find(handle);
+	if (i == m_handles.end())
+		return NULL;
+	if (write && !i.value().writable)
+		return NULL;
+
+	return &i.value();
+}
+
+quint32 MockState::openHandle(MockStore *store, const QByteArray &doc,
+	const QByteArray &rev, const MockRevision &work, bool writable)
+{
+	quint32 handle = m_nextHandle++;
+
+	MockHandle &h = m_handles[handle];
+	h.store = store->sid;
+	h.doc = doc;
+	h.rev = rev;
+	h.writable = writable;
+	h.work = work;
+
+	return handle;
+}
+
+QByteArray MockState::commitRev(MockStore *store, const MockRevision &rev)
+{
+	QByteArray rid = newId();
+	store->revs.insert(rid, rev);
+	return rid;
+}
+
+bool MockState::copyRevs(MockStore *src, MockStore *dst, const QByteArray &rev)
+{
+	if (!src->revs.contains(rev) && !dst->revs.contains(rev))
+		return false;
+
+	// parents that are missing in the source are silently skipped
+	QList<QByteArray> todo;
+	todo << rev;
+	while (!todo.isEmpty()) {
+		QByteArray rid = todo.takeFirst();
+		if (dst->revs.contains(rid) || !src->revs.contains(rid))
+			continue;
+
+		const MockRevision &r = src->revs[rid];
+		dst->revs.insert(rid, r);
+		todo << r.parents;
+	}
+
+	return true;
+}
+
+void MockState::notify(int event, bool isRev, const QByteArray &store,
+	const QByteArray &element)
+{
+	WatchInd ind;
+	ind.set_event((WatchInd_Event)event);
+	ind.set_type(isRev ? WatchInd_Type_REV : WatchInd_Type_DOC);
+	ind.set_store(str(store));
+	ind.set_element(str(element));
+	QByteArray body = serialize(ind);
+
+	foreach (MockSession *session, m_sessions) {
+		const QSet<QByteArray> &watches = isRev ? session->revWatches
+			: session->docWatches;
+		if (watches.contains(element))
+			session->indicate(WATCH_MSG, body);
+	}
+}
+
+/*****************************************************************************/
+
+int MockState::doEnum(MockSession *, const QByteArray &, QByteArray *cnf)
+{
+	EnumCnf enumCnf;
+
+	fillStore(m_sysStore, enumCnf.mutable_sys_store());
+	foreach (MockStore *store, m_stores)
+		if (store != m_sysStore)
+			fillStore(store, enumCnf.add_stores());
+
+	*cnf = serialize(enumCnf);
+	return 0;
+}
+
+int MockState::doLookupDoc(MockSession *, const QByteArray &raw, QByteArray *cnf)
+{
+	LookupDocReq req;
+	if (!parse(&req, raw))
+		return fail(ERR_EBADRPC);
+
+	QByteArray doc = bytes(req.doc());
+	QMap<QByteArray, QList<QByteArray> > revs, preRevs;
+	foreach (MockStore *store, selectStores(toList(req.stores()))) {
+		if (store->docs.contains(doc))
+			revs[store->docs.value(doc)] << store->sid;
+		foreach (const QByteArray &rev, store->preRevs.value(doc))
+			preRevs[rev] << store->sid;
+	}
+
+	LookupDocCnf lookupCnf;
+	QMapIterator<QByteArray, QList<QByteArray> > i(revs);
+	while (i.hasNext()) {
+		i.next();
+		LookupDocCnf_RevMap *map = lookupCnf.add_revs();
+		map->set_rid(str(i.key()));
+		foreach (const QByteArray &sid, i.value())
+			map->add_stores(str(sid));
+	}
+	QMapIterator<QByteArray, QList<QByteArray> > j(preRevs);
+	while (j.hasNext()) {
+		j.next();
+		LookupDocCnf_RevMap *map = lookupCnf.add_pre_revs();
+		map->set_rid(str(j.key()));
+		foreach (const QByteArray &sid, j.value())
+			map->add_stores(str(sid));
+	}
+
+	*cnf = serialize(lookupCnf);
+	return 0;
+}
+
+int MockState::doLookupRev(MockSession *, const QByteArray &raw, QByteArray *cnf)
+{
+	LookupRevReq req;
+	if (!parse(&req, raw))
+		return fail(ERR_EBADRPC);
+
+	QByteArray rev = bytes(req.rev());
+	LookupRevCnf lookupCnf;
+	foreach (MockStore *store, selectStores(toList(req.stores())))
+		if (store->revs.contains(rev))
+			lookupCnf.add_stores(str(store->sid));
+
+	*cnf = serialize(lookupCnf);
+	return 0;
+}
+
+int MockState::doStat(MockSession *, const QByteArray &raw, QByteArray *cnf)
+{
+	StatReq req;
+	if (!parse(&req, raw))
+		return fail(ERR_EBADRPC);
+
+	const MockRevision *rev = findRev(selectStores(toList(req.stores())),
+		bytes(req.rev()));
+	if (!rev)
+		return fail(ERR_ENOENT);
+
+	StatCnf statCnf;
+	fillStat(*rev, &statCnf);
+	*cnf = serialize(statCnf);
+	return 0;
+}
+
+int MockState::doGetLinks(MockSession *, const QByteArray &raw, QByteArray *cnf)
+{
+	GetLinksReq req;
+	if (!parse(&req, raw))
+		return fail(ERR_EBADRPC);
+
+	QList<MockStore*> stores = selectStores(toList(req.stores()));
+	const MockRevision *rev = findRev(stores, bytes(req.rev()));
+	if (!rev)
+		return fail(ERR_ENOENT);
+
+	GetLinksCnf linksCnf;
+	if (!rev->data.isEmpty()) {
+		try {
+			collectLinks(Value::fromByteArray(rev->data, DId()), &linksCnf);
+		} catch (ValueError&) {
+			return fail(ERR_EINVAL);
+		}
+	}
+
+	*cnf = serialize(linksCnf);
+	return 0;
+}
+
+int MockState::doPeek(MockSession *, const QByteArray &raw, QByteArray *cnf)
+{
+	PeekReq req;
+	if (!parse(&req, raw))
+		return fail(ERR_EBADRPC);
+
+	MockStore *store = findStore(bytes(req.store()));
+	if (!store)
+		return fail(ERR_ENOENT);
+
+	QByteArray rid = bytes(req.rev());
+	if (!store->revs.contains(rid))
+		return fail(ERR_ENOENT);
+
+	PeekCnf peekCnf;
+	peekCnf.set_handle(openHandle(store, QByteArray(), rid, store->revs[rid],
+		false));
+	*cnf = serialize(peekCnf);
+	return 0;
+}
+
+int MockState::doCreate(MockSession *, const QByteArray &raw, QByteArray *cnf)
+{
+	CreateReq req;
+	if (!parse(&req, raw))
+		return fail(ERR_EBADRPC);
+
+	MockStore *store = findStore(bytes(req.store()));
+	if (!store)
+		return fail(ERR_ENOENT);
+
+	MockRevision work;
+	work.flags = 0;
+	work.crtime = work.mtime = now();
+	work.typeCode = bytes(req.type_code());
+	work.creatorCode = bytes(req.creator_code());
+
+	QByteArray doc = newId();
+	CreateCnf createCnf;
+	createCnf.set_handle(openHandle(store, doc, QByteArray(), work, true));
+	createCnf.set_doc(str(doc));
+	*cnf = serialize(createCnf);
+	return 0;
+}
+
+int MockState::doFork(MockSession *, const QByteArray &raw, QByteArray *cnf)
+{
+	ForkReq req;
+	if (!parse(&req, raw))
+		return fail(ERR_EBADRPC);
+
+	MockStore *store = findStore(bytes(req.store()));
+	if (!store)
+		return fail(ERR_ENOENT);
+
+	QByteArray rid = bytes(req.rev());
+	if (!store->revs.contains(rid))
+		return fail(ERR_ENOENT);
+
+	MockRevision work = store->revs[rid];
+	work.parents = QList<QByteArray>() << rid;
+	work.creatorCode = bytes(req.creator_code());
+
+	QByteArray doc = newId();
+	ForkCnf forkCnf;
+	forkCnf.set_handle(openHandle(store, doc, QByteArray(), work, true));
+	forkCnf.set_doc(str(doc));
+	*cnf = serialize(forkCnf);
+	return 0;
+}
+
+int MockState::doUpdate(MockSession *, const QByteArray &raw, QByteArray *cnf)
+{
+	UpdateReq req;
+	if (!parse(&req, raw))
+		return fail(ERR_EBADRPC);
+
+	MockStore *store = findStore(bytes(req.store()));
+	if (!store)
+		return fail(ERR_ENOENT);
+
+	QByteArray doc = bytes(req.doc());
+	QByteArray rid = bytes(req.rev());
+	if (!store->docs.contains(doc))
+		return fail(ERR_ENOENT);
+	if (store->docs.value(doc) != rid)
+		return fail(ERR_ECONFLICT);
+
+	MockRevision work = store->revs[rid];
+	work.parents = QList<QByteArray>() << rid;
+	if (req.has_creator_code())
+		work.creatorCode = bytes(req.creator_code());
+
+	UpdateCnf updateCnf;
+	updateCnf.set_handle(openHandle(store, doc, rid, work, true));
+	*cnf = serialize(updateCnf);
+	return 0;
+}
+
+int MockState::doResume(MockSession *, const QByteArray &raw, QByteArray *cnf)
+{
+	ResumeReq req;
+	if (!parse(&req, raw))
+		return fail(ERR_EBADRPC);
+
+	MockStore *store = findStore(bytes(req.store()));
+	if (!store)
+		return fail(ERR_ENOENT);
+
+	QByteArray doc = bytes(req.doc());
+	QByteArray rid = bytes(req.rev());
+	if (!store->preRevs.value(doc).contains(rid))
+		return fail(ERR_ENOENT);
+
+	MockRevision work = store->revs[rid];
+	if (req.has_creator_code())
+		work.creatorCode = bytes(req.creator_code());
+
+	quint32 handle = openHandle(store, doc, store->docs.value(doc), work, true);
+	m_handles[handle].resumed = rid;
+
+	ResumeCnf resumeCnf;
+	resumeCnf.set_handle(handle);
+	*cnf = serialize(resumeCnf);
+	return 0;
+}
+
+int MockState::doRead(MockSession *, const QByteArray &raw, QByteArray *cnf)
+{
+	ReadReq req;
+	if (!parse(&req, raw))
+		return fail(ERR_EBADRPC);
+
+	MockHandle *h = findHandle(req.handle());
+	if (!h)
+		return fail(ERR_EBADF);
+
+	QByteArray part = bytes(req.part());
+	if (!h->work.attachments.contains(part))
+		return fail(ERR_ENOENT);
+
+	const QByteArray &data = h->work.attachments[part].data;
+	ReadCnf readCnf;
+	if (req.offset() < (quint64)data.size())
+		readCnf.set_data(data.constData() + req.offset(),
+			qMin<quint64>(req.length(), data.size() - req.offset()));
+	else
+		readCnf.set_data(std::string());
+
+	*cnf = serialize(readCnf);
+	return 0;
+}
+
+int MockState::doTrunc(MockSession *, const QByteArray &raw, QByteArray *)
+{
+	TruncReq req;
+	if (!parse(&req, raw))
+		return fail(ERR_EBADRPC);
+
+	MockHandle *h = findHandle(req.handle(), true);
+	if (!h)
+		return fail(ERR_EBADF);
+	if (req.offset() > MaxAttachmentSize)
+		return fail(ERR_EFBIG);
+
+	QByteArray part = bytes(req.part());
+	quint64 mtime = now();
+	if (!h->work.attachments.contains(part))
+		h->work.attachments[part].crtime = mtime;
+
+	MockRevision::Attachment &a = h->work.attachments[part];
+	int size = (int)req.offset();
+	if (size > a.data.size())
+		a.data.append(QByteArray(size - a.data.size(), '\0'));
+	else
+		a.data.truncate(size);
+	a.mtime = mtime;
+
+	return 0;
+}
+
+int MockState::doWriteBuffer(MockSession *, const QByteArray &raw, QByteArray *)
+{
+	WriteBufferReq req;
+	if (!parse(&req, raw))
+		return fail(ERR_EBADRPC);
+
+	MockHandle *h = findHandle(req.handle(), true);
+	if (!h)
+		return fail(ERR_EBADF);
+
+	h->buffers[bytes(req.part())].append(bytes(req.data()));
+	return 0;
+}
+
+int MockState::doWriteCommit(MockSession *, const QByteArray &raw, QByteArray *)
+{
+	WriteCommitReq req;
+	if (!parse(&req, raw))
+		return fail(ERR_EBADRPC);
+
+	MockHandle *h = findHandle(req.handle(), true);
+	if (!h)
+		return fail(ERR_EBADF);
+
+	QByteArray part = bytes(req.part());
+	QByteArray buf = h->buffers.take(part) + bytes(req.data());
+	if (req.offset() > MaxAttachmentSize - buf.size())
+		return fail(ERR_EFBIG);
+
+	quint64 mtime = now();
+	if (!h->work.attachments.contains(part))
+		h->work.attachments[part].crtime = mtime;
+
+	MockRevision::Attachment &a = h->work.attachments[part];
+	int offset = (int)req.offset();
+	if (offset > a.data.size())
+		a.data.append(QByteArray(offset - a.data.size(), '\0'));
+	a.data.replace(offset, buf.size(), buf);
+	a.mtime = mtime;
+
+	return 0;
+}
+
+int MockState::doFStat(MockSession *, const QByteArray &raw, QByteArray *cnf)
+{
+	FStatReq req;
+	if (!parse(&req, raw))
+		return fail(ERR_EBADRPC);
+
+	MockHandle *h = findHandle(req.handle());
+	if (!h)
+		return fail(ERR_EBADF);
+
+	StatCnf statCnf;
+	fillStat(h->work, &statCnf);
+	*cnf = serialize(statCnf);
+	return 0;
+}
+
+int MockState::doGetData(MockSession *, const QByteArray &raw, QByteArray *cnf)
+{
+	GetDataReq req;
+	if (!parse(&req, raw))
+		return fail(ERR_EBADRPC);
+
+	MockHandle *h = findHandle(req.handle());
+	if (!h)
+		return fail(ERR_EBADF);
+
+	QStringList path = QString::fromUtf8(req.selector().c_str()).split('/',
+		QString::SkipEmptyParts);
+	GetDataCnf dataCnf;
+	if (path.isEmpty()) {
+		dataCnf.set_data(str(h->work.data));
+	} else {
+		try {
+			Value root = Value::fromByteArray(h->work.data, DId(h->store));
+			Value *value = selectValue(&root, path);
+			if (!value)
+				return fail(ERR_ENOENT);
+			dataCnf.set_data(str(value->toByteArray()));
+		} catch (ValueError&) {
+			return fail(ERR_EINVAL);
+		}
+	}
+
+	*cnf = serialize(dataCnf);
+	return 0;
+}
+
+int MockState::doSetData(MockSession *, const QByteArray &raw, QByteArray *)
+{
+	SetDataReq req;
+	if (!parse(&req, raw))
+		return fail(ERR_EBADRPC);
+
+	MockHandle *h = findHandle(req.handle(), true);
+	if (!h)
+		return fail(ERR_EBADF);
+
+	QStringList path = QString::fromUtf8(req.selector().c_str()).split('/',
+		QString::SkipEmptyParts);
+	if (path.isEmpty()) {
+		h->work.data = bytes(req.data());
+		return 0;
+	}
+
+	// the last element may be a new key of a dictionary
+	try {
+		DId store(h->store);
+		Value root = Value::fromByteArray(h->work.data, store);
+		QString key = path.takeLast();
+		Value *parent = selectValue(&root, path);
+		if (!parent)
+			return fail(ERR_ENOENT);
+
+		Value value = Value::fromByteArray(bytes(req.data()), store);
+		if (parent->type() == Value::DICT) {
+			(*parent)[key] = value;
+		} else if (parent->type() == Value::LIST) {
+			bool ok;
+			int i = key.toInt(&ok);
+			if (!ok || i < 0 || i >= parent->size())
+				return fail(ERR_ENOENT);
+			(*parent)[i] = value;
+		} else
+			return fail(ERR_ENOENT);
+
+		h->work.data = root.toByteArray();
+	} catch (ValueError&) {
+		return fail(ERR_EINVAL);
+	}
+
+	return 0;
+}
+
+int MockState::doSetFlags(MockSession *, const QByteArray &raw, QByteArray *)
+{
+	SetFlagsReq req;
+	if (!parse(&req, raw))
+		return fail(ERR_EBADRPC);
+
+	MockHandle *h = findHandle(req.handle(), true);
+	if (!h)
+		return fail(ERR_EBADF);
+
+	h->work.flags = req.flags();
+	return 0;
+}
+
+int MockState::doSetType(MockSession *, const QByteArray &raw, QByteArray *)
+{
+	SetTypeReq req;
+	if (!parse(&req, raw))
+		return fail(ERR_EBADRPC);
+
+	MockHandle *h = findHandle(req.handle(), true);
+	if (!h)
+		return fail(ERR_EBADF);
+
+	h->work.typeCode = bytes(req.type_code());
+	return 0;
+}
+
+int MockState::doSetMTime(MockSession *, const QByteArray &raw, QByteArray *)
+{
+	SetMTimeReq req;
+	if (!parse(&req, raw))
+		return fail(ERR_EBADRPC);
+
+	MockHandle *h = findHandle(req.handle(), true);
+	if (!h)
+		return fail(ERR_EBADF);
+
+	QByteArray part = bytes(req.attachment());
+	if (!h->work.attachments.contains(part))
+		return fail(ERR_ENOENT);
+
+	h->work.attachments[part].mtime = req.mtime();
+	return 0;
+}
+
+int MockState::doMerge(MockSession *, const QByteArray &raw, QByteArray *)
+{
+	MergeReq req;
+	if (!parse(&req, raw))
+		return fail(ERR_EBADRPC);
+
+	MockHandle *h = findHandle(req.handle(), true);
+	if (!h)
+		return fail(ERR_EBADF);
+
+	MockStore *store = findStore(bytes(req.store()));
+	QByteArray rid = bytes(req.rev());
+	if (!store || !store->revs.contains(rid))
+		return fail(ERR_ENOENT);
+
+	MockStore *dst = findStore(h->store);
+	if (dst && dst != store)
+		copyRevs(store, dst, rid);
+	if (!h->work.parents.contains(rid))
+		h->work.parents << rid;
+
+	return 0;
+}
+
+int MockState::doRebase(MockSession *, const QByteArray &raw, QByteArray *)
+{
+	RebaseReq req;
+	if (!parse(&req, raw))
+		return fail(ERR_EBADRPC);
+
+	MockHandle *h = findHandle(req.handle(), true);
+	if (!h)
+		return fail(ERR_EBADF);
+
+	MockStore *store = findStore(h->store);
+	QByteArray rid = bytes(req.rev());
+	if (!store || !store->revs.contains(rid))
+		return fail(ERR_ENOENT);
+
+	h->work.parents = QList<QByteArray>() << rid;
+	h->rev = rid;
+	return 0;
+}
+
+int MockState::doCommit(MockSession *, const QByteArray &raw, QByteArray *cnf)
+{
+	CommitReq req;
+	if (!parse(&req, raw))
+		return fail(ERR_EBADRPC);
+
+	MockHandle *h = findHandle(req.handle(), true);
+	if (!h)
+		return fail(ERR_EBADF);
+
+	MockStore *store = findStore(h->store);
+	if (!store)
+		return fail(ERR_ENOENT);
+
+	bool existed = store->docs.contains(h->doc);
+	if (existed && store->docs.value(h->doc) != h->rev)
+		return fail(ERR_ECONFLICT);
+
+	if (req.has_comment())
+		h->work.comment = bytes(req.comment());
+	h->work.mtime = now();
+	h->buffers.clear();
+
+	QByteArray rid = commitRev(store, h->work);
+	store->docs.insert(h->doc, rid);
+	if (!h->resumed.isEmpty()) {
+		store->preRevs[h->doc].removeAll(h->resumed);
+		h->resumed.clear();
+	}
+
+	// further commits of the handle are based on the new revision
+	h->rev = rid;
+	h->work.parents = QList<QByteArray>() << rid;
+
+	notify(existed ? WatchInd_Event_MODIFIED : WatchInd_Event_APPEARED, false,
+		store->sid, h->doc);
+
+	CommitCnf commitCnf;
+	commitCnf.set_rev(str(rid));
+	*cnf = serialize(commitCnf);
+	return 0;
+}
+
+int MockState::doSuspend(MockSession *, const QByteArray &raw, QByteArray *cnf)
+{
+	SuspendReq req;
+	if (!parse(&req, raw))
+		return fail(ERR_EBADRPC);
+
+	MockHandle *h = findHandle(req.handle(), true);
+	if (!h)
+		return fail(ERR_EBADF);
+
+	MockStore *store = findStore(h->store);
+	if (!store)
+		return fail(ERR_ENOENT);
+
+	if (req.has_comment())
+		h->work.comment = bytes(req.comment());
+	h->work.mtime = now();
+
+	QByteArray rid = commitRev(store, h->work);
+	QList<QByteArray> &preRevs = store->preRevs[h->doc];
+	if (!h->resumed.isEmpty())
+		preRevs.removeAll(h->resumed);
+	preRevs << rid;
+	h->resumed = rid;
+
+	notify(WatchInd_Event_MODIFIED, false, store->sid, h->doc);
+
+	SuspendCnf suspendCnf;
+	suspendCnf.set_rev(str(rid));
+	*cnf = serialize(suspendCnf);
+	return 0;
+}
+
+int MockState::doClose(MockSession *, const QByteArray &raw, QByteArray *)
+{
+	CloseReq req;
+	if (!parse(&req, raw))
+		return fail(ERR_EBADRPC);
+
+	if (!m_handles.remove(req.handle()))
+		return fail(ERR_EBADF);
+
+	return 0;
+}
+
+int MockState::doWatchAdd(MockSession *session, const QByteArray &raw, QByteArray *)
+{
+	WatchAddReq req;
+	if (!parse(&req, raw))
+		return fail(ERR_EBADRPC);
+
+	if (req.type() == WatchAddReq_Type_REV)
+		session->revWatches.insert(bytes(req.element()));
+	else
+		session->docWatches.insert(bytes(req.element()));
+
+	return 0;
+}
+
+int MockState::doWatchRem(MockSession *session, const QByteArray &raw, QByteArray *)
+{
+	WatchRemReq req;
+	if (!parse(&req, raw))
+		return fail(ERR_EBADRPC);
+
+	if (req.type() == WatchRemReq_Type_REV)
+		session->revWatches.remove(bytes(req.element()));
+	else
+		session->docWatches.remove(bytes(req.element()));
+
+	return 0;
+}
+
+int MockState::doWatchProgress(MockSession *, const QByteArray &raw, QByteArray *)
+{
+	// there is never any progress to report
+	WatchProgressReq req;
+	if (!parse(&req, raw))
+		return fail(ERR_EBADRPC);
+
+	return 0;
+}
+
+int MockState::doForget(MockSession *, const QByteArray &raw, QByteArray *)
+{
+	ForgetReq req;
+	if (!parse(&req, raw))
+		return fail(ERR_EBADRPC);
+
+	MockStore *store = findStore(bytes(req.store()));
+	if (!store)
+		return fail(ERR_ENOENT);
+
+	QByteArray doc = bytes(req.doc());
+	if (!store->preRevs[doc].removeAll(bytes(req.rev())))
+		return fail(ERR_ENOENT);
+
+	notify(WatchInd_Event_MODIFIED, false, store->sid, doc);
+	return 0;
+}
+
+int MockState::doDeleteDoc(MockSession *, const QByteArray &raw, QByteArray *)
+{
+	DeleteDocReq req;
+	if (!parse(&req, raw))
+		return fail(ERR_EBADRPC);
+
+	MockStore *store = findStore(bytes(req.store()));
+	if (!store)
+		return fail(ERR_ENOENT);
+
+	QByteArray doc = bytes(req.doc());
+	if (!store->docs.contains(doc))
+		return fail(ERR_ENOENT);
+	if (store->docs.value(doc) != bytes(req.rev()))
+		return fail(ERR_ECONFLICT);
+
+	store->docs.remove(doc);
+	store->preRevs.remove(doc);
+	notify(WatchInd_Event_DISAPPEARED, false, store->sid, doc);
+	return 0;
+}
+
+int MockState::doDeleteRev(MockSession *, const QByteArray &raw, QByteArray *)
+{
+	DeleteRevReq req;
+	if (!parse(&req, raw))
+		return fail(ERR_EBADRPC);
+
+	MockStore *store = findStore(bytes(req.store()));
+	if (!store)
+		return fail(ERR_ENOENT);
+
+	QByteArray rid = bytes(req.rev());
+	if (!store->revs.remove(rid))
+		return fail(ERR_ENOENT);
+
+	notify(WatchInd_Event_DISAPPEARED, true, store->sid, rid);
+	return 0;
+}
+
+int MockState::doForwardDoc(MockSession *, const QByteArray &raw, QByteArray *)
+{
+	ForwardDocReq req;
+	if (!parse(&req, raw))
+		return fail(ERR_EBADRPC);
+
+	MockStore *store = findStore(bytes(req.store()));
+	MockStore *src = findStore(bytes(req.src_store()));
+	if (!store || !src)
+		return fail(ERR_ENOENT);
+
+	QByteArray doc = bytes(req.doc());
+	QByteArray toRev = bytes(req.to_rev());
+	if (!store->docs.contains(doc))
+		return fail(ERR_ENOENT);
+	if (store->docs.value(doc) != bytes(req.from_rev()))
+		return fail(ERR_ECONFLICT);
+	if (!copyRevs(src, store, toRev))
+		return fail(ERR_ENOENT);
+
+	store->docs.insert(doc, toRev);
+	notify(WatchInd_Event_MODIFIED, false, store->sid, doc);
+	return 0;
+}
+
+int MockState::doReplicateDoc(MockSession *, const QByteArray &raw, QByteArray *cnf)
+{
+	ReplicateDocReq req;
+	if (!parse(&req, raw))
+		return fail(ERR_EBADRPC);
+
+	MockStore *src = findStore(bytes(req.src_store()));
+	MockStore *dst = findStore(bytes(req.dst_store()));
+	if (!src || !dst)
+		return fail(ERR_ENOENT);
+
+	QByteArray doc = bytes(req.doc());
+	if (!src->docs.contains(doc))
+		return fail(ERR_ENOENT);
+
+	QByteArray rid = src->docs.value(doc);
+	QByteArray old = dst->docs.value(doc);
+	if (old != rid) {
+		copyRevs(src, dst, rid);
+		dst->docs.insert(doc, rid);
+		notify(old.isEmpty() ? WatchInd_Event_APPEARED : WatchInd_Event_MODIFIED,
+			false, dst->sid, doc);
+	}
+
+	ReplicateDocCnf replicateCnf;
+	replicateCnf.set_handle(openHandle(dst, doc, rid, dst->revs[rid], false));
+	*cnf = serialize(replicateCnf);
+	return 0;
+}
+
+int MockState::doReplicateRev(MockSession *, const QByteArray &raw, QByteArray *cnf)
+{
+	ReplicateRevReq req;
+	if (!parse(&req, raw))
+		return fail(ERR_EBADRPC);
+
+	MockStore *src = findStore(bytes(req.src_store()));
+	MockStore *dst = findStore(bytes(req.dst_store()));
+	if (!src || !dst)
+		return fail(ERR_ENOENT);
+
+	QByteArray rid = bytes(req.rev());
+	if (!copyRevs(src, dst, rid))
+		return fail(ERR_ENOENT);
+
+	ReplicateRevCnf replicateCnf;
+	replicateCnf.set_handle(openHandle(dst, QByteArray(), rid, dst->revs[rid],
+		false));
+	*cnf = serialize(replicateCnf);
+	return 0;
+}
+
+int MockState::doMount(MockSession *, const QByteArray &raw, QByteArray *cnf)
+{
+	MountReq req;
+	if (!parse(&req, raw))
+		return fail(ERR_EBADRPC);
+
+	MockStore *store = mount(QString::fromUtf8(req.label().c_str()));
+	store->src = QString::fromUtf8(req.src().c_str());
+
+	MountCnf mountCnf;
+	mountCnf.set_sid(str(store->sid));
+	*cnf = serialize(mountCnf);
+	return 0;
+}
+
+int MockState::doUnmount(MockSession *, const QByteArray &raw, QByteArray *)
+{
+	UnmountReq req;
+	if (!parse(&req, raw))
+		return fail(ERR_EBADRPC);
+
+	MockStore *store = findStore(bytes(req.sid()));
+	if (!store)
+		return fail(ERR_ENOENT);
+	if (store == m_sysStore)
+		return fail(ERR_EBUSY);
+
+	QMutableHashIterator<quint32, MockHandle> i(m_handles);
+	while (i.hasNext())
+		if (i.next().value().store == store->sid)
+			i.remove();
+
+	m_stores.removeAll(store);
+	delete store;
+	return 0;
+}
+
+int MockState::doGetPath(MockSession *, const QByteArray &, QByteArray *)
+{
+	// there are no files behind the stores
+	return fail(ERR_ENOSYS);
+}
+
+int MockState::doProgressStart(MockSession *, const QByteArray &, QByteArray *)
+{
+	return fail(ERR_ENOENT);
+}
+
+int MockState::doProgressEnd(MockSession *, const QByteArray &, QByteArray *)
+{
+	return fail(ERR_ENOENT);
+}
+
+int MockState::doProgressQuery(MockSession *, const QByteArray &, QByteArray *cnf)
+{
+	*cnf = serialize(ProgressQueryCnf());
+	return 0;
+}
+
+int MockState::doWalkPath(MockSession *, const QByteArray &raw, QByteArray *cnf)
+{
+	WalkPathReq req;
+	if (!parse(&req, raw))
+		return fail(ERR_EBADRPC);
+
+	// only the root of a store can be looked up, i.e. "<label>:"
+	QString path = QString::fromUtf8(req.path().c_str());
+	if (!path.endsWith(':'))
+		return fail(ERR_ENOENT);
+	path.chop(1);
+
+	WalkPathCnf walkCnf;
+	foreach (MockStore *store, m_stores) {
+		if (store->label != path)
+			continue;
+
+		WalkPathCnf_Item *item = walkCnf.add_items();
+		item->set_store(str(store->sid));
+		item->set_doc(str(store->sid));
+		item->set_rev(str(store->docs.value(store->sid)));
+	}
+
+	if (walkCnf.items_size() == 0)
+		return fail(ERR_ENOENT);
+
+	*cnf = serialize(walkCnf);
+	return 0;
+}
@@ -0,0 +1,281 @@
+/*
+ * PeerDrive
+ * Copyright (C) 2013  Jan Klötzke <jan DOT kloetzke AT freenet DOT de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MOCKDAEMON_H
+#define MOCKDAEMON_H
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QList>
+#include <QMap>
+#include <QMutex>
+#include <QSet>
+#include <QString>
+#include <QStringList>
+#include <QThread>
+#include <QTimer>
+#include <QWaitCondition>
+
+class QIODevice;
+
+struct MockOptions {
+	MockOptions()
+		: maxPacketSize(16384)
+		, largeFrames(true)
+		, latency(0)
+		, jitter(0)
+		, bandwidth(0)
+		, port(0)
+	{
+		stores << "user";
+	}
+
+	unsigned int maxPacketSize;
+	bool largeFrames;
+	// delay of every confirmation and its random variation in microseconds
+	int latency;
+	int jitter;
+	// bytes per second in each direction, zero is unlimited
+	qint64 bandwidth;
+	quint16 port;
+	QString localPath;
+	// labels of the stores that are mounted besides the system store
+	QStringList stores;
+};
+
+/*
+ * In-memory PeerDrive daemon which speaks the v2.0 client protocol. Stores,
+ * documents and revisions are kept in memory and are lost when the daemon
+ * stops. Replication and synchronization are not simulated, the respective
+ * requests succeed without any progress being reported.
+ *
+ * Confirmations can be delayed to simulate a slow link. Each direction has
+ * its own bandwidth and every confirmation is additionally delayed by the
+ * latency plus a random jitter. The daemon listens on TCP and optionally on
+ * a unix domain socket and runs in its own thread.
+ */
+class MockDaemon : public QThread
+{
+	Q_OBJECT
+
+public:
+	MockDaemon(const MockOptions &options = MockOptions(), QObject *parent = NULL);
+	~MockDaemon();
+
+	QString address() const;
+	QString localAddress() const;
+
+protected:
+	void run();
+
+private:
+	MockOptions m_options;
+	quint16 m_port;
+	QString m_localPath;
+
+	QMutex m_startupMutex;
+	QWaitCondition m_startupDone;
+};
+
+class MockSession;
+
+struct MockRevision {
+	struct Attachment {
+		QByteArray data;
+		quint64 crtime;
+		quint64 mtime;
+	};
+
+	quint32 flags;
+	QByteArray data;
+	QMap<QByteArray, Attachment> attachments;
+	QList<QByteArray> parents;
+	quint64 crtime;
+	quint64 mtime;
+	QByteArray typeCode;
+	QByteArray creatorCode;
+	QByteArray comment;
+};
+
+struct MockStore {
+	QByteArray sid;
+	QString label;
+	QString src;
+	QHash<QByteArray, QByteArray> docs;
+	QHash<QByteArray, QList<QByteArray> > preRevs;
+	QHash<QByteArray, MockRevision> revs;
+};
+
+struct MockHandle {
+	QByteArray store;
+	QByteArray doc;
+	QByteArray rev;
+	QByteArray resumed;
+	bool writable;
+	MockRevision work;
+	QMap<QByteArray, QByteArray> buffers;
+};
+
+/*
+ * The state of the daemon. Shared by all sessions, which all live in the
+ * thread of the daemon. Hence no locking is needed.
+ */
+class MockState
+{
+public:
+	MockState(const MockOptions &options);
+	~MockState();
+
+	void addSession(MockSession *session);
+	void delSession(MockSession *session);
+
+	// returns an ErrorCode plus one, or zero if the request succeeded
+	int handle(MockSession *session, int msg, const QByteArray &req,
+		QByteArray *cnf);
+
+private:
+	typedef int (MockState::*Handler)(MockSession *, const QByteArray &,
+		QByteArray *);
+
+	int doEnum(MockSession *, const QByteArray &, QByteArray *);
+	int doLookupDoc(MockSession *, const QByteArray &, QByteArray *);
+	int doLookupRev(MockSession *, const QByteArray &, QByteArray *);
+	int doStat(MockSession *, const QByteArray &, QByteArray *);
+	int doGetLinks(MockSession *, const QByteArray &, QByteArray *);
+	int doPeek(MockSession *, const QByteArray &, QByteArray *);
+	int doCreate(MockSession *, const QByteArray &, QByteArray *);
+	int doFork(MockSession *, const QByteArray &, QByteArray *);
+	int doUpdate(MockSession *, const QByteArray &, QByteArray *);
+	int doResume(MockSession *, const QByteArray &, QByteArray *);
+	int doRead(MockSession *, const QByteArray &, QByteArray *);
+	int doTrunc(MockSession *, const QByteArray &, QByteArray *);
+	int doWriteBuffer(MockSession *, const QByteArray &, QByteArray *);
+	int doWriteCommit(MockSession *, const QByteArray &, QByteArray *);
+	int doFStat(MockSession *, const QByteArray &, QByteArray *);
+	int doGetData(MockSession *, const QByteArray &, QByteArray *);
+	int doSetData(MockSession *, const QByteArray &, QByteArray *);
+	int doSetFlags(MockSession *, const QByteArray &, QByteArray *);
+	int doSetType(MockSession *, const QByteArray &, QByteArray *);
+	int doSetMTime(MockSession *, const QByteArray &, QByteArray *);
+	int doMerge(MockSession *, const QByteArray &, QByteArray *);
+	int doRebase(MockSession *, const QByteArray &, QByteArray *);
+	int doCommit(MockSession *, const QByteArray &, QByteArray *);
+	int doSuspend(MockSession *, const QByteArray &, QByteArray *);
+	int doClose(MockSession *, const QByteArray &, QByteArray *);
+	int doWatchAdd(MockSession *, const QByteArray &, QByteArray *);
+	int doWatchRem(MockSession *, const QByteArray &, QByteArray *);
+	int doWatchProgress(MockSession *, const QByteArray &, QByteArray *);
+	int doForget(MockSession *, const QByteArray &, QByteArray *);
+	int doDeleteDoc(MockSession *, const QByteArray &, QByteArray *);
+	int doDeleteRev(MockSession *, const QByteArray &, QByteArray *);
+	int doForwardDoc(MockSession *, const QByteArray &, QByteArray *);
+	int doReplicateDoc(MockSession *, const QByteArray &, QByteArray *);
+	int doReplicateRev(MockSession *, const QByteArray &, QByteArray *);
+	int doMount(MockSession *, const QByteArray &, QByteArray *);
+	int doUnmount(MockSession *, const QByteArray &, QByteArray *);
+	int doGetPath(MockSession *, const QByteArray &, QByteArray *);
+	int doProgressStart(MockSession *, const QByteArray &, QByteArray *);
+	int doProgressEnd(MockSession *, const QByteArray &, QByteArray *);
+	int doProgressQuery(MockSession *, const QByteArray &, QByteArray *);
+	int doWalkPath(MockSession *, const QByteArray &, QByteArray *);
+
+	MockStore *mount(const QString &label);
+	MockStore *findStore(const QByteArray &sid);
+	QList<MockStore*> selectStores(const QList<QByteArray> &sids);
+	const MockRevision *findRev(const QList<MockStore*> &stores,
+		const QByteArray &rev);
+	MockHandle *findHandle(quint32 handle, bool write = false);
+	quint32 openHandle(MockStore *store, const QByteArray &doc,
+		const QByteArray &rev, const MockRevision &work, bool writable);
+	QByteArray commitRev(MockStore *store, const MockRevision &rev);
+	bool copyRevs(MockStore *src, MockStore *dst, const QByteArray &rev);
+	QByteArray newId();
+	void notify(int event, bool isRev, const QByteArray &store,
+		const QByteArray &element);
+
+	static quint64 now();
+
+	const MockOptions &m_options;
+	Handler m_handlers[64];
+	QList<MockStore*> m_stores;
+	MockStore *m_sysStore;
+	QHash<quint32, MockHandle> m_handles;
+	quint32 m_nextHandle;
+	quint32 m_nextId;
+	QList<MockSession*> m_sessions;
+};
+
+class MockSession : public QObject
+{
+	Q_OBJECT
+
+public:
+	MockSession(QIODevice *socket, MockState *state, const MockOptions &options);
+	~MockSession();
+
+	QSet<QByteArray> docWatches;
+	QSet<QByteArray> revWatches;
+
+	void indicate(int msg, const QByteArray &body);
+
+private slots:
+	void readyRead();
+	void sendDue();
+
+private:
+	struct Pending {
+		qint64 due;
+		QByteArray frame;
+	};
+
+	void handle(quint32 ref, int msg, const QByteArray &body);
+	void send(quint32 ref, int msg, int flag, const QByteArray &body,
+		qint64 ready);
+	qint64 transfer(qint64 *linkFree, qint64 start, int size) const;
+	qint64 latency() const;
+	qint64 now() const { return m_clock.nsecsElapsed() / 1000; }
+
+	QIODevice *m_socket;
+	MockState *m_state;
+	const MockOptions &m_options;
+	QByteArray m_buf;
+	bool m_large;
+	QList<Pending> m_pending;
+	QTimer m_timer;
+	QElapsedTimer m_clock;
+	qint64 m_upFree;
+	qint64 m_downFree;
+};
+
+class MockAcceptor : public QObject
+{
+	Q_OBJECT
+
+public:
+	MockAcceptor(QObject *server, MockState *state, const MockOptions &options);
+
+private slots:
+	void newConnection();
+
+private:
+	MockState *m_state;
+	const MockOptions &m_options;
+};
+
+#endif
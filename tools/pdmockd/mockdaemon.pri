@@ -0,0 +1,11 @@
+#
+# The mock daemon can be linked into other programs to run it in-process:
+#
+# include(../tools/pdmockd/mockdaemon.pri)
+#
+
+INCLUDEPATH += $$PWD
+DEPENDPATH += $$PWD
+
+SOURCES += $$PWD/mockdaemon.cpp
+HEADERS += $$PWD/mockdaemon.h
@@ -0,0 +1,12 @@
+include(../../global.pri)
+
+TEMPLATE = app
+CONFIG += console
+QT = core network
+
+TARGET = pdmockd
+
+SOURCES += main.cpp
+include(mockdaemon.pri)
+
+LIBS += -lprotobuf
@@ -0,0 +1,196 @@
+/*
+ * PeerDrive
+ * Copyright (C) 2013  Jan Klötzke <jan DOT kloetzke AT freenet DOT de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QCoreApplication>
+#include <QDataStream>
+#include <QDateTime>
+#include <QFile>
+#include <QStringList>
+#include <QtEndian>
+#include <iostream>
+
+#include <peerdrive-qt/peerdrive_internal.h>
+
+using namespace PeerDrive;
+
+static const char *help =
+	"PeerDrive flight recorder decoder\n"
+	"\n"
+	"USAGE: pdrecorder DUMPFILE\n"
+	"\n"
+	"Prints the frames of a dump that was written by dumpFlightRecorder() or\n"
+	"after a connection broke while $PEERDRIVE_RECORDER was set. Payloads are\n"
+	"shown as protocol buffer fields (see peerdrive_client.proto). Truncated\n"
+	"payloads end with '...'.\n";
+
+static const char *flagNames[] = { "REQ", "CNF", "IND", "RSP" };
+
+static bool readVarint(const uchar *&p, const uchar *end, quint64 &value)
+{
+	value = 0;
+	for (int shift = 0; p < end && shift < 64; shift += 7) {
+		uchar b = *p++;
+		value |= (quint64)(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return true;
+	}
+
+	return false;
+}
+
+static QString formatBytes(const uchar *data, int len)
+{
+	bool printable = len > 0;
+	for (int i = 0; i < len && printable; i++)
+		printable = data[i] >= 0x20 && data[i] < 0x7f;
+
+	QByteArray bytes((const char *)data, len);
+	if (printable)
+		return QString("\"%1\"").arg(QString::fromLatin1(bytes));
+	else
+		return bytes.toHex();
+}
+
+/*
+ * The LITE runtime has no reflection. Hence the fields are decoded from the
+ * wire format and shown by their number.
+ */
+static QString decodeFields(const uchar *p, int len, bool truncated)
+{
+	const uchar *end = p + len;
+	QStringList fields;
+
+	while (p < end) {
+		quint64 key, value;
+		if (!readVarint(p, end, key))
+			break;
+
+		int field = key >> 3;
+		switch (key & 7) {
+			case 0:
+				if (!readVarint(p, end, value))
+					goto out;
+				fields << QString("%1=%2").arg(field).arg(value);
+				break;
+			case 1:
+				if (end - p < 8)
+					goto out;
+				fields << QString("%1=%2").arg(field).arg(qFromLittleEndian<quint64>(p));
+				p += 8;
+				break;
+			case 2: {
+				if (!readVarint(p, end, value))
+					goto out;
+				int avail = qMin<quint64>(value, end - p);
+				fields << QString("%1=%2%3").arg(QString::number(field),
+					formatBytes(p, avail), (quint64)avail < value ? "..." : "");
+				p += avail;
+				if ((quint64)avail < value)
+					return fields.join(" ");
+				break;
+			}
+			case 5:
+				if (end - p < 4)
+					goto out;
+				fields << QString("%1=%2").arg(field).arg(qFromLittleEndian<quint32>(p));
+				p += 4;
+				break;
+			default:
+				goto out;
+		}
+	}
+
+out:
+	if (p < end || truncated)
+		fields << "...";
+
+	return fields.join(" ");
+}
+
+int main(int argc, char** argv)
+{
+	QCoreApplication app(argc, argv);
+	QStringList arguments(QCoreApplication::arguments());
+
+	if (arguments.size() != 2) {
+		std::cerr << help;
+		return 1;
+	}
+
+	if (arguments.at(1) == "--help" || arguments.at(1) == "-h") {
+		std::cout << help;
+		return 0;
+	}
+
+	QFile file(arguments.at(1));
+	if (!file.open(QIODevice::ReadOnly)) {
+		std::cerr << "cannot open " << qPrintable(arguments.at(1)) << "\n";
+		return 2;
+	}
+
+	QDataStream in(&file);
+	quint32 magic, count;
+	quint16 version;
+	qint64 start;
+
+	in >> magic >> version >> start >> count;
+	if (magic != FlightRecorder::Magic || version != FlightRecorder::Version) {
+		std::cerr << "not a flight recorder dump\n";
+		return 2;
+	}
+
+	std::cout << "recording started "
+	          << qPrintable(QDateTime::fromMSecsSinceEpoch(start).toString(Qt::ISODate))
+	          << ", " << count << " frames\n";
+
+	while (count--) {
+		FlightRecorder::Entry e;
+
+		in >> e.time >> e.ref >> e.length >> e.msg >> e.dir >> e.captured;
+		if (in.readRawData(e.payload, e.captured) != e.captured ||
+		    in.status() != QDataStream::Ok) {
+			std::cerr << "truncated dump\n";
+			return 2;
+		}
+
+		int msg = e.msg >> 4;
+		int flag = e.msg & 3;
+		const uchar *payload = (const uchar *)e.payload;
+		QString fields;
+
+		// the only confirmation whose meaning does not depend on the request
+		ErrorCnf err;
+		if (msg == ERROR_MSG && e.captured == e.length &&
+		    err.ParseFromArray(payload, e.captured))
+			fields = QString("error=%1").arg(err.error() + 1);
+		else
+			fields = decodeFields(payload, e.captured, e.captured < e.length);
+
+		std::cout << qPrintable(QString("%1.%2 %3 %4 %5 ref=%6 len=%7 %8")
+			.arg(e.time / 1000000, 4)
+			.arg(e.time % 1000000, 6, 10, QChar('0'))
+			.arg(e.dir == FlightRecorder::DirSent ? '>' : '<')
+			.arg(flagNames[flag])
+			.arg(messageName(msg), -18)
+			.arg(e.ref)
+			.arg(e.length)
+			.arg(fields)) << "\n";
+	}
+
+	return 0;
+}
@@ -0,0 +1,11 @@
+include(../../global.pri)
+
+TEMPLATE = app
+CONFIG += console
+QT = core network
+
+TARGET = pdrecorder
+
+SOURCES += main.cpp
+
+LIBS += -lprotobuf
@@ -0,0 +1,125 @@
+/*
+ * PeerDrive
+ * Copyright (C) 2013  Jan Klötzke <jan DOT kloetzke AT freenet DOT de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QDataStream>
+#include <QFile>
+#include <iostream>
+
+#include <peerdrive-qt/peerdrive_internal.h>
+
+#include "capture.h"
+
+using namespace PeerDrive;
+
+bool Capture::load(const QString &fileName)
+{
+	QFile file(fileName);
+	if (!file.open(QIODevice::ReadOnly)) {
+		std::cerr << "cannot open " << qPrintable(fileName) << "\n";
+		return false;
+	}
+
+	QDataStream in(&file);
+	qint64 start;
+	if (!FrameCapture::readHeader(in, &start)) {
+		std::cerr << "not a capture file: " << qPrintable(fileName) << "\n";
+		return false;
+	}
+
+	QHash<quint32, int> pending;
+	QVector<bool> confirmed;
+	FrameCapture::Record rec;
+
+	while (!in.atEnd() && FrameCapture::read(in, &rec)) {
+		int flag = rec.msg & 3;
+
+		if (rec.dir == FlightRecorder::DirSent && flag == FLAG_REQ) {
+			Exchange e;
+			e.msg = rec.msg >> 4;
+			e.req = rec.payload;
+			e.cnfMsg = -1;
+			e.sent = rec.time;
+			e.latency = 0;
+			pending.insert(rec.ref, m_exchanges.size());
+			m_exchanges.append(e);
+			confirmed.append(false);
+		} else if (rec.dir == FlightRecorder::DirReceived && flag == FLAG_CNF) {
+			QHash<quint32, int>::iterator it = pending.find(rec.ref);
+			if (it == pending.end())
+				continue;
+
+			int i = it.value();
+			pending.erase(it);
+			Exchange &e = m_exchanges[i];
+			e.cnfMsg = rec.msg >> 4;
+			e.cnf = rec.payload;
+			e.latency = rec.time - e.sent;
+			confirmed[i] = true;
+		}
+	}
+
+	// forget about requests that never got an answer
+	QVector<Exchange> exchanges;
+	for (int i = 0; i < m_exchanges.size(); i++)
+		if (confirmed[i])
+			exchanges.append(m_exchanges[i]);
+	m_exchanges = exchanges;
+
+	m_used.fill(false, m_exchanges.size());
+	for (int i = 0; i < m_exchanges.size(); i++) {
+		const Exchange &e = m_exchanges[i];
+		m_byPayload[qMakePair(e.msg, e.req)].append(i);
+		m_byMsg[e.msg].append(i);
+	}
+
+	return true;
+}
+
+const Exchange *Capture::initExchange() const
+{
+	for (int i = 0; i < m_exchanges.size(); i++)
+		if (m_exchanges[i].msg == INIT_MSG)
+			return &m_exchanges[i];
+
+	return NULL;
+}
+
+const Exchange *Capture::answer(int msg, const QByteArray &req)
+{
+	QMutexLocker locker(&m_mutex);
+
+	QList<int> &same = m_byPayload[qMakePair(msg, req)];
+	while (!same.isEmpty()) {
+		int i = same.takeFirst();
+		if (!m_used[i]) {
+			m_used[i] = true;
+			return &m_exchanges[i];
+		}
+	}
+
+	QList<int> &similar = m_byMsg[msg];
+	while (!similar.isEmpty()) {
+		int i = similar.takeFirst();
+		if (!m_used[i]) {
+			m_used[i] = true;
+			return &m_exchanges[i];
+		}
+	}
+
+	return NULL;
+}
@@ -0,0 +1,70 @@
+/*
+ * PeerDrive
+ * Copyright (C) 2013  Jan Klötzke <jan DOT kloetzke AT freenet DOT de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef REPLAY_CAPTURE_H
+#define REPLAY_CAPTURE_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QPair>
+#include <QString>
+#include <QVector>
+
+/*
+ * A request of the capture together with its confirmation. Times are in
+ * microseconds since the capture was started.
+ */
+struct Exchange {
+	int msg;
+	QByteArray req;
+	int cnfMsg;
+	QByteArray cnf;
+	qint64 sent;
+	qint64 latency;
+};
+
+/*
+ * All exchanges of a capture file in the order the requests were sent.
+ * Requests that were never confirmed are dropped, indications are ignored.
+ */
+class Capture
+{
+public:
+	bool load(const QString &fileName);
+
+	const QVector<Exchange> &exchanges() const { return m_exchanges; }
+	const Exchange *initExchange() const;
+
+	/*
+	 * Finds the confirmation for a request. Preferably a request with the
+	 * same payload is taken, otherwise the next one of the same type. Every
+	 * exchange is only used once. Thread safe.
+	 */
+	const Exchange *answer(int msg, const QByteArray &req);
+
+private:
+	QVector<Exchange> m_exchanges;
+	QVector<bool> m_used;
+	QHash<QPair<int, QByteArray>, QList<int> > m_byPayload;
+	QHash<int, QList<int> > m_byMsg;
+	QMutex m_mutex;
+};
+
+#endif
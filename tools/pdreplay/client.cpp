@@ -0,0 +1,143 @@
+/*
+ * PeerDrive
+ * Copyright (C) 2013  Jan Klötzke <jan DOT kloetzke AT freenet DOT de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QElapsedTimer>
+#include <QMap>
+#include <QThread>
+#include <iostream>
+#include <iomanip>
+
+#include <peerdrive-qt/peerdrive_internal.h>
+
+#include "capture.h"
+#include "client.h"
+
+using namespace PeerDrive;
+
+struct Outstanding {
+	int index;
+	PendingReply *reply;
+	qint64 sent;
+};
+
+struct MsgStats {
+	MsgStats() : count(0), captured(0), replayed(0), errors(0), mismatches(0) { }
+
+	int count;
+	qint64 captured;
+	qint64 replayed;
+	int errors;
+	int mismatches;
+};
+
+int replayClient(const Capture &capture, double speed)
+{
+	Connection *conn = Connection::instance();
+	if (!conn->waitForReady()) {
+		std::cerr << "server not reachable\n";
+		return 2;
+	}
+
+	const QVector<Exchange> &exchanges = capture.exchanges();
+	QList<Outstanding> outstanding;
+	QMap<int, MsgStats> stats;
+	qint64 base = exchanges.isEmpty() ? 0 : exchanges.first().sent;
+	int next = 0;
+
+	QElapsedTimer clock;
+	clock.start();
+
+	while (next < exchanges.size() || !outstanding.isEmpty()) {
+		qint64 now = clock.nsecsElapsed() / 1000;
+		bool idle = true;
+
+		// send everything that is due, the library did the INIT already
+		while (next < exchanges.size()) {
+			const Exchange &e = exchanges.at(next);
+			if (e.msg != INIT_MSG) {
+				if (speed > 0 && (e.sent - base) / speed > now)
+					break;
+
+				Outstanding o;
+				o.index = next;
+				o.reply = conn->rpcAsync(e.msg, e.req);
+				o.sent = now;
+				outstanding.append(o);
+			}
+			next++;
+			idle = false;
+		}
+
+		QList<Outstanding>::iterator it = outstanding.begin();
+		while (it != outstanding.end()) {
+			if (!it->reply->isFinished()) {
+				++it;
+				continue;
+			}
+
+			const Exchange &e = exchanges.at(it->index);
+			MsgStats &s = stats[e.msg];
+			Error err = it->reply->wait();
+			bool capturedErr = e.cnfMsg == ERROR_MSG;
+
+			s.count++;
+			s.captured += e.latency;
+			s.replayed += clock.nsecsElapsed() / 1000 - it->sent;
+			if (err)
+				s.errors++;
+			if ((err != ErrNoError) != capturedErr ||
+			    (!err && it->reply->confirmation().toByteArray() != e.cnf))
+				s.mismatches++;
+
+			delete it->reply;
+			it = outstanding.erase(it);
+			idle = false;
+		}
+
+		if (idle)
+			QThread::yieldCurrentThread();
+	}
+
+	qint64 wall = clock.nsecsElapsed() / 1000;
+	qint64 original = exchanges.isEmpty() ? 0 :
+		exchanges.last().sent + exchanges.last().latency - base;
+
+	std::cout << std::left << std::setw(20) << "message" << std::right
+	          << std::setw(8) << "count" << std::setw(14) << "capture [us]"
+	          << std::setw(14) << "replay [us]" << std::setw(8) << "errors"
+	          << std::setw(12) << "mismatches" << "\n";
+
+	int mismatches = 0;
+	QMapIterator<int, MsgStats> i(stats);
+	while (i.hasNext()) {
+		i.next();
+		const MsgStats &s = i.value();
+		std::cout << std::left << std::setw(20) << messageName(i.key()) << std::right
+		          << std::setw(8) << s.count
+		          << std::setw(14) << s.captured / s.count
+		          << std::setw(14) << s.replayed / s.count
+		          << std::setw(8) << s.errors
+		          << std::setw(12) << s.mismatches << "\n";
+		mismatches += s.mismatches;
+	}
+
+	std::cout << "duration: capture " << original / 1000 << " ms, replay "
+	          << wall / 1000 << " ms\n";
+
+	return mismatches ? 1 : 0;
+}
@@ -0,0 +1,32 @@
+/*
+ * PeerDrive
+ * Copyright (C) 2013  Jan Klötzke <jan DOT kloetzke AT freenet DOT de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef REPLAY_CLIENT_H
+#define REPLAY_CLIENT_H
+
+class Capture;
+
+/*
+ * Sends the requests of the capture through the PeerDrive library to the
+ * server in $PEERDRIVE. With a speed above zero the original timing is kept,
+ * scaled by the speed. A speed of zero sends everything as fast as possible.
+ * Prints the latency per message type compared to the capture.
+ */
+int replayClient(const Capture &capture, double speed);
+
+#endif
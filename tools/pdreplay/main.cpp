@@ -0,0 +1,82 @@
+/*
+ * PeerDrive
+ * Copyright (C) 2013  Jan Klötzke <jan DOT kloetzke AT freenet DOT de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QCoreApplication>
+#include <QStringList>
+#include <iostream>
+
+#include "capture.h"
+#include "client.h"
+#include "server.h"
+
+static const char *help =
+	"PeerDrive capture replay\n"
+	"\n"
+	"USAGE: pdreplay MODE CAPTURE [SPEED] [PORT]\n"
+	"\n"
+	"Modes:\n"
+	"    server CAPTURE [SPEED] [PORT]  Fake daemon answering from the capture\n"
+	"    client CAPTURE [SPEED]         Replay the requests against $PEERDRIVE\n"
+	"    run CAPTURE [SPEED]            Replay the requests against a fake daemon\n"
+	"\n"
+	"Captures are written by the library if $PEERDRIVE_CAPTURE is set to a file\n"
+	"name. SPEED scales the original timing, e.g. 2 replays twice as fast. With\n"
+	"0, the default, everything happens as fast as possible.\n";
+
+int main(int argc, char** argv)
+{
+	QCoreApplication app(argc, argv);
+	QStringList arguments(QCoreApplication::arguments());
+
+	if (arguments.size() >= 2 &&
+	    (arguments.at(1) == "--help" || arguments.at(1) == "-h")) {
+		std::cout << help;
+		return 0;
+	}
+
+	if (arguments.size() < 3) {
+		std::cerr << help;
+		return 1;
+	}
+
+	QString mode = arguments.at(1);
+	double speed = arguments.size() > 3 ? arguments.at(3).toDouble() : 0;
+
+	Capture capture;
+	if (!capture.load(arguments.at(2)))
+		return 2;
+
+	if (mode == "server") {
+		quint16 port = arguments.size() > 4 ? arguments.at(4).toUShort() : 0;
+		ReplayServer server(&capture, speed, port);
+		std::cout << "PEERDRIVE=" << qPrintable(server.address()) << "\n";
+		return app.exec();
+	} else if (mode == "client") {
+		return replayClient(capture, speed);
+	} else if (mode == "run") {
+		ReplayServer server(&capture, speed);
+		qputenv("PEERDRIVE", server.address().toLatin1());
+		int ret = replayClient(capture, speed);
+		if (server.misses())
+			std::cout << server.misses() << " requests not in capture\n";
+		return ret;
+	}
+
+	std::cerr << help;
+	return 1;
+}
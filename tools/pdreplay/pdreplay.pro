@@ -0,0 +1,15 @@
+include(../../global.pri)
+
+TEMPLATE = app
+CONFIG += console
+QT = core network
+
+TARGET = pdreplay
+
+SOURCES += main.cpp
+SOURCES += capture.cpp
+SOURCES += client.cpp
+SOURCES += server.cpp
+HEADERS += capture.h client.h server.h
+
+LIBS += -lprotobuf
@@ -0,0 +1,226 @@
+/*
+ * PeerDrive
+ * Copyright (C) 2013  Jan Klötzke <jan DOT kloetzke AT freenet DOT de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QtEndian>
+
+#include <peerdrive-qt/peerdrive_internal.h>
+
+#include "capture.h"
+#include "server.h"
+
+using namespace PeerDrive;
+
+ReplayServer::ReplayServer(Capture *capture, double speed, quint16 port,
+	QObject *parent)
+	: QThread(parent)
+	, m_capture(capture)
+	, m_speed(speed)
+	, m_port(port)
+	, m_misses(0)
+{
+	QMutexLocker locker(&m_startupMutex);
+
+	start();
+	m_startupDone.wait(&m_startupMutex);
+}
+
+ReplayServer::~ReplayServer()
+{
+	exit();
+	wait();
+}
+
+QString ReplayServer::address() const
+{
+	return QString("tcp://127.0.0.1:%1/00").arg(m_port);
+}
+
+void ReplayServer::run()
+{
+	QTcpServer server;
+
+	connect(&server, SIGNAL(newConnection()), this, SLOT(newConnection()),
+		Qt::DirectConnection);
+	if (!server.listen(QHostAddress::LocalHost, m_port))
+		qDebug() << "pdreplay: cannot listen:" << server.errorString();
+
+	m_startupMutex.lock();
+	m_port = server.serverPort();
+	m_startupDone.wakeAll();
+	m_startupMutex.unlock();
+
+	exec();
+}
+
+void ReplayServer::newConnection()
+{
+	QTcpServer *server = qobject_cast<QTcpServer*>(sender());
+
+	while (server->hasPendingConnections()) {
+		QTcpSocket *socket = server->nextPendingConnection();
+		socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+		new ReplaySession(socket, this);
+	}
+}
+
+ReplaySession::ReplaySession(QIODevice *socket, ReplayServer *server)
+	: QObject(socket)
+	, m_socket(socket)
+	, m_server(server)
+	, m_large(false)
+{
+	m_timer.setSingleShot(true);
+	m_clock.start();
+
+	connect(socket, SIGNAL(readyRead()), this, SLOT(readyRead()));
+	connect(socket, SIGNAL(disconnected()), socket, SLOT(deleteLater()));
+	connect(&m_timer, SIGNAL(timeout()), this, SLOT(sendDue()));
+}
+
+void ReplaySession::readyRead()
+{
+	m_buf.append(m_socket->readAll());
+
+	int pos = 0;
+	while (m_buf.size() - pos > 2) {
+		const uchar *frame = (const uchar *)m_buf.constData() + pos;
+		int header = 2;
+		int expect;
+
+		if (m_large && (*frame & 0x80)) {
+			if (m_buf.size() - pos < 4)
+				break;
+			header = 4;
+			expect = qFromBigEndian<quint32>(frame) & ~FRAME_LARGE;
+		} else
+			expect = qFromBigEndian<quint16>(frame);
+
+		if (pos + expect + header > m_buf.size())
+			break;
+
+		quint32 ref = qFromBigEndian<quint32>(frame + header);
+		quint16 msg = qFromBigEndian<quint16>(frame + header + 4);
+		if ((msg & 3) == FLAG_REQ)
+			handle(ref, msg >> 4, m_buf.mid(pos + header + 6, expect - 6));
+
+		pos += expect + header;
+	}
+
+	m_buf.remove(0, pos);
+}
+
+template <typename C>
+static QByteArray serialize(const C &cnf)
+{
+	QByteArray raw;
+	raw.resize(cnf.ByteSize());
+	cnf.SerializeWithCachedSizesToArray((google::protobuf::uint8*)raw.data());
+	return raw;
+}
+
+void ReplaySession::handle(quint32 ref, int msg, const QByteArray &body)
+{
+	if (msg == INIT_MSG) {
+		// Answer with the parameters of the captured daemon. The cookie is
+		// not checked.
+		InitReq req;
+		req.ParseFromArray(body.constData(), body.size());
+
+		InitCnf cnf;
+		const Exchange *init = m_server->m_capture->initExchange();
+		if (!init || !cnf.ParseFromArray(init->cnf.constData(), init->cnf.size())) {
+			cnf.set_major(2);
+			cnf.set_minor(0);
+			cnf.set_max_packet_size(16384);
+		}
+		cnf.set_large_frames(req.large_frames());
+		send(ref, msg, serialize(cnf));
+
+		// switch after the confirmation went out in the old format
+		m_large = cnf.large_frames();
+		return;
+	}
+
+	const Exchange *e = m_server->m_capture->answer(msg, body);
+	if (!e) {
+		qDebug() << "pdreplay: not in capture:" << messageName(msg);
+		m_server->m_misses++;
+
+		ErrorCnf cnf;
+		cnf.set_error(ERR_ENOSYS);
+		send(ref, ERROR_MSG, serialize(cnf));
+		return;
+	}
+
+	if (m_server->m_speed > 0)
+		schedule(e->latency / m_server->m_speed, ref, e->cnfMsg, e->cnf);
+	else
+		send(ref, e->cnfMsg, e->cnf);
+}
+
+void ReplaySession::schedule(qint64 delay, quint32 ref, int msg,
+	const QByteArray &body)
+{
+	Pending p;
+	p.due = m_clock.nsecsElapsed() / 1000 + delay;
+	p.ref = ref;
+	p.msg = msg;
+	p.body = body;
+
+	int i = m_pending.size();
+	while (i > 0 && m_pending.at(i-1).due > p.due)
+		i--;
+	m_pending.insert(i, p);
+
+	if (i == 0)
+		m_timer.start(qMax<qint64>(0, delay / 1000));
+}
+
+void ReplaySession::sendDue()
+{
+	qint64 now = m_clock.nsecsElapsed() / 1000;
+
+	while (!m_pending.isEmpty() && m_pending.first().due <= now) {
+		Pending p = m_pending.takeFirst();
+		send(p.ref, p.msg, p.body);
+	}
+
+	if (!m_pending.isEmpty())
+		m_timer.start(qMax<qint64>(0, (m_pending.first().due - now) / 1000));
+}
+
+void ReplaySession::send(quint32 ref, int msg, const QByteArray &body)
+{
+	int len = 6 + body.size();
+	uchar header[10];
+	int offset = 0;
+
+	if (m_large && len > FRAME_SHORT_MAX) {
+		qToBigEndian((quint32)(FRAME_LARGE | len), header);
+	} else {
+		offset = 2;
+		qToBigEndian((quint16)len, header + 2);
+	}
+	qToBigEndian((quint32)ref, header + 4);
+	qToBigEndian((quint16)((msg << 4) | FLAG_CNF), header + 8);
+
+	m_socket->write((const char *)header + offset, 10 - offset);
+	m_socket->write(body);
+}
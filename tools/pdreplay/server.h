@@ -0,0 +1,100 @@
+/*
+ * PeerDrive
+ * Copyright (C) 2013  Jan Klötzke <jan DOT kloetzke AT freenet DOT de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef REPLAY_SERVER_H
+#define REPLAY_SERVER_H
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QList>
+#include <QMutex>
+#include <QThread>
+#include <QTimer>
+#include <QWaitCondition>
+
+class QIODevice;
+class Capture;
+
+/*
+ * Fake daemon that answers requests with the confirmations of a capture.
+ * With a speed above zero every confirmation is delayed by the service time
+ * of the daemon in the capture divided by the speed. Requests that are not
+ * in the capture are answered with ENOSYS. Runs in its own thread.
+ */
+class ReplayServer : public QThread
+{
+	Q_OBJECT
+
+public:
+	ReplayServer(Capture *capture, double speed, quint16 port = 0,
+		QObject *parent = NULL);
+	~ReplayServer();
+
+	QString address() const;
+	int misses() const { return m_misses; }
+
+protected:
+	void run();
+
+private slots:
+	void newConnection();
+
+private:
+	Capture *m_capture;
+	double m_speed;
+	quint16 m_port;
+	volatile int m_misses;
+	friend class ReplaySession;
+
+	QMutex m_startupMutex;
+	QWaitCondition m_startupDone;
+};
+
+class ReplaySession : public QObject
+{
+	Q_OBJECT
+
+public:
+	ReplaySession(QIODevice *socket, ReplayServer *server);
+
+private slots:
+	void readyRead();
+	void sendDue();
+
+private:
+	struct Pending {
+		qint64 due;
+		quint32 ref;
+		int msg;
+		QByteArray body;
+	};
+
+	void handle(quint32 ref, int msg, const QByteArray &body);
+	void schedule(qint64 delay, quint32 ref, int msg, const QByteArray &body);
+	void send(quint32 ref, int msg, const QByteArray &body);
+
+	QIODevice *m_socket;
+	ReplayServer *m_server;
+	QByteArray m_buf;
+	bool m_large;
+	QList<Pending> m_pending;
+	QTimer m_timer;
+	QElapsedTimer m_clock;
+};
+
+#endif